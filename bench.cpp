@@ -0,0 +1,60 @@
+//
+// Project: cliblisp
+// Created by bajdcc
+//
+
+// 基准：对10万个元素的列表做map，堆由VM_MEM放大（见CMakeLists.txt中的cliblisp-bench）
+// 用法：cliblisp-bench [轮数]
+
+#include <iostream>
+#include <sstream>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include "cparser.h"
+#include "cvm.h"
+#include "cexception.h"
+
+int main(int argc, char *argv[]) {
+    using clock = std::chrono::steady_clock;
+    auto rounds = argc > 1 ? std::max(1, atoi(argv[1])) : 10;
+    auto codes = {
+            R"(len (map (\ `x `(+ x 1)) (iota 100000)))",
+            R"(len (filter (\ `x `(> x 50000)) (iota 100000)))",
+            R"(foldl + 0 (map (\ `x `(* x 2)) (iota 100000)))",
+    };
+    auto vm = std::make_unique<clib::cvm>();
+    std::stringstream ss;
+    int cycles = 0;
+    for (auto &code : codes) {
+        long long best = -1, total = 0;
+        std::string out;
+        for (auto k = 0; k < rounds; k++) {
+            auto t0 = clock::now();
+            vm->save();
+            try {
+                clib::cparser p;
+                vm->prepare(p.parse(code));
+                clib::cval *val;
+                while ((val = vm->run(INT32_MAX, cycles)) == nullptr) {
+                    if (!vm->wait())
+                        std::this_thread::yield();
+                }
+                ss.str("");
+                clib::cvm::print(val, ss);
+                out = ss.str();
+            } catch (const clib::cexception &e) {
+                out = e.msg;
+                vm->restore();
+            }
+            vm->gc();
+            auto us = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - t0).count();
+            total += us;
+            if (best < 0 || us < best)
+                best = us;
+        }
+        std::cout << code << "  =>  " << out << "  [best " << best << "us, avg " << total / rounds << "us, heap "
+                  << vm->heap_used() << " bytes]" << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,744 @@
+//
+// Project: cliblisp
+// Created by bajdcc
+//
+
+#include <cstdlib>
+#include <cassert>
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include "carray.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define ARRAY_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#else
+#define ARRAY_X86 0
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+namespace clib {
+
+    carray *carray::create(array_t type, size_t size) {
+        // 表头与数据一次分配，数据按ARRAY_ALIGN对齐
+        auto mem = (char *) std::malloc(sizeof(carray) + ARRAY_ALIGN + size * sizeof(double));
+        assert(mem);
+        auto arr = (carray *) mem;
+        auto data = (uintptr_t) (mem + sizeof(carray));
+        data = (data + ARRAY_ALIGN - 1) & ~(uintptr_t) (ARRAY_ALIGN - 1);
+        new(&arr->ref) std::atomic<uint>(1);
+        arr->type = type;
+        arr->size = size;
+        arr->data = (void *) data;
+        return arr;
+    }
+
+    carray *carray::retain() {
+        ref++;
+        return this;
+    }
+
+    void carray::release() {
+        assert(ref > 0);
+        if (--ref == 0) {
+            ref.~atomic();
+            std::free(this);
+        }
+    }
+
+    namespace simd {
+
+#define ARITH_SWITCH(k, ...) \
+        switch (op) { \
+            case op_add: k<op_add>(__VA_ARGS__); break; \
+            case op_sub: k<op_sub>(__VA_ARGS__); break; \
+            case op_mul: k<op_mul>(__VA_ARGS__); break; \
+            default: k<op_div>(__VA_ARGS__); break; \
+        }
+
+#define CMP_SWITCH(k, ...) \
+        switch (op) { \
+            case op_eq: k<op_eq>(__VA_ARGS__); break; \
+            case op_ne: k<op_ne>(__VA_ARGS__); break; \
+            case op_lt: k<op_lt>(__VA_ARGS__); break; \
+            case op_le: k<op_le>(__VA_ARGS__); break; \
+            case op_gt: k<op_gt>(__VA_ARGS__); break; \
+            default: k<op_ge>(__VA_ARGS__); break; \
+        }
+
+        template<int op>
+        static inline double f64_op(double a, double b) {
+            switch (op) {
+                case op_add:
+                    return a + b;
+                case op_sub:
+                    return a - b;
+                case op_mul:
+                    return a * b;
+                default:
+                    return a / b;
+            }
+        }
+
+        // 定长整数按补码回绕，与C的无符号运算一致
+        template<int op>
+        static inline slong i64_op(slong a, slong b) {
+            switch (op) {
+                case op_add:
+                    return (slong) ((ulong) a + (ulong) b);
+                case op_sub:
+                    return (slong) ((ulong) a - (ulong) b);
+                case op_mul:
+                    return (slong) ((ulong) a * (ulong) b);
+                default:
+                    return b == -1 ? (slong) (0 - (ulong) a) : a / b;
+            }
+        }
+
+        template<int op, class T>
+        static inline slong cmp_op(T a, T b) {
+            switch (op) {
+                case op_eq:
+                    return a == b;
+                case op_ne:
+                    return a != b;
+                case op_lt:
+                    return a < b;
+                case op_le:
+                    return a <= b;
+                case op_gt:
+                    return a > b;
+                default:
+                    return a >= b;
+            }
+        }
+
+        namespace scalar {
+            template<int op>
+            static void f64_bin(const double *a, size_t sa, const double *b, size_t sb, double *r, size_t n) {
+                for (size_t i = 0; i < n; i++)
+                    r[i] = f64_op<op>(a[i * sa], b[i * sb]);
+            }
+
+            template<int op>
+            static void i64_bin(const slong *a, size_t sa, const slong *b, size_t sb, slong *r, size_t n) {
+                for (size_t i = 0; i < n; i++)
+                    r[i] = i64_op<op>(a[i * sa], b[i * sb]);
+            }
+
+            template<int op, class T>
+            static void cmp(const T *a, size_t sa, const T *b, size_t sb, slong *r, size_t n) {
+                for (size_t i = 0; i < n; i++)
+                    r[i] = cmp_op<op>(a[i * sa], b[i * sb]);
+            }
+
+            template<int op>
+            static void f64_cmp(const double *a, size_t sa, const double *b, size_t sb, slong *r, size_t n) {
+                cmp<op>(a, sa, b, sb, r, n);
+            }
+
+            template<int op>
+            static void i64_cmp(const slong *a, size_t sa, const slong *b, size_t sb, slong *r, size_t n) {
+                cmp<op>(a, sa, b, sb, r, n);
+            }
+
+            static void f64_binary(int op, const double *a, size_t sa, const double *b, size_t sb, double *r, size_t n) {
+                ARITH_SWITCH(f64_bin, a, sa, b, sb, r, n)
+            }
+
+            static void i64_binary(int op, const slong *a, size_t sa, const slong *b, size_t sb, slong *r, size_t n) {
+                ARITH_SWITCH(i64_bin, a, sa, b, sb, r, n)
+            }
+
+            static void f64_compare(int op, const double *a, size_t sa, const double *b, size_t sb, slong *r, size_t n) {
+                CMP_SWITCH(f64_cmp, a, sa, b, sb, r, n)
+            }
+
+            static void i64_compare(int op, const slong *a, size_t sa, const slong *b, size_t sb, slong *r, size_t n) {
+                CMP_SWITCH(i64_cmp, a, sa, b, sb, r, n)
+            }
+
+            static void i64_to_f64(const slong *a, double *r, size_t n) {
+                for (size_t i = 0; i < n; i++)
+                    r[i] = (double) a[i];
+            }
+
+            static double f64_sum(const double *a, size_t n) {
+                double r = 0;
+                for (size_t i = 0; i < n; i++)
+                    r += a[i];
+                return r;
+            }
+
+            static double f64_min(const double *a, size_t n) {
+                auto r = a[0];
+                for (size_t i = 1; i < n; i++)
+                    r = a[i] < r ? a[i] : r;
+                return r;
+            }
+
+            static double f64_max(const double *a, size_t n) {
+                auto r = a[0];
+                for (size_t i = 1; i < n; i++)
+                    r = a[i] > r ? a[i] : r;
+                return r;
+            }
+
+            static double f64_dot(const double *a, const double *b, size_t n) {
+                double r = 0;
+                for (size_t i = 0; i < n; i++)
+                    r += a[i] * b[i];
+                return r;
+            }
+
+            static slong i64_sum(const slong *a, size_t n) {
+                ulong r = 0;
+                for (size_t i = 0; i < n; i++)
+                    r += (ulong) a[i];
+                return (slong) r;
+            }
+
+            static slong i64_min(const slong *a, size_t n) {
+                auto r = a[0];
+                for (size_t i = 1; i < n; i++)
+                    r = a[i] < r ? a[i] : r;
+                return r;
+            }
+
+            static slong i64_max(const slong *a, size_t n) {
+                auto r = a[0];
+                for (size_t i = 1; i < n; i++)
+                    r = a[i] > r ? a[i] : r;
+                return r;
+            }
+
+            static slong i64_dot(const slong *a, const slong *b, size_t n) {
+                ulong r = 0;
+                for (size_t i = 0; i < n; i++)
+                    r += (ulong) a[i] * (ulong) b[i];
+                return (slong) r;
+            }
+        }
+
+#if ARRAY_X86
+        // SSE2是x86-64的基线指令集，无需检测
+        namespace sse2 {
+            using scalar::i64_compare;
+            using scalar::i64_to_f64;
+            using scalar::i64_min;
+            using scalar::i64_max;
+            using scalar::i64_dot;
+
+            template<int op>
+            static inline __m128d f64_vop(__m128d a, __m128d b) {
+                switch (op) {
+                    case op_add:
+                        return _mm_add_pd(a, b);
+                    case op_sub:
+                        return _mm_sub_pd(a, b);
+                    case op_mul:
+                        return _mm_mul_pd(a, b);
+                    default:
+                        return _mm_div_pd(a, b);
+                }
+            }
+
+            template<int op>
+            static inline __m128d f64_vcmp(__m128d a, __m128d b) {
+                switch (op) {
+                    case op_eq:
+                        return _mm_cmpeq_pd(a, b);
+                    case op_ne:
+                        return _mm_cmpneq_pd(a, b);
+                    case op_lt:
+                        return _mm_cmplt_pd(a, b);
+                    case op_le:
+                        return _mm_cmple_pd(a, b);
+                    case op_gt:
+                        return _mm_cmpgt_pd(a, b);
+                    default:
+                        return _mm_cmpge_pd(a, b);
+                }
+            }
+
+            template<int op>
+            static void f64_bin(const double *a, size_t sa, const double *b, size_t sb, double *r, size_t n) {
+                auto ba = _mm_set1_pd(a[0]), bb = _mm_set1_pd(b[0]);
+                size_t i = 0;
+                for (; i + 2 <= n; i += 2) {
+                    auto x = sa ? _mm_loadu_pd(a + i) : ba;
+                    auto y = sb ? _mm_loadu_pd(b + i) : bb;
+                    _mm_storeu_pd(r + i, f64_vop<op>(x, y));
+                }
+                scalar::f64_bin<op>(a + i * sa, sa, b + i * sb, sb, r + i, n - i);
+            }
+
+            template<int op>
+            static void i64_bin(const slong *a, size_t sa, const slong *b, size_t sb, slong *r, size_t n) {
+                auto ba = _mm_set1_epi64x(a[0]), bb = _mm_set1_epi64x(b[0]);
+                size_t i = 0;
+                for (; i + 2 <= n; i += 2) {
+                    auto x = sa ? _mm_loadu_si128((const __m128i *) (a + i)) : ba;
+                    auto y = sb ? _mm_loadu_si128((const __m128i *) (b + i)) : bb;
+                    auto z = op == op_add ? _mm_add_epi64(x, y) : _mm_sub_epi64(x, y);
+                    _mm_storeu_si128((__m128i *) (r + i), z);
+                }
+                scalar::i64_bin<op>(a + i * sa, sa, b + i * sb, sb, r + i, n - i);
+            }
+
+            template<int op>
+            static void f64_cmp(const double *a, size_t sa, const double *b, size_t sb, slong *r, size_t n) {
+                auto ba = _mm_set1_pd(a[0]), bb = _mm_set1_pd(b[0]);
+                auto one = _mm_set1_epi64x(1);
+                size_t i = 0;
+                for (; i + 2 <= n; i += 2) {
+                    auto x = sa ? _mm_loadu_pd(a + i) : ba;
+                    auto y = sb ? _mm_loadu_pd(b + i) : bb;
+                    auto m = _mm_castpd_si128(f64_vcmp<op>(x, y));
+                    _mm_storeu_si128((__m128i *) (r + i), _mm_and_si128(m, one));
+                }
+                scalar::f64_cmp<op>(a + i * sa, sa, b + i * sb, sb, r + i, n - i);
+            }
+
+            static void f64_binary(int op, const double *a, size_t sa, const double *b, size_t sb, double *r, size_t n) {
+                ARITH_SWITCH(f64_bin, a, sa, b, sb, r, n)
+            }
+
+            static void i64_binary(int op, const slong *a, size_t sa, const slong *b, size_t sb, slong *r, size_t n) {
+                if (op == op_add)
+                    i64_bin<op_add>(a, sa, b, sb, r, n);
+                else if (op == op_sub)
+                    i64_bin<op_sub>(a, sa, b, sb, r, n);
+                else
+                    scalar::i64_binary(op, a, sa, b, sb, r, n);
+            }
+
+            static void f64_compare(int op, const double *a, size_t sa, const double *b, size_t sb, slong *r, size_t n) {
+                CMP_SWITCH(f64_cmp, a, sa, b, sb, r, n)
+            }
+
+            static double f64_sum(const double *a, size_t n) {
+                auto s0 = _mm_setzero_pd(), s1 = s0;
+                size_t i = 0;
+                for (; i + 4 <= n; i += 4) {
+                    s0 = _mm_add_pd(s0, _mm_loadu_pd(a + i));
+                    s1 = _mm_add_pd(s1, _mm_loadu_pd(a + i + 2));
+                }
+                double t[2];
+                _mm_storeu_pd(t, _mm_add_pd(s0, s1));
+                return t[0] + t[1] + scalar::f64_sum(a + i, n - i);
+            }
+
+            static double f64_min(const double *a, size_t n) {
+                if (n < 2)
+                    return a[0];
+                auto s = _mm_loadu_pd(a);
+                size_t i = 2;
+                for (; i + 2 <= n; i += 2)
+                    s = _mm_min_pd(s, _mm_loadu_pd(a + i));
+                double t[2];
+                _mm_storeu_pd(t, s);
+                auto r = t[0] < t[1] ? t[0] : t[1];
+                return i < n && a[i] < r ? a[i] : r;
+            }
+
+            static double f64_max(const double *a, size_t n) {
+                if (n < 2)
+                    return a[0];
+                auto s = _mm_loadu_pd(a);
+                size_t i = 2;
+                for (; i + 2 <= n; i += 2)
+                    s = _mm_max_pd(s, _mm_loadu_pd(a + i));
+                double t[2];
+                _mm_storeu_pd(t, s);
+                auto r = t[0] > t[1] ? t[0] : t[1];
+                return i < n && a[i] > r ? a[i] : r;
+            }
+
+            static double f64_dot(const double *a, const double *b, size_t n) {
+                auto s0 = _mm_setzero_pd(), s1 = s0;
+                size_t i = 0;
+                for (; i + 4 <= n; i += 4) {
+                    s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+                    s1 = _mm_add_pd(s1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+                }
+                double t[2];
+                _mm_storeu_pd(t, _mm_add_pd(s0, s1));
+                return t[0] + t[1] + scalar::f64_dot(a + i, b + i, n - i);
+            }
+
+            static slong i64_sum(const slong *a, size_t n) {
+                auto s = _mm_setzero_si128();
+                size_t i = 0;
+                for (; i + 2 <= n; i += 2)
+                    s = _mm_add_epi64(s, _mm_loadu_si128((const __m128i *) (a + i)));
+                slong t[2];
+                _mm_storeu_si128((__m128i *) t, s);
+                return (slong) ((ulong) t[0] + (ulong) t[1] + (ulong) scalar::i64_sum(a + i, n - i));
+            }
+        }
+
+        namespace avx2 {
+            using scalar::i64_to_f64;
+            using scalar::i64_dot;
+
+            template<int op>
+            TARGET_AVX2 static inline __m256d f64_vop(__m256d a, __m256d b) {
+                switch (op) {
+                    case op_add:
+                        return _mm256_add_pd(a, b);
+                    case op_sub:
+                        return _mm256_sub_pd(a, b);
+                    case op_mul:
+                        return _mm256_mul_pd(a, b);
+                    default:
+                        return _mm256_div_pd(a, b);
+                }
+            }
+
+            template<int op>
+            TARGET_AVX2 static inline __m256d f64_vcmp(__m256d a, __m256d b) {
+                switch (op) {
+                    case op_eq:
+                        return _mm256_cmp_pd(a, b, _CMP_EQ_OQ);
+                    case op_ne:
+                        return _mm256_cmp_pd(a, b, _CMP_NEQ_UQ);
+                    case op_lt:
+                        return _mm256_cmp_pd(a, b, _CMP_LT_OQ);
+                    case op_le:
+                        return _mm256_cmp_pd(a, b, _CMP_LE_OQ);
+                    case op_gt:
+                        return _mm256_cmp_pd(a, b, _CMP_GT_OQ);
+                    default:
+                        return _mm256_cmp_pd(a, b, _CMP_GE_OQ);
+                }
+            }
+
+            // 只有相等与大于比较，其余由交换和取反得到
+            template<int op>
+            TARGET_AVX2 static inline __m256i i64_vcmp(__m256i a, __m256i b, __m256i one) {
+                switch (op) {
+                    case op_eq:
+                        return _mm256_and_si256(_mm256_cmpeq_epi64(a, b), one);
+                    case op_ne:
+                        return _mm256_andnot_si256(_mm256_cmpeq_epi64(a, b), one);
+                    case op_lt:
+                        return _mm256_and_si256(_mm256_cmpgt_epi64(b, a), one);
+                    case op_le:
+                        return _mm256_andnot_si256(_mm256_cmpgt_epi64(a, b), one);
+                    case op_gt:
+                        return _mm256_and_si256(_mm256_cmpgt_epi64(a, b), one);
+                    default:
+                        return _mm256_andnot_si256(_mm256_cmpgt_epi64(b, a), one);
+                }
+            }
+
+            template<int op>
+            TARGET_AVX2 static void f64_bin(const double *a, size_t sa, const double *b, size_t sb, double *r, size_t n) {
+                auto ba = _mm256_set1_pd(a[0]), bb = _mm256_set1_pd(b[0]);
+                size_t i = 0;
+                for (; i + 4 <= n; i += 4) {
+                    auto x = sa ? _mm256_loadu_pd(a + i) : ba;
+                    auto y = sb ? _mm256_loadu_pd(b + i) : bb;
+                    _mm256_storeu_pd(r + i, f64_vop<op>(x, y));
+                }
+                scalar::f64_bin<op>(a + i * sa, sa, b + i * sb, sb, r + i, n - i);
+            }
+
+            template<int op>
+            TARGET_AVX2 static void i64_bin(const slong *a, size_t sa, const slong *b, size_t sb, slong *r, size_t n) {
+                auto ba = _mm256_set1_epi64x(a[0]), bb = _mm256_set1_epi64x(b[0]);
+                size_t i = 0;
+                for (; i + 4 <= n; i += 4) {
+                    auto x = sa ? _mm256_loadu_si256((const __m256i *) (a + i)) : ba;
+                    auto y = sb ? _mm256_loadu_si256((const __m256i *) (b + i)) : bb;
+                    auto z = op == op_add ? _mm256_add_epi64(x, y) : _mm256_sub_epi64(x, y);
+                    _mm256_storeu_si256((__m256i *) (r + i), z);
+                }
+                scalar::i64_bin<op>(a + i * sa, sa, b + i * sb, sb, r + i, n - i);
+            }
+
+            template<int op>
+            TARGET_AVX2 static void f64_cmp(const double *a, size_t sa, const double *b, size_t sb, slong *r, size_t n) {
+                auto ba = _mm256_set1_pd(a[0]), bb = _mm256_set1_pd(b[0]);
+                auto one = _mm256_set1_epi64x(1);
+                size_t i = 0;
+                for (; i + 4 <= n; i += 4) {
+                    auto x = sa ? _mm256_loadu_pd(a + i) : ba;
+                    auto y = sb ? _mm256_loadu_pd(b + i) : bb;
+                    auto m = _mm256_castpd_si256(f64_vcmp<op>(x, y));
+                    _mm256_storeu_si256((__m256i *) (r + i), _mm256_and_si256(m, one));
+                }
+                scalar::f64_cmp<op>(a + i * sa, sa, b + i * sb, sb, r + i, n - i);
+            }
+
+            template<int op>
+            TARGET_AVX2 static void i64_cmp(const slong *a, size_t sa, const slong *b, size_t sb, slong *r, size_t n) {
+                auto ba = _mm256_set1_epi64x(a[0]), bb = _mm256_set1_epi64x(b[0]);
+                auto one = _mm256_set1_epi64x(1);
+                size_t i = 0;
+                for (; i + 4 <= n; i += 4) {
+                    auto x = sa ? _mm256_loadu_si256((const __m256i *) (a + i)) : ba;
+                    auto y = sb ? _mm256_loadu_si256((const __m256i *) (b + i)) : bb;
+                    _mm256_storeu_si256((__m256i *) (r + i), i64_vcmp<op>(x, y, one));
+                }
+                scalar::i64_cmp<op>(a + i * sa, sa, b + i * sb, sb, r + i, n - i);
+            }
+
+            static void f64_binary(int op, const double *a, size_t sa, const double *b, size_t sb, double *r, size_t n) {
+                ARITH_SWITCH(f64_bin, a, sa, b, sb, r, n)
+            }
+
+            static void i64_binary(int op, const slong *a, size_t sa, const slong *b, size_t sb, slong *r, size_t n) {
+                // AVX2没有64位整数乘除
+                if (op == op_add)
+                    i64_bin<op_add>(a, sa, b, sb, r, n);
+                else if (op == op_sub)
+                    i64_bin<op_sub>(a, sa, b, sb, r, n);
+                else
+                    scalar::i64_binary(op, a, sa, b, sb, r, n);
+            }
+
+            static void f64_compare(int op, const double *a, size_t sa, const double *b, size_t sb, slong *r, size_t n) {
+                CMP_SWITCH(f64_cmp, a, sa, b, sb, r, n)
+            }
+
+            static void i64_compare(int op, const slong *a, size_t sa, const slong *b, size_t sb, slong *r, size_t n) {
+                CMP_SWITCH(i64_cmp, a, sa, b, sb, r, n)
+            }
+
+            // 多个累加器掩盖加法延迟
+            TARGET_AVX2 static double f64_sum(const double *a, size_t n) {
+                auto s0 = _mm256_setzero_pd(), s1 = s0, s2 = s0, s3 = s0;
+                size_t i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    s0 = _mm256_add_pd(s0, _mm256_loadu_pd(a + i));
+                    s1 = _mm256_add_pd(s1, _mm256_loadu_pd(a + i + 4));
+                    s2 = _mm256_add_pd(s2, _mm256_loadu_pd(a + i + 8));
+                    s3 = _mm256_add_pd(s3, _mm256_loadu_pd(a + i + 12));
+                }
+                for (; i + 4 <= n; i += 4)
+                    s0 = _mm256_add_pd(s0, _mm256_loadu_pd(a + i));
+                s0 = _mm256_add_pd(_mm256_add_pd(s0, s1), _mm256_add_pd(s2, s3));
+                double t[4];
+                _mm256_storeu_pd(t, s0);
+                return (t[0] + t[1]) + (t[2] + t[3]) + scalar::f64_sum(a + i, n - i);
+            }
+
+            TARGET_AVX2 static double f64_min(const double *a, size_t n) {
+                if (n < 4)
+                    return scalar::f64_min(a, n);
+                auto s = _mm256_loadu_pd(a);
+                size_t i = 4;
+                for (; i + 4 <= n; i += 4)
+                    s = _mm256_min_pd(s, _mm256_loadu_pd(a + i));
+                double t[4];
+                _mm256_storeu_pd(t, s);
+                auto r = scalar::f64_min(t, 4);
+                return i < n ? std::min(r, scalar::f64_min(a + i, n - i)) : r;
+            }
+
+            TARGET_AVX2 static double f64_max(const double *a, size_t n) {
+                if (n < 4)
+                    return scalar::f64_max(a, n);
+                auto s = _mm256_loadu_pd(a);
+                size_t i = 4;
+                for (; i + 4 <= n; i += 4)
+                    s = _mm256_max_pd(s, _mm256_loadu_pd(a + i));
+                double t[4];
+                _mm256_storeu_pd(t, s);
+                auto r = scalar::f64_max(t, 4);
+                return i < n ? std::max(r, scalar::f64_max(a + i, n - i)) : r;
+            }
+
+            TARGET_AVX2 static double f64_dot(const double *a, const double *b, size_t n) {
+                auto s0 = _mm256_setzero_pd(), s1 = s0;
+                size_t i = 0;
+                for (; i + 8 <= n; i += 8) {
+                    s0 = _mm256_add_pd(s0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+                    s1 = _mm256_add_pd(s1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+                }
+                double t[4];
+                _mm256_storeu_pd(t, _mm256_add_pd(s0, s1));
+                return (t[0] + t[1]) + (t[2] + t[3]) + scalar::f64_dot(a + i, b + i, n - i);
+            }
+
+            TARGET_AVX2 static slong i64_sum(const slong *a, size_t n) {
+                auto s0 = _mm256_setzero_si256(), s1 = s0;
+                size_t i = 0;
+                for (; i + 8 <= n; i += 8) {
+                    s0 = _mm256_add_epi64(s0, _mm256_loadu_si256((const __m256i *) (a + i)));
+                    s1 = _mm256_add_epi64(s1, _mm256_loadu_si256((const __m256i *) (a + i + 4)));
+                }
+                slong t[4];
+                _mm256_storeu_si256((__m256i *) t, _mm256_add_epi64(s0, s1));
+                return (slong) ((ulong) scalar::i64_sum(t, 4) + (ulong) scalar::i64_sum(a + i, n - i));
+            }
+
+            TARGET_AVX2 static slong i64_min(const slong *a, size_t n) {
+                if (n < 4)
+                    return scalar::i64_min(a, n);
+                auto s = _mm256_loadu_si256((const __m256i *) a);
+                size_t i = 4;
+                for (; i + 4 <= n; i += 4) {
+                    auto x = _mm256_loadu_si256((const __m256i *) (a + i));
+                    s = _mm256_blendv_epi8(s, x, _mm256_cmpgt_epi64(s, x));
+                }
+                slong t[4];
+                _mm256_storeu_si256((__m256i *) t, s);
+                auto r = scalar::i64_min(t, 4);
+                return i < n ? std::min(r, scalar::i64_min(a + i, n - i)) : r;
+            }
+
+            TARGET_AVX2 static slong i64_max(const slong *a, size_t n) {
+                if (n < 4)
+                    return scalar::i64_max(a, n);
+                auto s = _mm256_loadu_si256((const __m256i *) a);
+                size_t i = 4;
+                for (; i + 4 <= n; i += 4) {
+                    auto x = _mm256_loadu_si256((const __m256i *) (a + i));
+                    s = _mm256_blendv_epi8(s, x, _mm256_cmpgt_epi64(x, s));
+                }
+                slong t[4];
+                _mm256_storeu_si256((__m256i *) t, s);
+                auto r = scalar::i64_max(t, 4);
+                return i < n ? std::max(r, scalar::i64_max(a + i, n - i)) : r;
+            }
+        }
+#else
+        namespace sse2 = scalar;
+        namespace avx2 = scalar;
+#endif
+
+#undef ARITH_SWITCH
+#undef CMP_SWITCH
+
+        isa_t detect() {
+#if ARRAY_X86
+#if defined(__GNUC__) || defined(__clang__)
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2"))
+                return isa_avx2;
+#elif defined(_MSC_VER)
+            int info[4];
+            __cpuid(info, 0);
+            if (info[0] >= 7) {
+                __cpuid(info, 1);
+                // 还需确认操作系统保存了YMM寄存器
+                auto osxsave = (info[2] & (1 << 27)) != 0;
+                auto avx = (info[2] & (1 << 28)) != 0;
+                if (osxsave && avx && (_xgetbv(0) & 6) == 6) {
+                    __cpuidex(info, 7, 0);
+                    if (info[1] & (1 << 5))
+                        return isa_avx2;
+                }
+            }
+#endif
+            return isa_sse2;
+#else
+            return isa_scalar;
+#endif
+        }
+
+        static std::atomic<isa_t> isa{detect()}; // 进程级设置，各cvm共用
+
+        isa_t current() {
+            return isa.load(std::memory_order_relaxed);
+        }
+
+        void select(isa_t level) {
+            auto max = detect();
+            isa.store(level > max ? max : level, std::memory_order_relaxed);
+        }
+
+        const char *isa_name(isa_t level) {
+            switch (level) {
+                case isa_avx2:
+                    return "avx2";
+                case isa_sse2:
+                    return "sse2";
+                default:
+                    return "scalar";
+            }
+        }
+
+#define SIMD_DISPATCH(fn, ...) \
+        switch (isa) { \
+            case isa_avx2: return avx2::fn(__VA_ARGS__); \
+            case isa_sse2: return sse2::fn(__VA_ARGS__); \
+            default: return scalar::fn(__VA_ARGS__); \
+        }
+
+        void f64_binary(int op, const double *a, bool va, const double *b, bool vb, double *r, size_t n) {
+            if (n == 0)
+                return;
+            SIMD_DISPATCH(f64_binary, op, a, va ? 1 : 0, b, vb ? 1 : 0, r, n)
+        }
+
+        void i64_binary(int op, const slong *a, bool va, const slong *b, bool vb, slong *r, size_t n) {
+            if (n == 0)
+                return;
+            SIMD_DISPATCH(i64_binary, op, a, va ? 1 : 0, b, vb ? 1 : 0, r, n)
+        }
+
+        void f64_compare(int op, const double *a, bool va, const double *b, bool vb, slong *r, size_t n) {
+            if (n == 0)
+                return;
+            SIMD_DISPATCH(f64_compare, op, a, va ? 1 : 0, b, vb ? 1 : 0, r, n)
+        }
+
+        void i64_compare(int op, const slong *a, bool va, const slong *b, bool vb, slong *r, size_t n) {
+            if (n == 0)
+                return;
+            SIMD_DISPATCH(i64_compare, op, a, va ? 1 : 0, b, vb ? 1 : 0, r, n)
+        }
+
+        void i64_to_f64(const slong *a, double *r, size_t n) {
+            SIMD_DISPATCH(i64_to_f64, a, r, n)
+        }
+
+        double f64_sum(const double *a, size_t n) {
+            SIMD_DISPATCH(f64_sum, a, n)
+        }
+
+        double f64_min(const double *a, size_t n) {
+            SIMD_DISPATCH(f64_min, a, n)
+        }
+
+        double f64_max(const double *a, size_t n) {
+            SIMD_DISPATCH(f64_max, a, n)
+        }
+
+        double f64_dot(const double *a, const double *b, size_t n) {
+            SIMD_DISPATCH(f64_dot, a, b, n)
+        }
+
+        slong i64_sum(const slong *a, size_t n) {
+            SIMD_DISPATCH(i64_sum, a, n)
+        }
+
+        slong i64_min(const slong *a, size_t n) {
+            SIMD_DISPATCH(i64_min, a, n)
+        }
+
+        slong i64_max(const slong *a, size_t n) {
+            SIMD_DISPATCH(i64_max, a, n)
+        }
+
+        slong i64_dot(const slong *a, const slong *b, size_t n) {
+            SIMD_DISPATCH(i64_dot, a, b, n)
+        }
+
+#undef SIMD_DISPATCH
+    }
+}
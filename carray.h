@@ -0,0 +1,83 @@
+//
+// Project: cliblisp
+// Created by bajdcc
+//
+
+#ifndef CLIBLISP_CARRAY_H
+#define CLIBLISP_CARRAY_H
+
+#include <atomic>
+#include "types.h"
+
+#define ARRAY_ALIGN 32 // 按AVX寄存器宽度对齐
+
+namespace clib {
+
+    enum array_t {
+        arr_i64,
+        arr_f64,
+    };
+
+    // 紧凑数值数组，数据不在GC堆上，不可变，按原子引用计数共享，可跨cvm传递
+    struct carray {
+        std::atomic<uint> ref;
+        array_t type;
+        size_t size;
+        union {
+            slong *i64;
+            double *f64;
+            void *data;
+        };
+
+        static carray *create(array_t type, size_t size);
+        carray *retain();
+        void release();
+    };
+
+    // 向量化运算核，启动时按CPU特性选择AVX2/SSE2/标量实现
+    namespace simd {
+        enum op_t {
+            op_add,
+            op_sub,
+            op_mul,
+            op_div,
+            op_eq,
+            op_ne,
+            op_lt,
+            op_le,
+            op_gt,
+            op_ge,
+        };
+
+        enum isa_t {
+            isa_scalar,
+            isa_sse2,
+            isa_avx2,
+        };
+
+        isa_t detect();
+        isa_t current();
+        void select(isa_t isa); // 不能超过detect()的结果
+        const char *isa_name(isa_t isa);
+
+        // 逐元素运算，va/vb为false时广播a[0]/b[0]
+        void f64_binary(int op, const double *a, bool va, const double *b, bool vb, double *r, size_t n);
+        void i64_binary(int op, const slong *a, bool va, const slong *b, bool vb, slong *r, size_t n); // 除数不能为零
+        // 比较结果为0/1
+        void f64_compare(int op, const double *a, bool va, const double *b, bool vb, slong *r, size_t n);
+        void i64_compare(int op, const slong *a, bool va, const slong *b, bool vb, slong *r, size_t n);
+        void i64_to_f64(const slong *a, double *r, size_t n);
+
+        // 归约，min/max要求n>0
+        double f64_sum(const double *a, size_t n);
+        double f64_min(const double *a, size_t n);
+        double f64_max(const double *a, size_t n);
+        double f64_dot(const double *a, const double *b, size_t n);
+        slong i64_sum(const slong *a, size_t n);
+        slong i64_min(const slong *a, size_t n);
+        slong i64_max(const slong *a, size_t n);
+        slong i64_dot(const slong *a, const slong *b, size_t n);
+    }
+}
+
+#endif //CLIBLISP_CARRAY_H
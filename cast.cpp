@@ -196,9 +196,17 @@ namespace clib {
             case ast_root: // 根结点，全局声明
                 ast_recursion(node->child, level, os, rec);
                 break;
+            case ast_collection:
+            case ast_keyword:
+            case ast_operator:
             case ast_env:
             case ast_sub:
             case ast_lambda:
+            case ast_bigint:
+            case ast_array:
+            case ast_seq:
+            case ast_memo:
+            case ast_chan:
                 break;
             case ast_sexpr:
                 os << '(';
@@ -332,6 +340,17 @@ namespace clib {
             case ast_double:
                 os << "double: " << node->data._double << std::endl;
                 break;
+            case ast_env: // 运行时类型，不出现在语法树中
+            case ast_sub:
+            case ast_lambda:
+            case ast_sexpr:
+            case ast_qexpr:
+            case ast_bigint:
+            case ast_array:
+            case ast_seq:
+            case ast_memo:
+            case ast_chan:
+                break;
         }
     }
 
@@ -391,6 +410,11 @@ namespace clib {
             std::make_tuple(ast_lambda, "lambda", l_none, 0),
             std::make_tuple(ast_sexpr, "sexpr", l_none, 0),
             std::make_tuple(ast_qexpr, "qexpr", l_none, 0),
+            std::make_tuple(ast_bigint, "bigint", l_none, 0),
+            std::make_tuple(ast_array, "array", l_none, 0),
+            std::make_tuple(ast_seq, "seq", l_none, 0),
+            std::make_tuple(ast_memo, "memo", l_none, 0),
+            std::make_tuple(ast_chan, "chan", l_none, 0),
     };
 
     const string_t &cast::ast_str(ast_t type) {
@@ -36,6 +36,11 @@ namespace clib {
         ast_lambda,
         ast_sexpr,
         ast_qexpr,
+        ast_bigint,
+        ast_array,
+        ast_seq,
+        ast_memo,
+        ast_chan,
     };
 
     enum ast_to_t {
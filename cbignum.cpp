@@ -0,0 +1,375 @@
+//
+// Project: cliblisp
+// Created by bajdcc
+//
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include "cbignum.h"
+
+namespace clib {
+
+    static const uint64 LIMB_BASE = 0x100000000ULL;
+    static const cbignum::limb_t DEC_BASE = 1000000000U; // 每段9位十进制
+    static const int DEC_DIGITS = 9;
+
+    static void trim_mag(std::vector<cbignum::limb_t> &a) {
+        while (!a.empty() && a.back() == 0)
+            a.pop_back();
+    }
+
+    static int clz(cbignum::limb_t x) {
+        auto n = 0;
+        while ((x & 0x80000000U) == 0) {
+            x <<= 1;
+            n++;
+        }
+        return n;
+    }
+
+    cbignum::cbignum(slong n) {
+        neg = n < 0;
+        auto v = neg ? 0 - (uint64) n : (uint64) n;
+        mag.push_back((limb_t) v);
+        mag.push_back((limb_t) (v >> 32));
+        trim();
+    }
+
+    cbignum::cbignum(const limb_t *data, uint size, bool neg) : mag(data, data + size), neg(neg) {
+        trim();
+    }
+
+    void cbignum::trim() {
+        trim_mag(mag);
+        if (mag.empty())
+            neg = false;
+    }
+
+    bool cbignum::to_long(slong &n) const {
+        if (mag.size() > 2)
+            return false;
+        uint64 v = 0;
+        if (mag.size() > 0)
+            v = mag[0];
+        if (mag.size() > 1)
+            v |= (uint64) mag[1] << 32;
+        if (neg) {
+            if (v > (uint64) std::numeric_limits<slong>::max() + 1)
+                return false;
+            n = (slong) (0 - v);
+        } else {
+            if (v > (uint64) std::numeric_limits<slong>::max())
+                return false;
+            n = (slong) v;
+        }
+        return true;
+    }
+
+    double cbignum::to_double() const {
+        double d = 0;
+        for (auto i = mag.rbegin(); i != mag.rend(); i++)
+            d = d * 4294967296.0 + *i;
+        return neg ? -d : d;
+    }
+
+    int cbignum::compare(const cbignum &b) const {
+        if (neg != b.neg)
+            return neg ? -1 : 1;
+        auto c = cmp_mag(mag, b.mag);
+        return neg ? -c : c;
+    }
+
+    cbignum cbignum::operator+(const cbignum &b) const {
+        cbignum r;
+        if (neg == b.neg) {
+            r.mag = add_mag(mag, b.mag);
+            r.neg = neg;
+        } else if (cmp_mag(mag, b.mag) >= 0) {
+            r.mag = sub_mag(mag, b.mag);
+            r.neg = neg;
+        } else {
+            r.mag = sub_mag(b.mag, mag);
+            r.neg = b.neg;
+        }
+        r.trim();
+        return r;
+    }
+
+    cbignum cbignum::operator-(const cbignum &b) const {
+        return *this + -b;
+    }
+
+    cbignum cbignum::operator-() const {
+        cbignum r = *this;
+        if (!r.mag.empty())
+            r.neg = !r.neg;
+        return r;
+    }
+
+    cbignum cbignum::operator*(const cbignum &b) const {
+        cbignum r;
+        r.mag = mul_mag(mag.data(), mag.size(), b.mag.data(), b.mag.size());
+        r.neg = neg != b.neg;
+        r.trim();
+        return r;
+    }
+
+    cbignum cbignum::operator/(const cbignum &b) const {
+        cbignum q, r;
+        divmod(*this, b, q, r);
+        return q;
+    }
+
+    cbignum cbignum::operator%(const cbignum &b) const {
+        cbignum q, r;
+        divmod(*this, b, q, r);
+        return r;
+    }
+
+    void cbignum::divmod(const cbignum &a, const cbignum &b, cbignum &q, cbignum &r) {
+        // 截断除法，与C的整数除法一致
+        assert(!b.zero());
+        divmod_mag(a.mag, b.mag, q.mag, r.mag);
+        q.neg = a.neg != b.neg;
+        r.neg = a.neg;
+        q.trim();
+        r.trim();
+    }
+
+    int cbignum::cmp_mag(const mag_t &a, const mag_t &b) {
+        if (a.size() != b.size())
+            return a.size() < b.size() ? -1 : 1;
+        for (auto i = a.size(); i-- > 0;) {
+            if (a[i] != b[i])
+                return a[i] < b[i] ? -1 : 1;
+        }
+        return 0;
+    }
+
+    cbignum::mag_t cbignum::add_mag(const mag_t &a, const mag_t &b) {
+        auto &x = a.size() >= b.size() ? a : b;
+        auto &y = a.size() >= b.size() ? b : a;
+        mag_t r(x.size() + 1);
+        uint64 carry = 0;
+        for (size_t i = 0; i < x.size(); i++) {
+            auto s = (uint64) x[i] + (i < y.size() ? y[i] : 0) + carry;
+            r[i] = (limb_t) s;
+            carry = s >> 32;
+        }
+        r[x.size()] = (limb_t) carry;
+        trim_mag(r);
+        return r;
+    }
+
+    cbignum::mag_t cbignum::sub_mag(const mag_t &a, const mag_t &b) {
+        mag_t r(a.size());
+        slong borrow = 0;
+        for (size_t i = 0; i < a.size(); i++) {
+            auto t = (slong) a[i] - (i < b.size() ? (slong) b[i] : 0) - borrow;
+            borrow = t < 0 ? 1 : 0;
+            r[i] = (limb_t) (t + (borrow ? LIMB_BASE : 0));
+        }
+        assert(borrow == 0);
+        trim_mag(r);
+        return r;
+    }
+
+    void cbignum::mul_school(const limb_t *a, size_t na, const limb_t *b, size_t nb, limb_t *out) {
+        for (size_t i = 0; i < na; i++) {
+            uint64 carry = 0;
+            uint64 x = a[i];
+            for (size_t j = 0; j < nb; j++) {
+                auto t = x * b[j] + out[i + j] + carry;
+                out[i + j] = (limb_t) t;
+                carry = t >> 32;
+            }
+            out[i + nb] = (limb_t) carry;
+        }
+    }
+
+    void cbignum::add_shifted(mag_t &r, const mag_t &a, size_t shift) {
+        uint64 carry = 0;
+        size_t i = 0;
+        for (; i < a.size(); i++) {
+            auto s = (uint64) r[i + shift] + a[i] + carry;
+            r[i + shift] = (limb_t) s;
+            carry = s >> 32;
+        }
+        for (i += shift; carry && i < r.size(); i++) {
+            auto s = (uint64) r[i] + carry;
+            r[i] = (limb_t) s;
+            carry = s >> 32;
+        }
+    }
+
+    cbignum::mag_t cbignum::mul_mag(const limb_t *a, size_t na, const limb_t *b, size_t nb) {
+        while (na > 0 && a[na - 1] == 0)
+            na--;
+        while (nb > 0 && b[nb - 1] == 0)
+            nb--;
+        if (na == 0 || nb == 0)
+            return mag_t();
+        if (na < nb) {
+            std::swap(a, b);
+            std::swap(na, nb);
+        }
+        mag_t r(na + nb);
+        if (nb < BIGNUM_KARATSUBA) {
+            mul_school(a, na, b, nb, r.data());
+            trim_mag(r);
+            return r;
+        }
+        auto m = na / 2;
+        if (nb <= m) {
+            // 长度悬殊时只拆分较长的乘数
+            add_shifted(r, mul_mag(a, m, b, nb), 0);
+            add_shifted(r, mul_mag(a + m, na - m, b, nb), m);
+        } else {
+            // Karatsuba: (a1*B+a0)(b1*B+b0) = z2*B^2 + ((a0+a1)(b0+b1)-z0-z2)*B + z0
+            auto z0 = mul_mag(a, m, b, m);
+            auto z2 = mul_mag(a + m, na - m, b + m, nb - m);
+            auto sa = add_mag(mag_t(a, a + m), mag_t(a + m, a + na));
+            auto sb = add_mag(mag_t(b, b + m), mag_t(b + m, b + nb));
+            auto z1 = mul_mag(sa.data(), sa.size(), sb.data(), sb.size());
+            z1 = sub_mag(sub_mag(z1, z0), z2);
+            add_shifted(r, z0, 0);
+            add_shifted(r, z1, m);
+            add_shifted(r, z2, m * 2);
+        }
+        trim_mag(r);
+        return r;
+    }
+
+    cbignum::limb_t cbignum::divmod_small(mag_t &a, limb_t d) {
+        uint64 rem = 0;
+        for (auto i = a.size(); i-- > 0;) {
+            auto cur = (rem << 32) | a[i];
+            a[i] = (limb_t) (cur / d);
+            rem = cur % d;
+        }
+        trim_mag(a);
+        return (limb_t) rem;
+    }
+
+    void cbignum::divmod_mag(const mag_t &a, const mag_t &b, mag_t &q, mag_t &r) {
+        if (cmp_mag(a, b) < 0) {
+            q.clear();
+            r = a;
+            return;
+        }
+        if (b.size() == 1) {
+            q = a;
+            auto rem = divmod_small(q, b[0]);
+            r.clear();
+            if (rem)
+                r.push_back(rem);
+            return;
+        }
+        // Knuth D：先规格化使除数最高位为1，再逐位估商
+        auto n = b.size(), m = a.size() - n;
+        auto s = clz(b[n - 1]);
+        mag_t bn(n), an(a.size() + 1);
+        for (auto i = n - 1; i > 0; i--)
+            bn[i] = (b[i] << s) | (s ? (limb_t) ((uint64) b[i - 1] >> (32 - s)) : 0);
+        bn[0] = b[0] << s;
+        an[a.size()] = s ? (limb_t) ((uint64) a[a.size() - 1] >> (32 - s)) : 0;
+        for (auto i = a.size() - 1; i > 0; i--)
+            an[i] = (a[i] << s) | (s ? (limb_t) ((uint64) a[i - 1] >> (32 - s)) : 0);
+        an[0] = a[0] << s;
+        q.assign(m + 1, 0);
+        for (auto j = m + 1; j-- > 0;) {
+            auto num = ((uint64) an[j + n] << 32) | an[j + n - 1];
+            auto qhat = num / bn[n - 1];
+            auto rhat = num % bn[n - 1];
+            while (qhat >= LIMB_BASE || qhat * bn[n - 2] > ((rhat << 32) | an[j + n - 2])) {
+                qhat--;
+                rhat += bn[n - 1];
+                if (rhat >= LIMB_BASE)
+                    break;
+            }
+            slong borrow = 0;
+            uint64 carry = 0;
+            for (size_t i = 0; i < n; i++) {
+                auto p = qhat * bn[i] + carry;
+                carry = p >> 32;
+                auto t = (slong) an[i + j] - (slong) (p & 0xFFFFFFFFULL) - borrow;
+                an[i + j] = (limb_t) t;
+                borrow = t < 0 ? 1 : 0;
+            }
+            auto t = (slong) an[j + n] - (slong) carry - borrow;
+            an[j + n] = (limb_t) t;
+            if (t < 0) {
+                // 估商大了1，加回一次除数
+                qhat--;
+                carry = 0;
+                for (size_t i = 0; i < n; i++) {
+                    auto sum = (uint64) an[i + j] + bn[i] + carry;
+                    an[i + j] = (limb_t) sum;
+                    carry = sum >> 32;
+                }
+                an[j + n] += (limb_t) carry;
+            }
+            q[j] = (limb_t) qhat;
+        }
+        trim_mag(q);
+        r.assign(n, 0);
+        for (size_t i = 0; i < n - 1; i++)
+            r[i] = (an[i] >> s) | (s ? (limb_t) ((uint64) an[i + 1] << (32 - s)) : 0);
+        r[n - 1] = an[n - 1] >> s;
+        trim_mag(r);
+    }
+
+    void cbignum::print_small(mag_t n, string_t &out, size_t width) {
+        // 逐次除以10^9
+        std::vector<limb_t> parts;
+        while (!n.empty())
+            parts.push_back(divmod_small(n, DEC_BASE));
+        string_t s;
+        char buf[16];
+        for (auto i = parts.size(); i-- > 0;) {
+            snprintf(buf, sizeof(buf), i + 1 == parts.size() ? "%u" : "%09u", parts[i]);
+            s += buf;
+        }
+        if (width > s.length())
+            out.append(width - s.length(), '0');
+        else if (width == 0 && s.empty())
+            s = "0";
+        out += s;
+    }
+
+    void cbignum::print_dc(const cbignum &n, const std::vector<cbignum> &pow, int k, string_t &out, size_t width) {
+        // 分治：n = q*10^(9*2^k) + r，高低两半分别转换
+        if (k < 0 || n.mag.size() <= BIGNUM_DC_PRINT) {
+            print_small(n.mag, out, width);
+            return;
+        }
+        if (width == 0 && cmp_mag(n.mag, pow[k].mag) < 0) {
+            print_dc(n, pow, k - 1, out, 0);
+            return;
+        }
+        cbignum q, r;
+        divmod(n, pow[k], q, r);
+        auto low = (size_t) DEC_DIGITS << k;
+        print_dc(q, pow, k - 1, out, width > low ? width - low : 0);
+        print_dc(r, pow, k - 1, out, low);
+    }
+
+    string_t cbignum::to_string() const {
+        if (mag.empty())
+            return "0";
+        string_t out;
+        if (neg)
+            out += '-';
+        if (mag.size() <= BIGNUM_DC_PRINT) {
+            print_small(mag, out, 0);
+            return out;
+        }
+        cbignum a(mag.data(), (uint) mag.size(), false);
+        std::vector<cbignum> pow{cbignum((slong) DEC_BASE)};
+        while (cmp_mag(pow.back().mag, a.mag) <= 0)
+            pow.push_back(pow.back() * pow.back());
+        print_dc(a, pow, (int) pow.size() - 1, out, 0);
+        return out;
+    }
+}
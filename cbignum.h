@@ -0,0 +1,131 @@
+//
+// Project: cliblisp
+// Created by bajdcc
+//
+
+#ifndef CLIBLISP_CBIGNUM_H
+#define CLIBLISP_CBIGNUM_H
+
+#include <vector>
+#include <limits>
+#include "types.h"
+
+#define BIGNUM_KARATSUBA 32 // 乘数位数（limb）超过该值时使用Karatsuba乘法
+#define BIGNUM_DC_PRINT 16  // 位数超过该值时按分治法转换十进制
+
+namespace clib {
+
+    // 定长整数运算的溢出检查，溢出时返回true且不修改结果
+#if defined(__GNUC__) || defined(__clang__)
+    template<class T>
+    bool checked_add(T a, T b, T &r) {
+        T t;
+        if (__builtin_add_overflow(a, b, &t))
+            return true;
+        r = t;
+        return false;
+    }
+
+    template<class T>
+    bool checked_sub(T a, T b, T &r) {
+        T t;
+        if (__builtin_sub_overflow(a, b, &t))
+            return true;
+        r = t;
+        return false;
+    }
+
+    template<class T>
+    bool checked_mul(T a, T b, T &r) {
+        T t;
+        if (__builtin_mul_overflow(a, b, &t))
+            return true;
+        r = t;
+        return false;
+    }
+#else
+    template<class T>
+    bool checked_add(T a, T b, T &r) {
+        if ((b > 0 && a > std::numeric_limits<T>::max() - b) ||
+            (b < 0 && a < std::numeric_limits<T>::min() - b))
+            return true;
+        r = a + b;
+        return false;
+    }
+
+    template<class T>
+    bool checked_sub(T a, T b, T &r) {
+        if ((b < 0 && a > std::numeric_limits<T>::max() + b) ||
+            (b > 0 && a < std::numeric_limits<T>::min() + b))
+            return true;
+        r = a - b;
+        return false;
+    }
+
+    template<class T>
+    bool checked_mul(T a, T b, T &r) {
+        const auto max = std::numeric_limits<T>::max(), min = std::numeric_limits<T>::min();
+        if (a > 0) {
+            if (b > 0 ? a > max / b : b < min / a)
+                return true;
+        } else if (a < 0) {
+            if (b > 0 ? a < min / b : (b != 0 && b < max / a))
+                return true;
+        }
+        r = a * b;
+        return false;
+    }
+#endif
+
+    // 任意精度整数，2^32进制，低位在前，符号与绝对值分开存放
+    class cbignum {
+    public:
+        using limb_t = uint32;
+
+        cbignum() = default;
+        explicit cbignum(slong n);
+        cbignum(const limb_t *data, uint size, bool neg);
+
+        bool negative() const { return neg; }
+        bool zero() const { return mag.empty(); }
+        const std::vector<limb_t> &limbs() const { return mag; }
+
+        // 能否用long表示
+        bool to_long(slong &n) const;
+        double to_double() const;
+        int compare(const cbignum &b) const;
+
+        cbignum operator+(const cbignum &b) const;
+        cbignum operator-(const cbignum &b) const;
+        cbignum operator*(const cbignum &b) const;
+        cbignum operator/(const cbignum &b) const;
+        cbignum operator%(const cbignum &b) const;
+        cbignum operator-() const;
+
+        static void divmod(const cbignum &a, const cbignum &b, cbignum &q, cbignum &r);
+
+        string_t to_string() const;
+
+    private:
+        using mag_t = std::vector<limb_t>;
+
+        void trim();
+
+        static int cmp_mag(const mag_t &a, const mag_t &b);
+        static mag_t add_mag(const mag_t &a, const mag_t &b);
+        static mag_t sub_mag(const mag_t &a, const mag_t &b); // 要求a>=b
+        static mag_t mul_mag(const limb_t *a, size_t na, const limb_t *b, size_t nb);
+        static void mul_school(const limb_t *a, size_t na, const limb_t *b, size_t nb, limb_t *out);
+        static void add_shifted(mag_t &r, const mag_t &a, size_t shift);
+        static limb_t divmod_small(mag_t &a, limb_t d);
+        static void divmod_mag(const mag_t &a, const mag_t &b, mag_t &q, mag_t &r);
+
+        static void print_small(mag_t n, string_t &out, size_t width);
+        static void print_dc(const cbignum &n, const std::vector<cbignum> &pow, int k, string_t &out, size_t width);
+
+        mag_t mag;
+        bool neg{false};
+    };
+}
+
+#endif //CLIBLISP_CBIGNUM_H
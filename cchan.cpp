@@ -0,0 +1,149 @@
+//
+// Project: cliblisp
+// Created by bajdcc
+//
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#if defined(_WIN32)
+#include <malloc.h>
+#endif
+#include "cchan.h"
+#include "cvm.h"
+
+namespace clib {
+
+    void *cchan::operator new(size_t size) {
+#if defined(_WIN32)
+        auto ptr = _aligned_malloc(size, CHAN_LINE);
+#else
+        void *ptr = nullptr;
+        if (posix_memalign(&ptr, CHAN_LINE, size) != 0)
+            ptr = nullptr;
+#endif
+        if (!ptr)
+            throw std::bad_alloc();
+        return ptr;
+    }
+
+    void cchan::operator delete(void *ptr) {
+#if defined(_WIN32)
+        _aligned_free(ptr);
+#else
+        free(ptr);
+#endif
+    }
+
+    cchan *cchan::create(size_t capacity) {
+        assert(capacity > 0);
+        auto ch = new cchan();
+        ch->ref = 1;
+        ch->capacity = capacity;
+        ch->cells = new cell[capacity];
+        for (size_t i = 0; i < capacity; i++) {
+            ch->cells[i].seq.store(i, std::memory_order_relaxed);
+            ch->cells[i].data = nullptr;
+        }
+        return ch;
+    }
+
+    cchan::~cchan() {
+        while (auto p = try_recv())
+            delete p;
+        delete[] cells;
+    }
+
+    cchan *cchan::retain() {
+        ref++;
+        return this;
+    }
+
+    void cchan::release() {
+        assert(ref > 0);
+        if (--ref == 0)
+            delete this;
+    }
+
+    bool cchan::try_send(cpacket *p) {
+        // 格的序号等于写位置时可写，写入后序号加一交给读方
+        auto pos = tail.load(std::memory_order_relaxed);
+        for (;;) {
+            auto &c = cells[pos % capacity];
+            auto seq = c.seq.load(std::memory_order_acquire);
+            auto dif = (intptr_t) seq - (intptr_t) pos;
+            if (dif == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    c.data = p;
+                    c.seq.store(pos + 1, std::memory_order_release);
+                    notify();
+                    return true;
+                }
+            } else if (dif < 0) {
+                return false; // 上一轮的元素还没有被取走
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    cpacket *cchan::try_recv() {
+        // 格的序号等于读位置加一时可读，取出后序号推进一整轮交还写方
+        auto pos = head.load(std::memory_order_relaxed);
+        for (;;) {
+            auto &c = cells[pos % capacity];
+            auto seq = c.seq.load(std::memory_order_acquire);
+            auto dif = (intptr_t) seq - (intptr_t) (pos + 1);
+            if (dif == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    auto p = c.data;
+                    c.data = nullptr;
+                    c.seq.store(pos + capacity, std::memory_order_release);
+                    notify();
+                    return p;
+                }
+            } else if (dif < 0) {
+                return nullptr;
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void cchan::notify() {
+        // 计数与登记数都按顺序一致的次序访问：等待方登记后再读计数，两边至少有一方看到对方
+        events++;
+        if (watching.load() == 0)
+            return;
+        std::lock_guard<std::mutex> guard(watch_lock);
+        for (auto &token : watchers)
+            token->notify();
+    }
+
+    void cchan::watch(ccancel *token) {
+        std::lock_guard<std::mutex> guard(watch_lock);
+        watchers.push_back(token);
+        watching++;
+    }
+
+    void cchan::unwatch(ccancel *token) {
+        std::lock_guard<std::mutex> guard(watch_lock);
+        auto it = std::find(watchers.begin(), watchers.end(), token);
+        if (it != watchers.end()) {
+            watchers.erase(it);
+            watching--;
+        }
+    }
+
+    size_t cchan::size() const {
+        auto t = tail.load(std::memory_order_acquire);
+        auto h = head.load(std::memory_order_acquire);
+        return t > h ? t - h : 0;
+    }
+
+    bool cchan::full() const {
+        return size() >= capacity;
+    }
+}
@@ -0,0 +1,70 @@
+//
+// Project: cliblisp
+// Created by bajdcc
+//
+
+#ifndef CLIBLISP_CCHAN_H
+#define CLIBLISP_CCHAN_H
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include "types.h"
+
+#define CHAN_LINE 64 // 缓存行大小，读写位置分开存放避免伪共享
+
+namespace clib {
+
+    struct cpacket;
+    class ccancel;
+    class cvm;
+
+    // 有界多生产者多消费者通道，不在GC堆上，按原子引用计数共享，可跨cvm传递
+    // 环形队列无锁：每格的序号标明该格可写还是可读，读写位置各自用CAS推进
+    // 元素是堆上的cpacket，入队后归通道所有，出队后归接收方所有，只转移指针不复制
+    // 通道中的值若引用了通道自身，引用计数无法归零
+    // 收发成功时计数加一并唤醒登记的等待者，休眠的上下文比较计数即知是否该重试
+    struct cchan {
+        std::atomic<uint> ref;
+        size_t capacity;
+        std::atomic<size_t> events{0}; // 成功收发的次数
+        cvm *owner{nullptr}; // 还没有离开创建者时不为空，值直接移交而不打包，见cvm::share
+
+        static cchan *create(size_t capacity);
+        cchan *retain();
+        void release(); // 最后一个引用释放时丢弃未取出的元素
+
+        bool try_send(cpacket *p); // 已满时返回false，p仍归调用方
+        cpacket *try_recv(); // 为空时返回nullptr
+        bool full() const; // 近似判断，并发时只作提示
+        size_t size() const; // 同上
+
+        // 阻塞在宿主中的cvm登记令牌，其他cvm收发时经令牌唤醒
+        void watch(ccancel *token);
+        void unwatch(ccancel *token);
+
+    private:
+        struct cell {
+            std::atomic<size_t> seq;
+            cpacket *data;
+        };
+
+        cchan() = default;
+        ~cchan();
+
+        void notify();
+
+        // C++14的new不保证超过max_align_t的对齐，按缓存行对齐分配
+        static void *operator new(size_t size);
+        static void operator delete(void *ptr);
+
+        cell *cells{nullptr};
+        alignas(CHAN_LINE) std::atomic<size_t> head{0}; // 下一个读位置
+        alignas(CHAN_LINE) std::atomic<size_t> tail{0}; // 下一个写位置
+        std::atomic<uint> watching{0}; // 登记的令牌数，为0时收发不必加锁
+        std::mutex watch_lock;
+        std::vector<ccancel *> watchers;
+    };
+}
+
+#endif //CLIBLISP_CCHAN_H
@@ -9,13 +9,14 @@
 namespace clib {
 
     cgui::cgui() {
+        vm.set_host(this);
         auto cs = std::vector<string_t>{
             R"(def `put-str (\ `s `(map ui-put (word s))))",
-            R"(def `ui-put-delay (\ `(c t) `(begin (ui-put c) (conf `(record)) (conf (attr `wait t)))))",
+            R"(def `ui-put-delay (\ `(c t) `(begin (ui-put c) (sleep t))))",
             R"(def `put-str-delay (\ `(s t) `(map (\ `c `(ui-put-delay c t)) (word s))))",
             R"(def `(i S) 0 (word __logo__))",
             R"(conf `(ticks 1000))",
-            R"(if (< i (len S)) `(begin (ui-put (index S i)) (def `i (+ i)) (conf `continue)) `(conf `break))",
+            R"(while (< i (len S)) (ui-put (index S i)) (def `i (+ i)))",
             R"(conf `(ticks 5))",
             R"(put-str-delay "Hello world!\n" 0.4d)",
             R"(put-str "Welcome to cliblisp by bajdcc!\n")",
@@ -103,6 +104,8 @@ namespace clib {
                     vm.restore();
                     vm.gc();
                 }
+            } else if (vm.has_threads()) {
+                vm.run(cycle, c); // 空闲时继续推进后台的绿色线程
             }
         }
         if (continues > 0) {
@@ -12,6 +12,7 @@
 #include "types.h"
 #include "cparser.h"
 #include "cvm.h"
+#include "chost.h"
 
 #define GUI_FONT GLUT_BITMAP_9_BY_15
 #define GUI_FONT_W 9
@@ -24,7 +25,7 @@
 
 namespace clib {
 
-    class cgui {
+    class cgui : public chost {
     public:
         cgui();
         ~cgui() = default;
@@ -34,14 +35,14 @@ namespace clib {
 
         void draw();
 
-        void put_char(char c);
+        void put_char(char c) override;
 
-        void set_cycle(int cycle);
-        void set_ticks(int ticks);
+        void set_cycle(int cycle) override;
+        void set_ticks(int ticks) override;
 
-        void record();
-        bool reach(const decimal &d);
-        void control(int type);
+        void record() override;
+        bool reach(const decimal &d) override;
+        void control(int type) override;
 
     private:
         void tick();
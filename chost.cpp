@@ -0,0 +1,57 @@
+//
+// Project: cliblisp
+// Created by bajdcc
+//
+
+#include <iostream>
+#include <thread>
+#include "chost.h"
+#include "cvm.h"
+
+namespace clib {
+
+    void chost::put_char(char c) {
+        std::cout.put(c);
+    }
+
+    void chost::put_string(const string_t &s) {
+        std::cout << s;
+    }
+
+    void chost::set_cycle(int /*cycle*/) {
+    }
+
+    void chost::set_ticks(int /*ticks*/) {
+    }
+
+    void chost::record() {
+        record_now = std::chrono::steady_clock::now();
+    }
+
+    bool chost::reach(const decimal &d) {
+        auto now = std::chrono::steady_clock::now();
+        return std::chrono::duration_cast<std::chrono::duration<decimal>>(now - record_now).count() > d;
+    }
+
+    void chost::control(int /*type*/) {
+    }
+
+    ulong chost::clock() {
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        return (ulong) std::chrono::duration_cast<std::chrono::milliseconds>(now).count();
+    }
+
+    void chost::idle(ulong deadline, ccancel *cancel) {
+        auto now = clock();
+        if (deadline <= now)
+            return;
+        if (cancel)
+            cancel->sleep(deadline - now);
+        else
+            std::this_thread::sleep_for(std::chrono::milliseconds(deadline - now));
+    }
+
+    cvm_pool *chost::pool() {
+        return nullptr;
+    }
+}
@@ -0,0 +1,49 @@
+//
+// Project: cliblisp
+// Created by bajdcc
+//
+
+#ifndef CLIBLISP_CHOST_H
+#define CLIBLISP_CHOST_H
+
+#include <chrono>
+#include "types.h"
+
+namespace clib {
+
+    class cvm_pool;
+    class ccancel;
+
+    // 宿主服务：输出、计时与界面控制，由嵌入方继承并注入cvm，见cvm::set_host
+    // 默认实现输出到标准输出，界面相关的设置被忽略
+    // 回调总是在执行cvm::run的线程上同步调用，宿主只需对自身共享的状态加锁
+    class chost {
+    public:
+        chost() = default;
+        virtual ~chost() = default;
+
+        chost(const chost &) = delete;
+        chost &operator=(const chost &) = delete;
+
+        virtual void put_char(char c); // ui-put
+        virtual void put_string(const string_t &s); // print
+
+        virtual void set_cycle(int cycle);
+        virtual void set_ticks(int ticks);
+
+        virtual void record();
+        virtual bool reach(const decimal &d); // 距上次record是否已超过d秒
+        virtual void control(int type); // 0: continue, 1: break
+
+        virtual ulong clock(); // 单调时钟，毫秒，供计时器使用
+        // 无事可做时阻塞到clock()达到deadline，令牌不为空时被取消或唤醒须立即返回，见cvm::wait
+        virtual void idle(ulong deadline, ccancel *cancel);
+
+        virtual cvm_pool *pool(); // pmap等使用的隔离体池，为空时顺序执行
+
+    private:
+        std::chrono::steady_clock::time_point record_now;
+    };
+}
+
+#endif //CLIBLISP_CHOST_H
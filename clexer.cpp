@@ -884,7 +884,7 @@ LEX_T(t) clexer::get_store_##t(int index) const \
                 bitOp[j].set((uint) op[j]); // 操作符第一/二位char二进制查找
             }
         }
-        string_t enable_char = "_-?";
+        string_t enable_char = "_-?>*"; // 允许string->number、let*这样的名字
         for (auto &c : enable_char) {
             bitIdOp.set((uint) c);
         }
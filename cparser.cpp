@@ -25,9 +25,6 @@ namespace clib {
         lexer->reset();
         // 清空AST
         ast.reset();
-        // 产生式
-        if (unit.get_pda().empty())
-            gen();
         // 语法分析（LR）
         program();
         //cast::print2(ast.get_root(), 0, std::cout);
@@ -151,7 +148,15 @@ namespace clib {
         return nullptr;
     }
 
-    void cparser::gen() {
+    const cunit &cparser::grammar() {
+        // 生成PDA较慢，首次使用时生成一次，静态局部变量的初始化是线程安全的
+        static cunit unit;
+        static auto done = (gen(unit), true);
+        (void) done;
+        return unit;
+    }
+
+    void cparser::gen(cunit &unit) {
 #define DEF_OP(name) auto &_##name##_ = unit.token(op_##name)
         DEF_OP(lparan);
         DEF_OP(rparan);
@@ -48,7 +48,8 @@ namespace clib {
         void next();
         void reset();
 
-        void gen();
+        static const cunit &grammar();
+        static void gen(cunit &unit);
         void program();
         ast_node *terminal();
 
@@ -77,7 +78,7 @@ namespace clib {
         std::vector<ast_node *> ast_reduce_cache;
 
     private:
-        cunit unit;
+        const cunit &unit{grammar()}; // 文法与PDA只读，所有分析器共享
         std::unique_ptr<clexer> lexer;
         cast ast;
     };
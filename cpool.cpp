@@ -0,0 +1,197 @@
+//
+// Project: cliblisp
+// Created by bajdcc
+//
+
+#include <sstream>
+#include "cpool.h"
+#include "cexception.h"
+
+namespace clib {
+
+    cvm_pool::cvm_pool(size_t n, int slice) : slice(slice) {
+        if (n == 0)
+            n = 1;
+        // 隔离体在当前线程构造，其余由第一个复制而来，预热后交给工作线程独占
+        for (size_t i = 0; i < n; i++) {
+            auto w = std::make_unique<worker>();
+            w->base = i == 0 ? std::make_unique<cvm>() : workers[0]->base->fork();
+            w->parser = std::make_unique<cparser>();
+            workers.push_back(std::move(w));
+        }
+        for (size_t i = 0; i < n; i++) {
+            workers[i]->thread = std::thread(&cvm_pool::work, this, i);
+        }
+    }
+
+    cvm_pool::~cvm_pool() {
+        {
+            std::lock_guard<std::mutex> guard(idle_lock);
+            stopping = true;
+        }
+        idle.notify_all();
+        for (auto &w : workers) {
+            w->thread.join();
+        }
+    }
+
+    std::future<cresult> cvm_pool::submit(const string_t &code, ulong timeout, ccancel *token) {
+        auto promise = std::make_shared<std::promise<cresult>>();
+        auto f = promise->get_future();
+        cjob j;
+        j.start = [code](cvm &vm, cparser &parser) {
+            vm.prepare(parser.parse(code));
+        };
+        j.finish = [promise](cvm &vm, cval *val, const string_t &error, int cycles) {
+            cresult r{false, "", error, cycles};
+            if (val) {
+                std::stringstream ss;
+                cvm::print(val, ss);
+                r.value = ss.str();
+                r.ok = true;
+            }
+            promise->set_value(r);
+        };
+        j.timeout = timeout;
+        j.token = token;
+        push(std::move(j));
+        return f;
+    }
+
+    void cvm_pool::post(cjob j) {
+        push(std::move(j));
+    }
+
+    void cvm_pool::push(cjob j) {
+        // 先计数再放入队列，取走任务时的pending--不会先于这里的pending++
+        auto &w = *workers[next++ % workers.size()];
+        {
+            std::lock_guard<std::mutex> guard(idle_lock);
+            pending++;
+        }
+        {
+            std::lock_guard<std::mutex> guard(w.lock);
+            w.jobs.push_back(std::move(j));
+        }
+        idle.notify_one();
+    }
+
+    size_t cvm_pool::size() const {
+        return workers.size();
+    }
+
+    bool cvm_pool::take(size_t id, cjob &j) {
+        {
+            auto &w = *workers[id];
+            std::lock_guard<std::mutex> guard(w.lock);
+            if (!w.jobs.empty()) {
+                j = std::move(w.jobs.front());
+                w.jobs.pop_front();
+                pending--;
+                return true;
+            }
+        }
+        for (size_t i = 1; i < workers.size(); i++) {
+            auto &w = *workers[(id + i) % workers.size()];
+            std::lock_guard<std::mutex> guard(w.lock);
+            if (!w.jobs.empty()) {
+                j = std::move(w.jobs.back());
+                w.jobs.pop_back();
+                pending--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void cvm_pool::work(size_t id) {
+        auto &w = *workers[id];
+        for (;;) {
+            cjob j;
+            if (w.running.size() < POOL_ACTIVE && take(id, j))
+                start(w, j);
+            if (!w.running.empty()) {
+                // 轮到的任务运行一个时间片，未结束的排回队尾
+                auto t = std::move(w.running.front());
+                w.running.pop_front();
+                if (!step(w, t))
+                    w.running.push_back(std::move(t));
+                continue;
+            }
+            std::unique_lock<std::mutex> guard(idle_lock);
+            idle.wait(guard, [this] { return stopping || pending > 0; });
+            if (stopping && pending == 0)
+                break;
+        }
+    }
+
+    void cvm_pool::start(worker &w, cjob &j) {
+        // 复用rebase过的隔离体，不够时才从基准cvm复制
+        task t{std::move(j), nullptr, 0};
+        if (w.spare.empty()) {
+            t.vm = w.base->fork();
+            t.vm->pin();
+        } else {
+            t.vm = std::move(w.spare.back());
+            w.spare.pop_back();
+        }
+        auto &vm = *t.vm;
+        vm.set_cancel(t.job.token);
+        try {
+            vm.save();
+            vm.set_deadline(t.job.timeout);
+            t.job.start(vm, *w.parser);
+        } catch (const cexception &e) {
+            finish(w, t, nullptr, e.msg);
+            return;
+        } catch (const std::exception &e) {
+            finish(w, t, nullptr, e.what());
+            return;
+        }
+        w.running.push_back(std::move(t));
+    }
+
+    bool cvm_pool::step(worker &w, task &t) {
+        auto &vm = *t.vm;
+        cval *val;
+        try {
+            val = vm.run(slice, t.cycles);
+        } catch (const cexception &e) {
+            finish(w, t, nullptr, e.msg);
+            return true;
+        } catch (const std::exception &e) {
+            finish(w, t, nullptr, e.what());
+            return true;
+        }
+        if (val) {
+            finish(w, t, val, "");
+            return true;
+        }
+        // 没有别的任务可做且都在等计时器时经宿主阻塞，否则让出处理器
+        if (!w.running.empty() || pending > 0 || !vm.wait())
+            std::this_thread::yield();
+        return false;
+    }
+
+    void cvm_pool::finish(worker &w, task &t, cval *val, string_t error) {
+        auto &vm = *t.vm;
+        if (val) {
+            try {
+                t.job.finish(vm, val, "", t.cycles);
+            } catch (const cexception &e) {
+                error = e.msg;
+                val = nullptr;
+            } catch (const std::exception &e) {
+                error = e.what();
+                val = nullptr;
+            }
+        }
+        if (!val) {
+            vm.restore();
+            t.job.finish(vm, nullptr, error, t.cycles);
+        }
+        vm.set_cancel(nullptr);
+        vm.rebase();
+        w.spare.push_back(std::move(t.vm));
+    }
+}
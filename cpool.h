@@ -0,0 +1,96 @@
+//
+// Project: cliblisp
+// Created by bajdcc
+//
+
+#ifndef CLIBLISP_CPOOL_H
+#define CLIBLISP_CPOOL_H
+
+#define POOL_SLICE 1000
+#define POOL_ACTIVE 4 // 每个工作线程同时轮转的任务数，各占一个隔离体
+
+#include <deque>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <future>
+#include <functional>
+#include "types.h"
+#include "cparser.h"
+#include "cvm.h"
+
+namespace clib {
+
+    // 任务结果，值为打印后的字符串，cval不能离开所属的cvm
+    struct cresult {
+        bool ok;
+        string_t value;
+        string_t error;
+        int cycles;
+    };
+
+    // 在隔离体上执行的任务：start准备根表达式，之后按时间片运行，结束时以值或错误调用finish
+    // 值需经cpacket进出，cval不能离开所属的cvm；timeout为开始执行后的毫秒数，0为不限
+    struct cjob {
+        std::function<void(cvm &vm, cparser &parser)> start;
+        std::function<void(cvm &vm, cval *val, const string_t &error, int cycles)> finish; // 出错时val为空
+        ulong timeout{0};
+        ccancel *token{nullptr}; // 在finish之前须保持有效
+    };
+
+    // 隔离体池：每个工作线程独占预热好的cvm与cparser
+    // 提交的任务先放入某个线程的队列，空闲线程从其他队列尾部窃取
+    // 开始执行的任务留在本线程，每运行一个时间片就排回轮转队列的尾部，长任务不会饿死后来的任务
+    // 任务在隔离体上执行，结束后rebase回到预热时的全局环境再交给下一个任务，前一个任务的def不会留给后一个
+    class cvm_pool {
+    public:
+        explicit cvm_pool(size_t n = std::thread::hardware_concurrency(), int slice = POOL_SLICE);
+        ~cvm_pool(); // 等待已提交的任务全部完成
+
+        cvm_pool(const cvm_pool &) = delete;
+        cvm_pool &operator=(const cvm_pool &) = delete;
+
+        // timeout为开始执行后的毫秒数，0为不限；token在结果就绪前须保持有效
+        std::future<cresult> submit(const string_t &code, ulong timeout = 0, ccancel *token = nullptr);
+        void post(cjob j);
+        size_t size() const;
+
+    private:
+        struct task {
+            cjob job;
+            std::unique_ptr<cvm> vm;
+            int cycles;
+        };
+
+        struct worker {
+            std::unique_ptr<cvm> base; // 只用于复制，不执行任务
+            std::vector<std::unique_ptr<cvm>> spare; // 已rebase、可交给下一个任务的隔离体
+            std::unique_ptr<cparser> parser;
+            std::deque<cjob> jobs; // 未开始的任务，本线程从头部取，窃取者从尾部取
+            std::deque<task> running; // 已开始的任务，只由本线程轮转
+            std::mutex lock;
+            std::thread thread;
+        };
+
+        void work(size_t id);
+        void push(cjob j);
+        bool take(size_t id, cjob &j);
+        void start(worker &w, cjob &j);
+        bool step(worker &w, task &t);
+        void finish(worker &w, task &t, cval *val, string_t error);
+
+    private:
+        std::vector<std::unique_ptr<worker>> workers;
+        int slice;
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> pending{0};
+        bool stopping{false};
+        std::mutex idle_lock;
+        std::condition_variable idle;
+    };
+}
+
+#endif //CLIBLISP_CPOOL_H
@@ -0,0 +1,118 @@
+//
+// Project: cliblisp
+// Created by bajdcc
+//
+
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <new>
+#include <vector>
+#include "crope.h"
+
+namespace clib {
+
+    crope *crope::leaf(const char *str, size_t len) {
+        // 叶结点的数据紧跟在结点之后
+        auto mem = std::malloc(sizeof(crope) + len + 1);
+        assert(mem);
+        auto node = new(mem) crope();
+        node->len = len;
+        node->flat = (char *) mem + sizeof(crope);
+        std::memcpy(node->flat, str, len);
+        node->flat[len] = 0;
+        return node;
+    }
+
+    crope *crope::concat(crope *left, crope *right) {
+        auto mem = std::malloc(sizeof(crope));
+        assert(mem);
+        auto node = new(mem) crope();
+        node->len = left->len + right->len;
+        node->left = left;
+        node->right = right;
+        return node;
+    }
+
+    crope *crope::slice(crope *base, size_t start, size_t len) {
+        assert(start + len <= base->len);
+        auto mem = std::malloc(sizeof(crope));
+        assert(mem);
+        auto node = new(mem) crope();
+        node->len = len;
+        node->flat = (char *) base->data() + start;
+        // 切片的切片直接引用数据的所有者，父切片复制数据后仍然有效
+        while (base->left)
+            base = base->left;
+        node->left = base->retain();
+        return node;
+    }
+
+    crope *crope::retain() {
+        ref++;
+        return this;
+    }
+
+    void crope::release() {
+        // 逐个拼接得到的绳很深，不能递归释放
+        std::vector<crope *> stack{this};
+        while (!stack.empty()) {
+            auto node = stack.back();
+            stack.pop_back();
+            assert(node->ref > 0);
+            if (--node->ref > 0)
+                continue;
+            if (node->left)
+                stack.push_back(node->left);
+            if (node->right)
+                stack.push_back(node->right);
+            if (node->owned)
+                std::free(node->flat);
+            node->~crope();
+            std::free(node);
+        }
+    }
+
+    const char *crope::c_str() {
+        data();
+        if (flat[len] != 0) {
+            // 切片不在父串末尾时复制一份，不再引用父结点
+            auto buf = (char *) std::malloc(len + 1);
+            assert(buf);
+            std::memcpy(buf, flat, len);
+            buf[len] = 0;
+            flat = buf;
+            owned = true;
+            left->release();
+            left = nullptr;
+        }
+        return flat;
+    }
+
+    const char *crope::data() {
+        if (flat)
+            return flat;
+        auto buf = (char *) std::malloc(len + 1);
+        assert(buf);
+        auto out = buf;
+        std::vector<crope *> stack{this};
+        while (!stack.empty()) {
+            auto node = stack.back();
+            stack.pop_back();
+            if (node->flat) {
+                std::memcpy(out, node->flat, node->len);
+                out += node->len;
+            } else {
+                stack.push_back(node->right);
+                stack.push_back(node->left);
+            }
+        }
+        *out = 0;
+        flat = buf;
+        owned = true;
+        left->release();
+        right->release();
+        left = right = nullptr;
+        return flat;
+    }
+}
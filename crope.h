@@ -0,0 +1,42 @@
+//
+// Project: cliblisp
+// Created by bajdcc
+//
+
+#ifndef CLIBLISP_CROPE_H
+#define CLIBLISP_CROPE_H
+
+#include "types.h"
+
+#define ROPE_MIN 64 // 拼接结果超过该长度时使用绳结构，否则直接展平
+
+namespace clib {
+
+    // 长字符串的绳结构，数据不在GC堆上，不可变，按引用计数共享
+    // 展平结果缓存在结点中，之后释放子结点；切片直接指向父结点的数据
+    class crope {
+    public:
+        static crope *leaf(const char *str, size_t len);
+        static crope *concat(crope *left, crope *right); // 接管两者的引用
+        static crope *slice(crope *base, size_t start, size_t len);
+
+        crope *retain();
+        void release();
+
+        size_t size() const { return len; }
+        const char *data(); // 不一定以'\0'结尾
+        const char *c_str();
+
+    private:
+        crope() = default;
+
+        uint ref{1};
+        bool owned{false}; // flat是否单独分配
+        size_t len{0};
+        crope *left{nullptr};
+        crope *right{nullptr};
+        char *flat{nullptr};
+    };
+}
+
+#endif //CLIBLISP_CROPE_H
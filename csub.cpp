@@ -4,11 +4,21 @@
 //
 
 #include <cstring>
+#include <cctype>
 #include <sstream>
+#include <algorithm>
+#include <limits>
+#include <array>
+#include <utility>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <thread>
 #include "cvm.h"
 #include "csub.h"
 #include "cparser.h"
-#include "cgui.h"
+#include "cpool.h"
+#include "cexception.h"
 
 #define VM_OP(val) (val->val._v.child->next)
 
@@ -17,6 +27,8 @@
 
 #define VM_RET(val) {*frame->ret = (val); return s_ret; }
 
+#define PMAP_SPLIT 4 // pmap为每个工作线程切分的块数
+
 namespace clib {
 
     bool strequ(const char * a, const char * b)
@@ -40,9 +52,6 @@ namespace clib {
             R"(def `cdar (\ `x `(cdr (car x))))",
             R"(def `cddr (\ `x `(cdr (cdr x))))",
             R"(def `cddr (\ `x `(cdr (cdr x))))",
-            R"((def `range (\ `(a b) `(if (== a b) `nil `(cons a (range (+ a 1) b))))))",
-            R"(def `map-i (\ `(f L i) `(if (>= i (len L)) `nil `(begin (f (index L i)) (map-i f L (+ i))))))",
-            R"(def `map (\ `(f L) `(if (null? L) `nil `(map-i f L 0))))",
         };
         cparser p;
         try {
@@ -101,6 +110,7 @@ MM.           MM      ,   MM    MM    `Y   MM      ,   MM  .     `MM   MM
         add_builtin(_env, "eval", val_sub("eval", builtins::call_eval));
         add_builtin(_env, "if", val_sub("if", builtins::_if));
         add_builtin(_env, "null?", val_sub("null?", builtins::is_null));
+        add_builtin(_env, "equal?", val_sub("equal?", builtins::is_equal));
 #define ADD_BUILTIN(name) add_builtin(_env, #name, val_sub(#name, builtins::name))
         ADD_BUILTIN(quote);
         ADD_BUILTIN(list);
@@ -118,116 +128,516 @@ MM.           MM      ,   MM    MM    `Y   MM      ,   MM  .     `MM   MM
         ADD_BUILTIN(print);
         ADD_BUILTIN(conf);
         ADD_BUILTIN(attr);
+        ADD_BUILTIN(hash);
 #undef ADD_BUILTIN
         add_builtin(_env, "ui-put", val_sub("ui-put", builtins::ui_put));
+        add_builtin(_env, "substring", val_sub("substring", builtins::substring));
+        add_builtin(_env, "string-find", val_sub("string-find", builtins::string_find));
+        add_builtin(_env, "string-split", val_sub("string-split", builtins::string_split));
+        add_builtin(_env, "string-join", val_sub("string-join", builtins::string_join));
+        add_builtin(_env, "string-replace", val_sub("string-replace", builtins::string_replace));
+        add_builtin(_env, "string-upcase", val_sub("string-upcase", builtins::string_upcase));
+        add_builtin(_env, "string-downcase", val_sub("string-downcase", builtins::string_downcase));
+        add_builtin(_env, "string->number", val_sub("string->number", builtins::string_to_number));
+        add_builtin(_env, "map", val_sub("map", builtins::map));
+        add_builtin(_env, "filter", val_sub("filter", builtins::filter));
+        add_builtin(_env, "for-each", val_sub("for-each", builtins::for_each));
+        add_builtin(_env, "pmap", val_sub("pmap", builtins::pmap));
+        add_builtin(_env, "spawn", val_sub("spawn", builtins::spawn));
+        add_builtin(_env, "join", val_sub("join", builtins::join));
+        add_builtin(_env, "detach", val_sub("detach", builtins::detach));
+        add_builtin(_env, "yield", val_sub("yield", builtins::yield));
+        add_builtin(_env, "sleep", val_sub("sleep", builtins::sleep));
+        add_builtin(_env, "chan", val_sub("chan", builtins::chan));
+        add_builtin(_env, "send", val_sub("send", builtins::send));
+        add_builtin(_env, "recv", val_sub("recv", builtins::recv));
+        add_builtin(_env, "select", val_sub("select", builtins::select));
+        add_builtin(_env, "pfor-each", val_sub("pfor-each", builtins::pfor_each));
+        add_builtin(_env, "foldl", val_sub("foldl", builtins::foldl));
+        add_builtin(_env, "foldr", val_sub("foldr", builtins::foldr));
+        add_builtin(_env, "range", val_sub("range", builtins::range));
+        add_builtin(_env, "iota", val_sub("iota", builtins::iota));
+        add_builtin(_env, "reverse", val_sub("reverse", builtins::reverse));
+        add_builtin(_env, "sort", val_sub("sort", builtins::sort));
+        add_builtin(_env, "sort-by", val_sub("sort-by", builtins::sort_by));
+        add_builtin(_env, "seq", val_sub("seq", builtins::seq));
+        add_builtin(_env, "memo", val_sub("memo", builtins::memo));
+        add_builtin(_env, "memo-stats", val_sub("memo-stats", builtins::memo_stats));
+        add_builtin(_env, "seq-range", val_sub("seq-range", builtins::seq_range));
+        add_builtin(_env, "seq-take", val_sub("seq-take", builtins::seq_take));
+        add_builtin(_env, "seq-drop", val_sub("seq-drop", builtins::seq_drop));
+        add_builtin(_env, "seq-zip", val_sub("seq-zip", builtins::seq_zip));
+        add_builtin(_env, "seq->list", val_sub("seq->list", builtins::seq_to_list));
+        add_builtin(_env, "f64", val_sub("f64", builtins::f64));
+        add_builtin(_env, "i64", val_sub("i64", builtins::i64));
+        add_builtin(_env, "vec-iota", val_sub("vec-iota", builtins::vec_iota));
+        add_builtin(_env, "vec-sum", val_sub("vec-sum", builtins::vec_sum));
+        add_builtin(_env, "vec-min", val_sub("vec-min", builtins::vec_min));
+        add_builtin(_env, "vec-max", val_sub("vec-max", builtins::vec_max));
+        add_builtin(_env, "vec-dot", val_sub("vec-dot", builtins::vec_dot));
+        add_builtin(_env, "vec-isa", val_sub("vec-isa", builtins::vec_isa));
+    }
+
+    // 数值塔：char < uchar < short < ushort < int < uint < long < ulong < float < double
+    // 大整数与整数运算得到大整数，与浮点数运算得到double
+    static bool is_number(ast_t type) {
+        return type >= ast_char && type <= ast_double;
+    }
+
+    // 整数除以零会触发SIGFPE，整数运算核之前检查除数
+    static bool is_zero(cval *val) {
+        switch (val->type) {
+#define DEFINE_ZERO(t) case ast_##t: return val->val._##t == 0;
+            DEFINE_ZERO(char)
+            DEFINE_ZERO(uchar)
+            DEFINE_ZERO(short)
+            DEFINE_ZERO(ushort)
+            DEFINE_ZERO(int)
+            DEFINE_ZERO(uint)
+            DEFINE_ZERO(long)
+            DEFINE_ZERO(ulong)
+#undef DEFINE_ZERO
+            default:
+                return false;
+        }
+    }
+
+    static ast_t promote(ast_t a, ast_t b) {
+        if (a == ast_bigint || b == ast_bigint) {
+            auto c = a == ast_bigint ? b : a;
+            if (c == ast_float || c == ast_double)
+                return ast_double;
+            if (c == ast_bigint || is_number(c))
+                return ast_bigint;
+            return ast_root;
+        }
+        if (!is_number(a) || !is_number(b))
+            return ast_root;
+        return a > b ? a : b;
     }
 
     template<ast_t t>
+    struct num_t {};
+
+#define DEFINE_NUM_T(t) \
+    template<> \
+    struct num_t<ast_##t> { \
+        using type = LEX_T(t); \
+        static type &get(cval *v) { return v->val._##t; } \
+    };
+    DEFINE_NUM_T(char)
+    DEFINE_NUM_T(uchar)
+    DEFINE_NUM_T(short)
+    DEFINE_NUM_T(ushort)
+    DEFINE_NUM_T(int)
+    DEFINE_NUM_T(uint)
+    DEFINE_NUM_T(long)
+    DEFINE_NUM_T(ulong)
+    DEFINE_NUM_T(float)
+    DEFINE_NUM_T(double)
+#undef DEFINE_NUM_T
+
+    // 算术运算返回是否溢出
+    template<class T>
     struct gen_op {
-        void add(cval *r, cval *v) {}
-        void sub(cval *r, cval *v) {}
-        void mul(cval *r, cval *v) {}
-        void div(cval *r, cval *v) {}
-        bool eq(cval *r, cval *v) {}
-        bool ne(cval *r, cval *v) {}
-        bool le(cval *r, cval *v) {}
-        bool ge(cval *r, cval *v) {}
-        bool lt(cval *r, cval *v) {}
-        bool gt(cval *r, cval *v) {}
+        static bool add(T &r, T v) { r += v; return false; }
+        static bool sub(T &r, T v) { r -= v; return false; }
+        static bool mul(T &r, T v) { r *= v; return false; }
+        static bool div(T &r, T v) { r /= v; return false; }
+        static bool eq(T r, T v) { return r == v; }
+        static bool ne(T r, T v) { return r != v; }
+        static bool le(T r, T v) { return r <= v; }
+        static bool ge(T r, T v) { return r >= v; }
+        static bool lt(T r, T v) { return r < v; }
+        static bool gt(T r, T v) { return r > v; }
     };
 
-#define DEFINE_VAL_OP(t) \
-    template<> \
-    struct gen_op<ast_##t> { \
-        static void add(cval *r, cval *v) { if (v == nullptr) r->val._##t++; else r->val._##t += v->val._##t; } \
-        static void sub(cval *r, cval *v) { if (v == nullptr) r->val._##t--; else r->val._##t -= v->val._##t; } \
-        static void mul(cval *r, cval *v) { if (v != nullptr) r->val._##t *= v->val._##t; } \
-        static void div(cval *r, cval *v) { if (v != nullptr) r->val._##t /= v->val._##t; } \
-        static bool eq(cval *r, cval *v) { return r->val._##t == v->val._##t; } \
-        static bool ne(cval *r, cval *v) { return r->val._##t != v->val._##t; } \
-        static bool le(cval *r, cval *v) { return r->val._##t <= v->val._##t; } \
-        static bool ge(cval *r, cval *v) { return r->val._##t >= v->val._##t; } \
-        static bool lt(cval *r, cval *v) { return r->val._##t < v->val._##t; } \
-        static bool gt(cval *r, cval *v) { return r->val._##t > v->val._##t; } \
+    // int与long溢出时由calc_op提升类型
+    template<class T>
+    struct gen_fix_op : gen_op<T> {
+        static bool add(T &r, T v) { return checked_add(r, v, r); }
+        static bool sub(T &r, T v) { return checked_sub(r, v, r); }
+        static bool mul(T &r, T v) { return checked_mul(r, v, r); }
+        static bool div(T &r, T v) {
+            if (v == -1 && r == std::numeric_limits<T>::min())
+                return true;
+            r /= v;
+            return false;
+        }
     };
-    DEFINE_VAL_OP(char)
-    DEFINE_VAL_OP(uchar)
-    DEFINE_VAL_OP(short)
-    DEFINE_VAL_OP(ushort)
-    DEFINE_VAL_OP(int)
-    DEFINE_VAL_OP(uint)
-    DEFINE_VAL_OP(long)
-    DEFINE_VAL_OP(ulong)
-    DEFINE_VAL_OP(float)
-    DEFINE_VAL_OP(double)
-#undef DEFINE_VAL_OP
-
-    int cvm::calc(int op, ast_t type, cval *r, cval *v, cval *env) {
-        switch (type) {
-#define DEFINE_CALC_TYPE(t) \
-            case ast_##t: \
-                switch (op) { \
-                    case '+': gen_op<ast_##t>::add(r, v); return 0; \
-                    case '-': gen_op<ast_##t>::sub(r, v); return 0; \
-                    case '*': gen_op<ast_##t>::mul(r, v); return 0; \
-                    case '/': gen_op<ast_##t>::div(r, v); return 0; \
-                    case '=' | '=' << 8: return gen_op<ast_##t>::eq(r, v); \
-                    case '!' | '=' << 8: return gen_op<ast_##t>::ne(r, v); \
-                    case '<' | '=' << 8: return gen_op<ast_##t>::le(r, v); \
-                    case '>' | '=' << 8: return gen_op<ast_##t>::ge(r, v); \
-                    case '<': return gen_op<ast_##t>::lt(r, v); \
-                    case '>': return gen_op<ast_##t>::gt(r, v); \
-        } \
-                break;
-            DEFINE_CALC_TYPE(char)
-            DEFINE_CALC_TYPE(uchar)
-            DEFINE_CALC_TYPE(short)
-            DEFINE_CALC_TYPE(ushort)
-            DEFINE_CALC_TYPE(int)
-            DEFINE_CALC_TYPE(uint)
-            DEFINE_CALC_TYPE(long)
-            DEFINE_CALC_TYPE(ulong)
-            DEFINE_CALC_TYPE(float)
-            DEFINE_CALC_TYPE(double)
-#undef DEFINE_CALC_TYPE
+
+    template<class T>
+    struct gen_num_op : gen_op<T> {};
+    template<>
+    struct gen_num_op<int> : gen_fix_op<int> {};
+    template<>
+    struct gen_num_op<slong> : gen_fix_op<slong> {};
+
+    enum calc_t {
+        c_add,
+        c_sub,
+        c_mul,
+        c_div,
+        c_set, // 类型转换
+        c_arith_size,
+        c_eq = 0,
+        c_ne,
+        c_le,
+        c_ge,
+        c_lt,
+        c_gt,
+        c_cmp_size,
+    };
+
+    static const int NUM_TYPES = ast_double - ast_char + 1;
+
+    // 特化的运算核：结果类型t，参数类型u
+    using kernel_t = bool (*)(cval *r, cval *v);
+    using cmp_kernel_t = bool (*)(cval *r, cval *v);
+
+    template<int op, ast_t t, ast_t u>
+    bool gen_kernel(cval *r, cval *v) {
+        using T = typename num_t<t>::type;
+        auto &a = num_t<t>::get(r);
+        auto b = (T) num_t<u>::get(v);
+        switch (op) {
+            case c_add:
+                return gen_num_op<T>::add(a, b);
+            case c_sub:
+                return gen_num_op<T>::sub(a, b);
+            case c_mul:
+                return gen_num_op<T>::mul(a, b);
+            case c_div:
+                return gen_num_op<T>::div(a, b);
             default:
-                break;
+                a = b;
+                return false;
         }
-        error("unsupported calc op");
-        return 0;
     }
 
-    static bool is_comparison(int op) {
+    template<int op, ast_t t>
+    bool gen_cmp_kernel(cval *r, cval *v) {
+        using T = typename num_t<t>::type;
+        auto a = num_t<t>::get(r), b = num_t<t>::get(v);
+        switch (op) {
+            case c_eq:
+                return gen_op<T>::eq(a, b);
+            case c_ne:
+                return gen_op<T>::ne(a, b);
+            case c_le:
+                return gen_op<T>::le(a, b);
+            case c_ge:
+                return gen_op<T>::ge(a, b);
+            case c_lt:
+                return gen_op<T>::lt(a, b);
+            default:
+                return gen_op<T>::gt(a, b);
+        }
+    }
+
+    using kernel_row_t = std::array<kernel_t, NUM_TYPES>;
+    using kernel_table_t = std::array<kernel_row_t, NUM_TYPES>;
+
+    template<int op, size_t t, size_t... u>
+    constexpr kernel_row_t gen_kernel_row(std::index_sequence<u...>) {
+        return {{&gen_kernel<op, (ast_t) (ast_char + t), (ast_t) (ast_char + u)>...}};
+    }
+
+    template<int op, size_t... t>
+    constexpr kernel_table_t gen_kernel_table(std::index_sequence<t...>) {
+        return {{gen_kernel_row<op, t>(std::make_index_sequence<NUM_TYPES>())...}};
+    }
+
+    template<size_t... op>
+    constexpr std::array<kernel_table_t, c_arith_size> gen_kernels(std::index_sequence<op...>) {
+        return {{gen_kernel_table<op>(std::make_index_sequence<NUM_TYPES>())...}};
+    }
+
+    template<int op, size_t... t>
+    constexpr std::array<cmp_kernel_t, NUM_TYPES> gen_cmp_row(std::index_sequence<t...>) {
+        return {{&gen_cmp_kernel<op, (ast_t) (ast_char + t)>...}};
+    }
+
+    template<size_t... op>
+    constexpr std::array<std::array<cmp_kernel_t, NUM_TYPES>, c_cmp_size> gen_cmp_kernels(std::index_sequence<op...>) {
+        return {{gen_cmp_row<op>(std::make_index_sequence<NUM_TYPES>())...}};
+    }
+
+    // 编译期生成的运算核表：[运算][结果类型][参数类型]
+    static const auto kernels = gen_kernels(std::make_index_sequence<c_arith_size>());
+    static const auto cmp_kernels = gen_cmp_kernels(std::make_index_sequence<c_cmp_size>());
+
+    static int arith_index(int op) {
+        switch (op) {
+            case '+':
+                return c_add;
+            case '-':
+                return c_sub;
+            case '*':
+                return c_mul;
+            case '/':
+                return c_div;
+            default:
+                return -1;
+        }
+    }
+
+    static int cmp_index(int op) {
         switch (op) {
             case '=' | '=' << 8:
+                return c_eq;
             case '!' | '=' << 8:
+                return c_ne;
             case '<' | '=' << 8:
+                return c_le;
             case '>' | '=' << 8:
+                return c_ge;
             case '<':
+                return c_lt;
             case '>':
-                return true;
+                return c_gt;
+            default:
+                return -1;
+        }
+    }
+
+    static bool is_comparison(int op) {
+        return cmp_index(op) != -1;
+    }
+
+    static void promote_long(cval *val) {
+        auto n = val->val._int;
+        val->type = ast_long;
+        val->val._long = n;
+    }
+
+    cval *cvm::calc_big(int op, cval *r, cval *v) {
+        auto acc = bigint(r);
+        if (!v) {
+            if (op == '+')
+                acc = acc + cbignum(1);
+            else if (op == '-')
+                acc = acc - cbignum(1);
+        }
+        while (v) {
+            auto n = bigint(v);
+            switch (op) {
+                case '+':
+                    acc = acc + n;
+                    break;
+                case '-':
+                    acc = acc - n;
+                    break;
+                case '*':
+                    acc = acc * n;
+                    break;
+                case '/':
+                    if (n.zero())
+                        error("divided by zero");
+                    acc = acc / n;
+                    break;
+                default:
+                    error("unsupported calc op");
+                    break;
+            }
+            v = v->next;
+        }
+        return val_integer(acc);
+    }
+
+    // 数组运算的操作数，标量按数组的广播处理
+    struct array_operand {
+        carray *arr;
+        array_t type;
+        slong i;
+        double f;
+
+        size_t size() const { return arr ? arr->size : 1; }
+        const slong *i64() const { return arr ? arr->i64 : &i; }
+        const double *f64() const { return arr ? arr->f64 : &f; }
+    };
+
+    static bool is_array_op(int op, int &sop) {
+        switch (op) {
+            case '+':
+                sop = simd::op_add;
+                break;
+            case '-':
+                sop = simd::op_sub;
+                break;
+            case '*':
+                sop = simd::op_mul;
+                break;
+            case '/':
+                sop = simd::op_div;
+                break;
+            case '=' | '=' << 8:
+                sop = simd::op_eq;
+                break;
+            case '!' | '=' << 8:
+                sop = simd::op_ne;
+                break;
+            case '<':
+                sop = simd::op_lt;
+                break;
+            case '<' | '=' << 8:
+                sop = simd::op_le;
+                break;
+            case '>':
+                sop = simd::op_gt;
+                break;
+            case '>' | '=' << 8:
+                sop = simd::op_ge;
+                break;
             default:
                 return false;
         }
+        return true;
+    }
+
+    // 整数数组参与浮点运算时先转换，结果由调用者释放
+    static carray *array_to_f64(carray *arr) {
+        if (arr->type == arr_f64)
+            return arr->retain();
+        auto r = carray::create(arr_f64, arr->size);
+        simd::i64_to_f64(arr->i64, r->f64, arr->size);
+        return r;
+    }
+
+    cval *cvm::calc_array(int op, cval *val) {
+        int sop;
+        if (!is_array_op(op, sop))
+            error("unsupported array op");
+        auto cmp = sop >= simd::op_eq;
+        if (!val->next || (cmp && val->next->next))
+            error(cmp ? "comparison requires 2 arguments" : "array operation requires at least 2 arguments");
+        auto operand = [this](cval *v) {
+            array_operand o{nullptr, arr_i64, 0, 0};
+            if (v->type == ast_array) {
+                o.arr = v->val._array->retain();
+                o.type = o.arr->type;
+            } else if (is_number(v->type)) {
+                cval tmp;
+                if (v->type == ast_float || v->type == ast_double) {
+                    tmp.type = ast_double;
+                    kernels[c_set][ast_double - ast_char][v->type - ast_char](&tmp, v);
+                    o.type = arr_f64;
+                    o.f = tmp.val._double;
+                } else {
+                    tmp.type = ast_long;
+                    kernels[c_set][ast_long - ast_char][v->type - ast_char](&tmp, v);
+                    o.i = tmp.val._long;
+                    o.f = (double) o.i;
+                }
+            } else {
+                error("invalid operator type for array");
+            }
+            return o;
+        };
+        auto acc = operand(val);
+        for (auto v = val->next; v; v = v->next) {
+            auto b = operand(v);
+            if (acc.arr && b.arr && acc.arr->size != b.arr->size) {
+                acc.arr->release();
+                b.arr->release();
+                error("array size mismatch");
+            }
+            auto n = acc.arr ? acc.size() : b.size();
+            auto type = acc.type == arr_f64 || b.type == arr_f64 ? arr_f64 : arr_i64;
+            if (!acc.arr && !b.arr) {
+                // 数组之前的标量先合并
+                if (type == arr_f64) {
+                    simd::f64_binary(sop, &acc.f, false, &b.f, false, &acc.f, 1);
+                    acc.type = arr_f64;
+                } else {
+                    if (sop == simd::op_div && b.i == 0)
+                        error("divided by zero");
+                    simd::i64_binary(sop, &acc.i, false, &b.i, false, &acc.i, 1);
+                    acc.f = (double) acc.i;
+                }
+                continue;
+            }
+            if (type == arr_i64 && sop == simd::op_div) {
+                auto d = b.i64();
+                for (size_t i = 0; i < b.size(); i++) {
+                    if (d[i] == 0) {
+                        if (acc.arr)
+                            acc.arr->release();
+                        if (b.arr)
+                            b.arr->release();
+                        error("divided by zero");
+                    }
+                }
+            }
+            auto r = carray::create(cmp ? arr_i64 : type, n);
+            if (type == arr_f64) {
+                auto x = acc.arr ? array_to_f64(acc.arr) : nullptr;
+                auto y = b.arr ? array_to_f64(b.arr) : nullptr;
+                auto pa = x ? x->f64 : &acc.f, pb = y ? y->f64 : &b.f;
+                if (cmp)
+                    simd::f64_compare(sop, pa, x != nullptr, pb, y != nullptr, r->i64, n);
+                else
+                    simd::f64_binary(sop, pa, x != nullptr, pb, y != nullptr, r->f64, n);
+                if (x)
+                    x->release();
+                if (y)
+                    y->release();
+            } else if (cmp) {
+                simd::i64_compare(sop, acc.i64(), acc.arr != nullptr, b.i64(), b.arr != nullptr, r->i64, n);
+            } else {
+                simd::i64_binary(sop, acc.i64(), acc.arr != nullptr, b.i64(), b.arr != nullptr, r->i64, n);
+            }
+            if (acc.arr)
+                acc.arr->release();
+            if (b.arr)
+                b.arr->release();
+            acc = {r, r->type, 0, 0};
+        }
+        return val_array(acc.arr);
     }
 
     cval *cvm::calc_op(int op, cval *val, cval *env) {
         if (!val)
             error("missing operator");
+        // 大整数参与浮点运算时先转为double
+        auto as_number = [](cval *val, cval &tmp) -> cval * {
+            if (val->type != ast_bigint)
+                return val;
+            tmp.type = ast_double;
+            tmp.val._double = bigint(val).to_double();
+            return &tmp;
+        };
         auto v = val;
         if (v->type == ast_sub) {
             error("invalid operator type for sub");
         }
-        if (v->type == ast_string) {
+        for (auto i = v; i; i = i->next) {
+            if (i->type == ast_array)
+                return calc_array(op, val);
+        }
+        if (v->type == ast_string && !is_comparison(op)) {
             if (op == '+') {
-                std::stringstream ss;
-                while (v) {
-                    if (v->type != ast_string)
+                size_t len = 0;
+                for (auto i = v; i; i = i->next) {
+                    if (i->type != ast_string)
                         error("invalid operator type for string");
-                    ss << v->val._string;
-                    v = v->next;
+                    len += string_size(i);
+                }
+                if (len < ROPE_MIN) {
+                    string_t s;
+                    s.reserve(len);
+                    for (auto i = v; i; i = i->next)
+                        s.append(string_data(i), string_size(i));
+                    return val_str(ast_string, s.c_str(), s.length());
+                }
+                // 长字符串惰性拼接，只在读取时展平一次
+                crope *r = nullptr;
+                for (auto i = v; i; i = i->next) {
+                    auto piece = i->flag & f_rope ? i->val._rope->retain() :
+                                 crope::leaf(i->val._string, string_size(i));
+                    r = r ? crope::concat(r, piece) : piece;
                 }
-                return val_str(ast_string, ss.str().c_str());
+                return val_rope(r);
             }
             error("invalid operator type for string");
         }
@@ -235,50 +645,91 @@ MM.           MM      ,   MM    MM    `Y   MM      ,   MM  .     `MM   MM
             if (!v->next || v->next->next)
                 error("comparison requires 2 arguments");
             auto v2 = v->next;
-            if (v->type != v2->type)
-                error("invalid operator type for comparison");
-            if (v->type == ast_string) {
-                switch (op) {
-                    case '=' | '=' << 8:
-                        return val_bool(strcmp(v->val._string, v2->val._string) == 0);
-                    case '!' | '=' << 8:
-                        return val_bool(strcmp(v->val._string, v2->val._string) != 0);
-                    case '<' | '=' << 8:
-                        return val_bool(strcmp(v->val._string, v2->val._string) <= 0);
-                    case '>' | '=' << 8:
-                        return val_bool(strcmp(v->val._string, v2->val._string) >= 0);
-                    case '<':
-                        return val_bool(strcmp(v->val._string, v2->val._string) < 0);
-                    case '>':
-                        return val_bool(strcmp(v->val._string, v2->val._string) > 0);
-                    default:
-                        break;
-                }
+            if (v->type == ast_string && v2->type == ast_string) {
+                auto c = string_compare(v, v2);
+                cval a, b;
+                a.type = b.type = ast_int;
+                a.val._int = c;
+                b.val._int = 0;
+                return val_bool(cmp_kernels[cmp_index(op)][ast_int - ast_char](&a, &b));
             }
-            if (v->type == ast_qexpr) {
-                std::stringstream s1, s2;
-                v->next = nullptr;
-                v2->next = nullptr;
-                print(v, s1);
-                print(v2, s2);
-                auto a = s1.str();
-                auto b = s2.str();
-                return val_bool(a == b);
+            if (v->type == ast_qexpr && v2->type == ast_qexpr) {
+                auto k = cmp_index(op);
+                if (k != c_eq && k != c_ne)
+                    error("invalid operator type for comparison");
+                return val_bool(equal(v, v2) == (k == c_eq));
             }
-            return val_bool(calc(op, v->type, v, v2, env) != 0);
+            auto t = promote(v->type, v2->type);
+            if (t == ast_bigint) {
+                auto c = bigint(v).compare(bigint(v2));
+                cval a, b;
+                a.type = b.type = ast_int;
+                a.val._int = c;
+                b.val._int = 0;
+                return val_bool(cmp_kernels[cmp_index(op)][ast_int - ast_char](&a, &b));
+            }
+            if (t == ast_root)
+                error("invalid operator type for comparison");
+            // 两边都转为公共类型后比较
+            cval a, b, tmp;
+            a.type = b.type = t;
+            auto x = as_number(v, tmp);
+            kernels[c_set][t - ast_char][x->type - ast_char](&a, x);
+            x = as_number(v2, tmp);
+            kernels[c_set][t - ast_char][x->type - ast_char](&b, x);
+            return val_bool(cmp_kernels[cmp_index(op)][t - ast_char](&a, &b));
         }
-        auto r = val_obj(v->type);
-        std::memcpy((char *) &r->val, (char *) &v->val, sizeof(v->val));
+        auto k = arith_index(op);
+        if (k == -1)
+            error("unsupported calc op");
+        // 先求出结果类型，运算核的整行只选一次
+        auto t = v->type;
+        for (auto i = v->next; i; i = i->next) {
+            t = promote(t, i->type);
+            if (t == ast_root)
+                error("invalid operator type");
+        }
+        if (t == ast_bigint)
+            return calc_big(op, v, v->next);
+        if (!is_number(t))
+            error("invalid operator type");
+        cval tmp;
+        auto r = val_obj(t);
+        auto x = as_number(v, tmp);
+        kernels[c_set][t - ast_char][x->type - ast_char](r, x);
+        auto row = &kernels[k][t - ast_char];
         v = v->next;
-        if (v) {
-            while (v) {
-                if (r->type != v->type)
-                    error("invalid operator type");
-                calc(op, r->type, r, v, env);
-                v = v->next;
+        if (!v) {
+            // 单参数时+与-为自增自减
+            if (k == c_add || k == c_sub) {
+                tmp.type = ast_int;
+                tmp.val._int = 1;
+                if ((*row)[ast_int - ast_char](r, &tmp)) {
+                    if (t == ast_int) {
+                        promote_long(r);
+                        kernels[k][ast_long - ast_char][ast_int - ast_char](r, &tmp);
+                    } else {
+                        return calc_big(op, r, nullptr);
+                    }
+                }
             }
-        } else {
-            calc(op, r->type, r, v, env);
+            return r;
+        }
+        while (v) {
+            if (op == '/' && t < ast_float && is_zero(v))
+                error("divided by zero");
+            x = as_number(v, tmp);
+            if ((*row)[x->type - ast_char](r, x)) {
+                // 溢出：int提升为long后重算，long提升为大整数
+                if (t == ast_int) {
+                    promote_long(r);
+                    t = ast_long;
+                    row = &kernels[k][t - ast_char];
+                    continue;
+                }
+                return calc_big(op, r, v);
+            }
+            v = v->next;
         }
         return r;
     }
@@ -319,6 +770,9 @@ MM.           MM      ,   MM    MM    `Y   MM      ,   MM  .     `MM   MM
             case ast_lambda: {
                 return builtins::call_lambda(vm, frame);
             }
+            case ast_memo: {
+                return builtins::call_memo(vm, frame);
+            }
             case ast_sexpr:
             case ast_literal: {
                 struct tmp_bag {
@@ -330,7 +784,7 @@ MM.           MM      ,   MM    MM    `Y   MM      ,   MM  .     `MM   MM
                     cval *r;
                 };
                 if (frame->arg == nullptr) {
-                    auto v = vm->val_obj(val->type);
+                    auto v = vm->val_obj(ast_sexpr);
                     vm->mem.push_root(v);
 #if SHOW_ALLOCATE_NODE
                     if (op->type == ast_literal) {
@@ -343,7 +797,7 @@ MM.           MM      ,   MM    MM    `Y   MM      ,   MM  .     `MM   MM
 #endif
                     v->val._v.child = nullptr;
                     v->val._v.count = 0;
-                    auto tmp = vm->eval_tmp.alloc<tmp_bag>();
+                    auto tmp = vm->tmp_alloc<tmp_bag>();
                     memset(tmp, 0, sizeof(tmp_bag));
                     tmp->v = v;
                     tmp->i = op;
@@ -424,25 +878,59 @@ MM.           MM      ,   MM    MM    `Y   MM      ,   MM  .     `MM   MM
             VM_RET(VM_NIL);
         }
         switch (val->type) {
-            case ast_sexpr: {
-                if (val->val._v.child) {
-                    if (val->val._v.count == 1) {
-                        return eval_one(vm, frame);
-                    }
-                    return eval_child(vm, frame);
-                } else {
-                    VM_RET(VM_NIL);
-                }
-            }
+            case ast_sexpr:
+                return eval_code(vm, frame);
             case ast_literal: {
                 VM_RET(vm->calc_symbol(val->val._string, env));
             }
             default:
                 break;
         }
+        if (val->flag & f_const) {
+            VM_RET(vm->copy(val)); // 共享代码不能被链入结果
+        }
         VM_RET(val);
     }
 
+    status_t cvm::eval_code(cvm *vm, cframe *frame) {
+        // 将S-exp或作为代码的Q-exp（if分支、lambda体）求值，不修改其类型
+        auto &val = frame->val;
+        if (!val || (val->type != ast_sexpr && val->type != ast_qexpr)) {
+            return eval(vm, frame);
+        }
+        if (!val->val._v.child) {
+            VM_RET(VM_NIL);
+        }
+        switch ((special_t) (val->flag & f_special)) {
+            case sp_if:
+                return builtins::special_if(vm, frame);
+            case sp_lambda:
+                return builtins::special_lambda(vm, frame);
+            case sp_def:
+                return builtins::special_def(vm, frame);
+            case sp_begin:
+                return builtins::special_begin(vm, frame);
+            case sp_while:
+                return builtins::special_while(vm, frame);
+            case sp_do:
+                return builtins::special_do(vm, frame);
+            case sp_dotimes:
+                return builtins::special_dotimes(vm, frame);
+            case sp_let:
+                return builtins::special_let(vm, frame);
+            case sp_let_star:
+                return builtins::special_let_star(vm, frame);
+            case sp_yield:
+                return builtins::special_yield(vm, frame);
+            default:
+                break;
+        }
+        if (val->val._v.count == 1) {
+            return eval_one(vm, frame);
+        }
+        return eval_child(vm, frame);
+    }
+
     status_t builtins::add(cvm *vm, cframe *frame) {
         VM_RET(VM_CALL("+"));
     }
@@ -475,28 +963,72 @@ MM.           MM      ,   MM    MM    `Y   MM      ,   MM  .     `MM   MM
         VM_RET(v);
     }
 
+    // 重量级内建函数分块执行：每步最多处理VM_CHUNK个元素后返回s_call，帧不出栈，
+    // 下一步从frame->arg中的进度继续，周期预算与线程时间片因此能在块之间生效
+    struct chunk_bag {
+        cval *v; // 正在构造的结果，完成前压在GC栈根上
+        cval *local; // 结果的尾结点
+        cval *i; // 下一个参数
+        cval *j; // 当前参数中的下一个元素
+        size_t k; // 已处理的字符数
+    };
+
+    chunk_bag *builtins::chunk_begin(cvm *vm, cframe *frame, cval *v) {
+        auto tmp = vm->tmp_alloc<chunk_bag>();
+        memset(tmp, 0, sizeof(chunk_bag));
+        tmp->v = v;
+        frame->arg = tmp;
+        return tmp;
+    }
+
+    void builtins::chunk_link(chunk_bag *tmp, cval *c) {
+        if (tmp->local)
+            tmp->local->next = c;
+        else
+            tmp->v->val._v.child = c;
+        tmp->local = c;
+        tmp->v->val._v.count++;
+    }
+
+    void builtins::chunk_push(cvm *vm, chunk_bag *tmp, cval *x) {
+        chunk_link(tmp, vm->copy(x));
+    }
+
+    bool builtins::chunk_copy(cvm *vm, chunk_bag *tmp) {
+        // 从tmp->i起复制至多VM_CHUNK个元素，还有剩余时返回true
+        for (auto n = 0; n < VM_CHUNK && tmp->i; n++) {
+            chunk_push(vm, tmp, tmp->i);
+            tmp->i = tmp->i->next;
+        }
+        return tmp->i != nullptr;
+    }
+
+    cval *builtins::chunk_end(cvm *vm, chunk_bag *tmp) {
+        auto v = tmp->v;
+        vm->eval_tmp.free(tmp);
+        vm->mem.pop_root();
+        return v;
+    }
+
     status_t builtins::list(cvm *vm, cframe *frame) {
         auto &val = frame->val;
         auto op = VM_OP(val);
-        if (val->val._v.count == 2 && op->val._v.count == 0) VM_RET(vm->copy(op));
-        auto v = vm->val_obj(ast_qexpr);
-        vm->mem.push_root(v);
+        auto tmp = (chunk_bag *) frame->arg;
+        if (tmp == nullptr) {
+            if (val->val._v.count == 2 && op->val._v.count == 0) VM_RET(vm->copy(op));
+            auto v = vm->val_obj(ast_qexpr);
+            vm->mem.push_root(v);
 #if SHOW_ALLOCATE_NODE
-        printf("[DEBUG] ALLOC | addr: 0x%p, node: %-10s, for list\n", v, cast::ast_str(v->type).c_str());
+            printf("[DEBUG] ALLOC | addr: 0x%p, node: %-10s, for list\n", v, cast::ast_str(v->type).c_str());
 #endif
-        auto i = op;
-        auto local = vm->copy(i);
-        v->val._v.child = local;
-        v->val._v.count = 1;
-        i = i->next;
-        while (i) {
-            v->val._v.count++;
-            local->next = vm->copy(i);
-            local = local->next;
-            i = i->next;
+            v->val._v.child = nullptr;
+            v->val._v.count = 0;
+            tmp = chunk_begin(vm, frame, v);
+            tmp->i = op;
         }
-        vm->mem.pop_root();
-        VM_RET(v);
+        if (chunk_copy(vm, tmp))
+            return s_call;
+        VM_RET(chunk_end(vm, tmp));
     }
 
     status_t builtins::car(cvm *vm, cframe *frame) {
@@ -522,25 +1054,29 @@ MM.           MM      ,   MM    MM    `Y   MM      ,   MM  .     `MM   MM
         if (op->type != ast_qexpr)
             vm->error("cdr need Q-exp");
         if (op->val._v.count > 0) {
-            if (op->val._v.child->next) {
+            if (op->val._v.child->next && (op->val._v.child->flag & f_const)) {
+                // 常量子表的尾部可直接共享
                 auto v = vm->val_obj(ast_qexpr);
-                vm->mem.push_root(v);
+                v->val._v.child = op->val._v.child->next;
+                v->val._v.count = op->val._v.count - 1;
+                VM_RET(v);
+            }
+            if (op->val._v.child->next) {
+                auto tmp = (chunk_bag *) frame->arg;
+                if (tmp == nullptr) {
+                    auto v = vm->val_obj(ast_qexpr);
+                    vm->mem.push_root(v);
 #if SHOW_ALLOCATE_NODE
-                printf("[DEBUG] ALLOC | addr: 0x%p, node: %-10s, for cdr\n", v, cast::ast_str(v->type).c_str());
+                    printf("[DEBUG] ALLOC | addr: 0x%p, node: %-10s, for cdr\n", v, cast::ast_str(v->type).c_str());
 #endif
-                auto i = op->val._v.child->next;
-                auto local = vm->copy(i);
-                v->val._v.child = local;
-                v->val._v.count = 1;
-                i = i->next;
-                while (i) {
-                    v->val._v.count++;
-                    local->next = vm->copy(i);
-                    local = local->next;
-                    i = i->next;
+                    v->val._v.child = nullptr;
+                    v->val._v.count = 0;
+                    tmp = chunk_begin(vm, frame, v);
+                    tmp->i = op->val._v.child->next;
                 }
-                vm->mem.pop_root();
-                VM_RET(v);
+                if (chunk_copy(vm, tmp))
+                    return s_call;
+                VM_RET(chunk_end(vm, tmp));
             } else {
                 VM_RET(VM_NIL);
             }
@@ -574,24 +1110,22 @@ MM.           MM      ,   MM    MM    `Y   MM      ,   MM  .     `MM   MM
 
         if (op2->type != ast_qexpr)
             vm->error("cons need Q-exp for second argument");
-        auto v = vm->val_obj(ast_qexpr);
-        vm->mem.push_root(v);
+        auto tmp = (chunk_bag *) frame->arg;
+        if (tmp == nullptr) {
+            auto v = vm->val_obj(ast_qexpr);
+            vm->mem.push_root(v);
 #if SHOW_ALLOCATE_NODE
-        printf("[DEBUG] ALLOC | addr: 0x%p, node: %-10s, for cons\n", v, cast::ast_str(v->type).c_str());
+            printf("[DEBUG] ALLOC | addr: 0x%p, node: %-10s, for cons\n", v, cast::ast_str(v->type).c_str());
 #endif
-        v->val._v.child = vm->copy(op);
-        v->val._v.count = 1 + op2->val._v.count;
-        auto i = op2->val._v.child;
-        auto local = vm->copy(i);
-        v->val._v.child->next = local;
-        i = i->next;
-        while (i) {
-            local->next = vm->copy(i);
-            local = local->next;
-            i = i->next;
+            v->val._v.child = nullptr;
+            v->val._v.count = 0;
+            tmp = chunk_begin(vm, frame, v);
+            chunk_push(vm, tmp, op);
+            tmp->i = op2->val._v.child;
         }
-        vm->mem.pop_root();
-        VM_RET(v);
+        if (chunk_copy(vm, tmp))
+            return s_call;
+        VM_RET(chunk_end(vm, tmp));
     }
 
     status_t builtins::def(cvm *vm, cframe *frame) {
@@ -657,12 +1191,16 @@ MM.           MM      ,   MM    MM    `Y   MM      ,   MM  .     `MM   MM
         return (cval **) ((char *) val + sizeof(cval));
     }
 
+    static cval **lambda_code(cval *val) {
+        return (cval **) ((char *) val + sizeof(cval) + sizeof(cval *));
+    }
+
     status_t builtins::call_lambda(cvm *vm, cframe *frame) {
         auto &val = frame->val;
         auto &env = frame->env;
         auto op = val->val._v.child;
         auto param = op->val._lambda.param;
-        auto body = op->val._lambda.body;
+        auto body = *lambda_code(op);
         if (val->val._v.count != param->val._v.count + 1)
             vm->error("lambda need valid argument size");
         if (frame->arg == nullptr) {
@@ -682,13 +1220,9 @@ MM.           MM      ,   MM    MM    `Y   MM      ,   MM  .     `MM   MM
                 _argument = _argument->next;
             }
             vm->mem.pop_root();
-            assert(body->type == ast_qexpr);
-            body->type = ast_sexpr;
-            return vm->call(cvm::eval, body, new_env, &(cval *&) frame->arg);
+            return vm->call(cvm::eval_code, body, new_env, &(cval *&) frame->arg);
         } else {
-            auto ret = (cval *) frame->arg;
-            body->type = ast_qexpr;
-            VM_RET(ret);
+            VM_RET((cval *) frame->arg);
         }
     }
 
@@ -698,25 +1232,10 @@ MM.           MM      ,   MM    MM    `Y   MM      ,   MM  .     `MM   MM
         if (val->val._v.count > 2)
             vm->error("eval not support more than one args");
         auto op = VM_OP(val);
-        struct tmp_bag {
-            bool qexp;
-            cval *ret;
-        };
         if (frame->arg == nullptr) {
-            auto tmp = vm->eval_tmp.alloc<tmp_bag>();
-            memset(tmp, 0, sizeof(tmp_bag));
-            tmp->qexp = op->type == ast_qexpr;
-            frame->arg = tmp;
-            if (tmp->qexp)
-                op->type = ast_sexpr;
-            return vm->call(cvm::eval, op, env, &tmp->ret);
+            return vm->call(cvm::eval_code, op, env, &(cval *&) frame->arg);
         } else {
-            auto tmp = (tmp_bag *) frame->arg;
-            if (tmp->qexp)
-                op->type = ast_qexpr;
-            auto ret = tmp->ret;
-            vm->eval_tmp.free(tmp);
-            VM_RET(ret);
+            VM_RET((cval *) frame->arg);
         }
     }
 
@@ -763,106 +1282,472 @@ MM.           MM      ,   MM    MM    `Y   MM      ,   MM  .     `MM   MM
             auto flag = true;
             if (op->type == ast_int && op->val._int == 0)
                 flag = false;
-            auto _t = op->next;
-            auto _f = _t->next;
-            if (_t->type != ast_qexpr)
-                vm->error("lambda need Q-exp for true branch");
-            if (_f->type != ast_qexpr)
-                vm->error("lambda need Q-exp for false branch");
-            if (flag) {
-                _t->type = ast_sexpr;
-                return vm->call(cvm::eval, _t, env, &(cval *&) frame->arg);
-            } else {
-                _f->type = ast_sexpr;
-                return vm->call(cvm::eval, _f, env, &(cval *&) frame->arg);
-            }
+            auto branch = flag ? op->next : op->next->next;
+            if (branch->type != ast_qexpr)
+                VM_RET(branch);
+            return vm->call(cvm::eval_code, branch, env, &(cval *&) frame->arg);
         } else {
             VM_RET((cval *) frame->arg);
         }
     }
 
-    status_t builtins::len(cvm *vm, cframe *frame) {
+    status_t builtins::special_if(cvm *vm, cframe *frame) {
         auto &val = frame->val;
-        auto op = VM_OP(val);
-        if (op->type != ast_qexpr)
-            vm->error("len requires Q-exp");
-        auto v = vm->val_obj(ast_int);
-        v->val._int = (int) op->val._v.count;
-        VM_RET(v);
+        auto cond = VM_OP(val);
+        if (frame->arg == nullptr) {
+            return vm->call(cvm::eval, cond, frame->env, &(cval *&) frame->arg);
+        }
+        auto op = (cval *) frame->arg;
+        auto flag = true;
+        if (op->type == ast_int && op->val._int == 0)
+            flag = false;
+        auto branch = flag ? cond->next : cond->next->next;
+        if (branch->type != ast_sexpr && branch->type != ast_qexpr && branch->type != ast_literal) {
+            VM_RET(vm->copy(branch)); // 分支仍连在代码中，不能直接返回
+        }
+        // 尾调用：当前帧直接改为求值分支
+        frame->fun = cvm::eval_code;
+        frame->val = branch;
+        frame->arg = nullptr;
+        return s_call;
     }
 
-    status_t builtins::index(cvm *vm, cframe *frame) {
+    status_t builtins::special_lambda(cvm *vm, cframe *frame) {
         auto &val = frame->val;
-        if (val->val._v.count != 3)
-            vm->error("index requires 2 args");
         auto op = VM_OP(val);
         if (op->type != ast_qexpr)
-            vm->error("len requires Q-exp for first arg");
-        if (op->next->type != ast_int)
-            vm->error("len requires int for second arg");
-        auto i = op->next->val._int;
-        auto size = op->val._v.count;
-        if (i >= 0 && i < size) {
-            auto node = op->val._v.child;
-            for (int j = 0; j < i; ++j) {
-                node = node->next;
+            vm->error("lambda need Q-exp for first argument");
+        for (auto i = op->val._v.child; i; i = i->next) {
+            if (i->type != ast_literal) {
+                vm->error("lambda need valid argument type");
             }
-            VM_RET(vm->copy(node));
         }
-        VM_RET(VM_NIL);
+        VM_RET(vm->val_lambda(op, op->next, frame->env));
     }
 
-    status_t builtins::append(cvm *vm, cframe *frame) {
+    status_t builtins::special_def(cvm *vm, cframe *frame) {
         auto &val = frame->val;
+        auto &env = frame->env;
         auto op = VM_OP(val);
-        if (op->type != ast_qexpr)
-            vm->error("append need Q-exp for first argument");
-        if (val->val._v.count == 2) {
-            VM_RET(vm->copy(op));
-        }
-        auto v = vm->copy(op);
-        vm->mem.push_root(v);
-#if SHOW_ALLOCATE_NODE
-        printf("[DEBUG] ALLOC | addr: 0x%p, node: %-10s, for append\n", v, cast::ast_str(v->type).c_str());
-#endif
-        auto i = op->next;
-        auto local = v->val._v.child;
-        while (local->next) {
-            local = local->next;
-        }
-        while (i) {
-            if (i->type == ast_qexpr) {
-                if (i->val._v.count > 0) {
-                    auto j = i->val._v.child;
-                    while (j) {
-                        local->next = vm->copy(j);
-                        local = local->next;
-                        j = j->next;
-                        v->val._v.count++;
+        struct tmp_bag {
+            cval *name;
+            cval *arg;
+            cval *first;
+            cval *r;
+        };
+        if (frame->arg == nullptr) {
+            if (op->type != ast_literal && op->type != ast_qexpr) {
+                frame->fun = cvm::eval_child; // 名字需要求值，交给内建的def
+                return s_call;
+            }
+            auto name = op;
+            auto count = 1U;
+            if (op->type == ast_qexpr) {
+                name = op->val._v.child;
+                count = op->val._v.count;
+                for (auto i = name; i; i = i->next) {
+                    if (i->type != ast_literal) {
+                        vm->error("def need literal for Q-exp");
                     }
-                    i = i->next;
-                } else {
-                    i = i->next;
                 }
-            } else {
-                local->next = vm->copy(i);
-                local = local->next;
-                i = i->next;
-                v->val._v.count++;
             }
+            if (count != val->val._v.count - 2)
+                vm->error("def need same size of Q-exp and argument");
+            auto tmp = vm->tmp_alloc<tmp_bag>();
+            memset(tmp, 0, sizeof(tmp_bag));
+            tmp->name = name;
+            tmp->arg = op->next;
+            frame->arg = tmp;
+            return vm->call(cvm::eval, tmp->arg, env, &tmp->r);
         }
-        vm->mem.pop_root();
-        VM_RET(v);
+        auto tmp = (tmp_bag *) frame->arg;
+        auto _def = vm->def(env, tmp->name->val._string, tmp->r);
+        if (tmp->first == nullptr)
+            tmp->first = _def;
+        tmp->arg = tmp->arg->next;
+        if (tmp->arg) {
+            tmp->name = tmp->name->next;
+            return vm->call(cvm::eval, tmp->arg, env, &tmp->r);
+        }
+        auto first = tmp->first;
+        vm->eval_tmp.free(tmp);
+        if (val->val._v.count == 3) {
+            VM_RET(vm->copy(first));
+        }
+        VM_RET(VM_NIL);
     }
 
-    status_t builtins::is_null(cvm *vm, cframe *frame) {
+    status_t builtins::special_begin(cvm *vm, cframe *frame) {
         auto &val = frame->val;
-        if (val->val._v.count != 2)
+        struct tmp_bag {
+            cval *i;
+            cval *r;
+        };
+        auto tmp = (tmp_bag *) frame->arg;
+        if (tmp == nullptr) {
+            tmp = vm->tmp_alloc<tmp_bag>();
+            memset(tmp, 0, sizeof(tmp_bag));
+            tmp->i = VM_OP(val);
+            frame->arg = tmp;
+        }
+        auto i = tmp->i;
+        if (i->next) {
+            tmp->i = i->next;
+            return vm->call(cvm::eval, i, frame->env, &tmp->r);
+        }
+        // 尾调用：最后一个表达式的值即为结果
+        vm->eval_tmp.free(tmp);
+        frame->fun = cvm::eval;
+        frame->val = i;
+        frame->arg = nullptr;
+        return s_call;
+    }
+
+    static bool int_arg(cval *val, slong &n) {
+        if (val->type == ast_int)
+            n = val->val._int;
+        else if (val->type == ast_long)
+            n = val->val._long;
+        else
+            return false;
+        return true;
+    }
+
+    // 循环在同一帧内迭代，每步经调度器返回一次，受周期预算约束
+    struct loop_bag {
+        cval *i; // 正在求值的表达式
+        cval *r;
+        cval *last; // 循环体最后一次的值
+        cval *env; // dotimes的循环环境
+        cval *scratch; // 本次求值的临时根
+        cval *keep; // last所在的临时根
+        slong k, n;
+    };
+
+    static bool is_true(cval *val) {
+        return !(val->type == ast_int && val->val._int == 0);
+    }
+
+    cval *builtins::scratch_begin(cvm *vm) {
+        // 临时根：一次求值产生的临时值都挂在它下面，弹出并摘下后由下一次回收整体释放
+        // 逃逸的值都已复制到环境或槽中，需要留下的结果由调用方另行复制或推迟摘下
+        auto v = vm->val_obj(ast_qexpr);
+        v->val._v.count = 0;
+        v->val._v.child = nullptr;
+        vm->mem.push_root(v);
+        return v;
+    }
+
+    void builtins::scratch_end(cvm *vm, cval *v) {
+        vm->mem.pop_root();
+        vm->mem.unlink(v);
+    }
+
+    status_t builtins::loop_eval(cvm *vm, loop_bag *tmp, cval *expr, cval *env) {
+        // 循环中的每次求值都挂在自己的临时根下，循环占用的堆不随次数增长
+        // 只有作为结果的last需要留到循环结束
+        tmp->scratch = scratch_begin(vm);
+        return vm->call(cvm::eval, expr, env, &tmp->r);
+    }
+
+    void builtins::loop_release(cvm *vm, loop_bag *tmp, bool keep) {
+        // 弹出临时根，keep时保留其中的结果并释放上一个结果
+        if (keep) {
+            vm->mem.pop_root();
+            if (tmp->keep)
+                vm->mem.unlink(tmp->keep);
+            tmp->keep = tmp->scratch;
+            tmp->last = tmp->r;
+        } else {
+            scratch_end(vm, tmp->scratch);
+        }
+        tmp->scratch = nullptr;
+    }
+
+    status_t builtins::special_while(cvm *vm, cframe *frame) {
+        // (while cond body...)，条件为真时反复求值循环体
+        auto &val = frame->val;
+        auto cond = VM_OP(val);
+        auto tmp = (loop_bag *) frame->arg;
+        if (tmp == nullptr) {
+            tmp = vm->tmp_alloc<loop_bag>();
+            memset(tmp, 0, sizeof(loop_bag));
+            tmp->i = cond;
+            frame->arg = tmp;
+            return loop_eval(vm, tmp, cond, frame->env);
+        }
+        if (tmp->i == cond) {
+            auto t = is_true(tmp->r);
+            loop_release(vm, tmp, false);
+            if (!t) {
+                auto last = tmp->last;
+                vm->eval_tmp.free(tmp);
+                VM_RET(last ? last : VM_NIL);
+            }
+            tmp->i = cond->next;
+        } else {
+            loop_release(vm, tmp, true);
+            tmp->i = tmp->i->next ? tmp->i->next : cond;
+        }
+        return loop_eval(vm, tmp, tmp->i, frame->env);
+    }
+
+    status_t builtins::special_do(cvm *vm, cframe *frame) {
+        // (do body... cond)，先求值循环体，条件为真时继续
+        auto &val = frame->val;
+        auto first = VM_OP(val);
+        auto tmp = (loop_bag *) frame->arg;
+        if (tmp == nullptr) {
+            tmp = vm->tmp_alloc<loop_bag>();
+            memset(tmp, 0, sizeof(loop_bag));
+            tmp->i = first;
+            frame->arg = tmp;
+            return loop_eval(vm, tmp, first, frame->env);
+        }
+        if (tmp->i->next == nullptr) {
+            auto t = is_true(tmp->r);
+            loop_release(vm, tmp, false);
+            if (!t) {
+                auto last = tmp->last;
+                vm->eval_tmp.free(tmp);
+                VM_RET(last ? last : VM_NIL);
+            }
+            tmp->i = first;
+        } else {
+            loop_release(vm, tmp, true);
+            tmp->i = tmp->i->next;
+        }
+        return loop_eval(vm, tmp, tmp->i, frame->env);
+    }
+
+    status_t builtins::special_dotimes(cvm *vm, cframe *frame) {
+        // (dotimes (i n) body...)，i从0到n-1，绑定在循环自己的环境中，原地更新
+        auto &val = frame->val;
+        auto spec = VM_OP(val);
+        auto tmp = (loop_bag *) frame->arg;
+        if (tmp == nullptr) {
+            if ((spec->type != ast_sexpr && spec->type != ast_qexpr) || spec->val._v.count != 2 ||
+                spec->val._v.child->type != ast_literal)
+                vm->error("dotimes need (name count) for first argument");
+            tmp = vm->tmp_alloc<loop_bag>();
+            memset(tmp, 0, sizeof(loop_bag));
+            tmp->i = spec->val._v.child->next;
+            frame->arg = tmp;
+            return loop_eval(vm, tmp, tmp->i, frame->env);
+        }
+        auto name = spec->val._v.child->val._string;
+        if (tmp->env == nullptr) {
+            auto ok = int_arg(tmp->r, tmp->n);
+            loop_release(vm, tmp, false);
+            if (!ok)
+                vm->error("dotimes need integer count");
+            if (tmp->n <= 0) {
+                vm->eval_tmp.free(tmp);
+                VM_RET(VM_NIL);
+            }
+            tmp->env = vm->new_env(frame->env);
+            vm->mem.push_root(tmp->env);
+            (*tmp->env->val._env.env)[name] = int_val(vm, 0);
+            vm->mem.pop_root();
+            tmp->i = spec->next;
+            return loop_eval(vm, tmp, tmp->i, tmp->env);
+        }
+        loop_release(vm, tmp, false);
+        if (tmp->i->next) {
+            tmp->i = tmp->i->next;
+            return loop_eval(vm, tmp, tmp->i, tmp->env);
+        }
+        if (++tmp->k == tmp->n) {
+            vm->eval_tmp.free(tmp);
+            VM_RET(VM_NIL);
+        }
+        auto &var = (*tmp->env->val._env.env)[name];
+        if (var->type == ast_int && tmp->k <= std::numeric_limits<int>::max()) {
+            var->val._int = (int) tmp->k;
+        } else if (var->type == ast_long) {
+            var->val._long = tmp->k;
+        } else { // 被循环体重新def过，或超出int范围
+            vm->mem.push_root(tmp->env);
+            auto v = int_val(vm, tmp->k);
+            vm->mem.pop_root();
+            vm->mem.unlink(tmp->env, var);
+            var = v;
+        }
+        tmp->i = spec->next;
+        return loop_eval(vm, tmp, tmp->i, tmp->env);
+    }
+
+    status_t builtins::let_bind(cvm *vm, cframe *frame, bool seq) {
+        // (let ((a 1) (b 2)) body...)，绑定存放在槽环境中，不建哈希表
+        // let的初值在外层环境求值，let*在已绑定的槽环境中求值
+        auto &val = frame->val;
+        auto spec = VM_OP(val);
+        struct tmp_bag {
+            cval *bind; // 正在求值的绑定
+            cval *i; // 正在求值的函数体表达式
+            cval *r;
+            cval *env;
+        };
+        auto tmp = (tmp_bag *) frame->arg;
+        if (tmp == nullptr) {
+            if (spec->type != ast_sexpr && spec->type != ast_qexpr)
+                vm->error("let need list of bindings");
+            for (auto i = spec->val._v.child; i; i = i->next) {
+                if ((i->type != ast_sexpr && i->type != ast_qexpr) || i->val._v.count != 2 ||
+                    i->val._v.child->type != ast_literal)
+                    vm->error("let need (name value) for binding");
+            }
+            tmp = vm->tmp_alloc<tmp_bag>();
+            memset(tmp, 0, sizeof(tmp_bag));
+            tmp->env = vm->slot_env(frame->env, spec->val._v.count);
+            frame->arg = tmp;
+            tmp->bind = spec->val._v.child;
+            if (tmp->bind)
+                return vm->call(cvm::eval, tmp->bind->val._v.child->next, seq ? tmp->env : frame->env, &tmp->r);
+            tmp->i = spec->next;
+            return vm->call(cvm::eval, tmp->i, tmp->env, &tmp->r);
+        }
+        auto env = tmp->env;
+        if (tmp->i == nullptr) {
+            auto &slot = cvm::slot_data(env)[env->val._slots.count++];
+            slot.name = tmp->bind->val._v.child->val._string;
+            slot.val = tmp->r;
+            tmp->bind = tmp->bind->next;
+            if (tmp->bind)
+                return vm->call(cvm::eval, tmp->bind->val._v.child->next, seq ? env : frame->env, &tmp->r);
+            tmp->i = spec->next;
+            return vm->call(cvm::eval, tmp->i, env, &tmp->r);
+        }
+        if (tmp->i->next) {
+            tmp->i = tmp->i->next;
+            return vm->call(cvm::eval, tmp->i, env, &tmp->r);
+        }
+        auto r = tmp->r;
+        vm->eval_tmp.free(env);
+        vm->eval_tmp.free(tmp);
+        VM_RET(r);
+    }
+
+    status_t builtins::special_let(cvm *vm, cframe *frame) {
+        return let_bind(vm, frame, false);
+    }
+
+    status_t builtins::special_let_star(cvm *vm, cframe *frame) {
+        return let_bind(vm, frame, true);
+    }
+
+    status_t builtins::len(cvm *vm, cframe *frame) {
+        auto &val = frame->val;
+        auto op = VM_OP(val);
+        if (op->type == ast_array || op->type == ast_string) {
+            auto v = vm->val_obj(ast_int);
+            v->val._int = (int) (op->type == ast_array ? op->val._array->size : cvm::string_size(op));
+            VM_RET(v);
+        }
+        if (op->type != ast_qexpr)
+            vm->error("len requires Q-exp");
+        auto v = vm->val_obj(ast_int);
+        v->val._int = (int) op->val._v.count;
+        VM_RET(v);
+    }
+
+    status_t builtins::index(cvm *vm, cframe *frame) {
+        auto &val = frame->val;
+        if (val->val._v.count != 3)
+            vm->error("index requires 2 args");
+        auto op = VM_OP(val);
+        if (op->type != ast_qexpr && op->type != ast_array)
+            vm->error("len requires Q-exp for first arg");
+        if (op->next->type != ast_int)
+            vm->error("len requires int for second arg");
+        auto i = op->next->val._int;
+        if (op->type == ast_array) {
+            auto arr = op->val._array;
+            if (i < 0 || (size_t) i >= arr->size)
+                VM_RET(VM_NIL);
+            if (arr->type == arr_f64) {
+                auto v = vm->val_obj(ast_double);
+                v->val._double = arr->f64[i];
+                VM_RET(v);
+            }
+            VM_RET(vm->val_integer(cbignum(arr->i64[i])));
+        }
+        auto size = op->val._v.count;
+        if (i >= 0 && i < size) {
+            auto node = op->val._v.child;
+            for (int j = 0; j < i; ++j) {
+                node = node->next;
+            }
+            VM_RET(vm->copy(node));
+        }
+        VM_RET(VM_NIL);
+    }
+
+    status_t builtins::append(cvm *vm, cframe *frame) {
+        auto &val = frame->val;
+        auto op = VM_OP(val);
+        if (op->type != ast_qexpr)
+            vm->error("append need Q-exp for first argument");
+        if (val->val._v.count == 2) {
+            VM_RET(vm->copy(op));
+        }
+        auto tmp = (chunk_bag *) frame->arg;
+        if (tmp == nullptr) {
+            // 逐个复制元素，结果不与参数共享子表
+            auto v = vm->val_obj(ast_qexpr);
+            vm->mem.push_root(v);
+#if SHOW_ALLOCATE_NODE
+            printf("[DEBUG] ALLOC | addr: 0x%p, node: %-10s, for append\n", v, cast::ast_str(v->type).c_str());
+#endif
+            v->val._v.child = nullptr;
+            v->val._v.count = 0;
+            tmp = chunk_begin(vm, frame, v);
+            tmp->i = op;
+            tmp->j = op->val._v.count > 0 ? op->val._v.child : nullptr;
+        }
+        for (auto n = 0; n < VM_CHUNK && tmp->i; n++) {
+            auto &i = tmp->i;
+            if (i->type == ast_qexpr && tmp->j) {
+                chunk_push(vm, tmp, tmp->j);
+                tmp->j = tmp->j->next;
+                continue;
+            }
+            if (i->type != ast_qexpr)
+                chunk_push(vm, tmp, i);
+            i = i->next;
+            tmp->j = i && i->type == ast_qexpr && i->val._v.count > 0 ? i->val._v.child : nullptr;
+        }
+        if (tmp->i)
+            return s_call;
+        VM_RET(chunk_end(vm, tmp));
+    }
+
+    status_t builtins::is_null(cvm *vm, cframe *frame) {
+        auto &val = frame->val;
+        if (val->val._v.count != 2)
             vm->error("null? requires 1 args");
         auto op = VM_OP(val);
         VM_RET(vm->val_bool(op->type == ast_qexpr && op->val._v.count == 0));
     }
 
+    status_t builtins::is_equal(cvm *vm, cframe *frame) {
+        auto &val = frame->val;
+        if (val->val._v.count != 3)
+            vm->error("equal? requires 2 args");
+        auto op = VM_OP(val);
+        VM_RET(vm->val_bool(cvm::equal(op, op->next)));
+    }
+
+    status_t builtins::hash(cvm *vm, cframe *frame) {
+        auto &val = frame->val;
+        if (val->val._v.count != 2)
+            vm->error("hash requires 1 args");
+        auto op = VM_OP(val);
+        auto v = vm->val_obj(ast_long);
+        v->val._long = (slong) cvm::hash(op);
+        VM_RET(v);
+    }
+
     status_t builtins::type(cvm *vm, cframe *frame) {
         auto &val = frame->val;
         if (val->val._v.count != 2)
@@ -876,7 +1761,7 @@ MM.           MM      ,   MM    MM    `Y   MM      ,   MM  .     `MM   MM
             return;
         switch (val->type) {
             case ast_string:
-                os << val->val._string;
+                os.write(cvm::string_data(val), cvm::string_size(val));
                 break;
             case ast_char:
                 os << val->val._char;
@@ -891,9 +1776,40 @@ MM.           MM      ,   MM    MM    `Y   MM      ,   MM  .     `MM   MM
         if (val->val._v.count != 2)
             vm->error("str requires 1 args");
         auto op = VM_OP(val);
+        auto tmp = (chunk_bag *) frame->arg;
+        if (tmp == nullptr) {
+            if (op->type == ast_string)
+                VM_RET(vm->copy(op));
+            if (op->type != ast_qexpr || op->val._v.count <= VM_CHUNK) {
+                std::stringstream ss;
+                stringify(op, ss);
+                auto s = ss.str();
+                VM_RET(vm->val_str(ast_string, s.c_str(), s.length()));
+            }
+            // 长表分块输出，每块的文本作为字符串片段挂在结果表下，最后一次拼接
+            auto v = vm->val_obj(ast_qexpr);
+            vm->mem.push_root(v);
+            v->val._v.child = nullptr;
+            v->val._v.count = 0;
+            tmp = chunk_begin(vm, frame, v);
+            tmp->i = op->val._v.child;
+        }
         std::stringstream ss;
-        stringify(op, ss);
-        VM_RET(vm->val_str(ast_string, ss.str().c_str()));
+        if (!tmp->local)
+            ss << "`(";
+        for (auto n = 0; n < VM_CHUNK && tmp->i; n++, tmp->i = tmp->i->next)
+            cvm::print(tmp->i, ss);
+        if (!tmp->i)
+            ss << ')';
+        auto piece = ss.str();
+        chunk_link(tmp, vm->val_str(ast_string, piece.c_str(), piece.length()));
+        if (tmp->i)
+            return s_call;
+        auto v = chunk_end(vm, tmp);
+        string_t text;
+        for (auto i = v->val._v.child; i; i = i->next)
+            text.append(cvm::string_data(i), cvm::string_size(i));
+        VM_RET(vm->val_str(ast_string, text.c_str(), text.length()));
     }
 
     status_t builtins::word(cvm *vm, cframe *frame) {
@@ -903,27 +1819,27 @@ MM.           MM      ,   MM    MM    `Y   MM      ,   MM  .     `MM   MM
         auto op = VM_OP(val);
         if (op->type != ast_string)
             vm->error("word requires string");
-        auto s = string_t(op->val._string);
-        auto v = vm->val_obj(ast_qexpr);
-        v->val._v.count = 0;
-        v->val._v.child = nullptr;
-        if (s.empty()) {
-            VM_RET(v);
-        }
-        vm->mem.push_root(v);
+        auto len = cvm::string_size(op);
+        auto tmp = (chunk_bag *) frame->arg;
+        if (tmp == nullptr) {
+            auto v = vm->val_obj(ast_qexpr);
+            v->val._v.count = 0;
+            v->val._v.child = nullptr;
+            if (len == 0) {
+                VM_RET(v);
+            }
+            vm->mem.push_root(v);
 #if SHOW_ALLOCATE_NODE
-        printf("[DEBUG] ALLOC | addr: 0x%p, node: %-10s, for word\n", v, cast::ast_str(v->type).c_str());
+            printf("[DEBUG] ALLOC | addr: 0x%p, node: %-10s, for word\n", v, cast::ast_str(v->type).c_str());
 #endif
-        auto len = s.length();
-        v->val._v.count = len;
-        v->val._v.child = vm->val_char(s[0]);
-        auto local = v->val._v.child;
-        for (auto i = 1; i < len; i++) {
-            local->next = vm->val_char(s[i]);
-            local = local->next;
+            tmp = chunk_begin(vm, frame, v);
         }
-        vm->mem.pop_root();
-        VM_RET(v);
+        auto s = cvm::string_data(op);
+        for (auto n = 0; n < VM_CHUNK && tmp->k < len; n++)
+            chunk_link(tmp, vm->val_char(s[tmp->k++]));
+        if (tmp->k < len)
+            return s_call;
+        VM_RET(chunk_end(vm, tmp));
     }
 
     status_t builtins::print(cvm *vm, cframe *frame) {
@@ -931,15 +1847,9 @@ MM.           MM      ,   MM    MM    `Y   MM      ,   MM  .     `MM   MM
         if (val->val._v.count != 2)
             vm->error("str requires 1 args");
         auto op = VM_OP(val);
-        decltype(op->val._string) s;
-        if (op->type != ast_string) {
-            std::stringstream ss;
-            stringify(op, ss);
-            s = ss.str().c_str();
-        } else {
-            s = op->val._string;
-        }
-        std::cout << s;
+        std::stringstream ss;
+        stringify(op, ss);
+        vm->host->put_string(ss.str());
         VM_RET(VM_NIL);
     }
 
@@ -954,28 +1864,28 @@ MM.           MM      ,   MM    MM    `Y   MM      ,   MM  .     `MM   MM
                 auto str = op->val._string;
                 if (strequ(str, "cycle") && count == 2 && op->next->type == ast_int) {
                     auto cycle = op->next->val._int;
-                    cgui::singleton().set_cycle(cycle);
+                    vm->host->set_cycle(cycle);
                 } else if (strequ(str, "ticks") && count == 2 && op->next->type == ast_int) {
                     auto cycle = op->next->val._int;
-                    cgui::singleton().set_ticks(cycle);
+                    vm->host->set_ticks(cycle);
                 } else if (strequ(str, "record") && count == 1) {
                     if (frame->arg != (void *) 1) {
-                        cgui::singleton().record();
+                        vm->host->record();
                         frame->arg = (void *) 1;
                     }
                 } else if (strequ(str, "continue") && count == 1) {
                     if (frame->arg != (void *) 1) {
-                        cgui::singleton().control(0);
+                        vm->host->control(0);
                         frame->arg = (void *) 1;
                     }
                 } else if (strequ(str, "break") && count == 1) {
                     if (frame->arg != (void *) 1) {
-                        cgui::singleton().control(1);
+                        vm->host->control(1);
                         frame->arg = (void *) 1;
                     }
                 } else if (strequ(str, "wait") && count == 2 && op->next->type == ast_double) {
                     auto offset = op->next->val._double;
-                    if (!cgui::singleton().reach(offset))
+                    if (!vm->host->reach(offset))
                         not_ret = true;
                 }
             }
@@ -993,7 +1903,7 @@ MM.           MM      ,   MM    MM    `Y   MM      ,   MM  .     `MM   MM
         auto op = VM_OP(val);
         if (op->type != ast_qexpr)
             vm->error("attr requires Q-exp at first");
-        auto v = vm->copy(op);
+        auto v = vm->copy(op, false);
         v->val._v.count = val->val._v.count - 1;
         vm->mem.push_root(v);
 #if SHOW_ALLOCATE_NODE
@@ -1010,6 +1920,1720 @@ MM.           MM      ,   MM    MM    `Y   MM      ,   MM  .     `MM   MM
         VM_RET(v);
     }
 
+    // 字符串
+
+    static bool is_callable(cval *val) {
+        return val->type == ast_lambda || val->type == ast_sub || val->type == ast_memo;
+    }
+
+    static cval *string_arg(cvm *vm, cval *val, const char *name) {
+        if (!val || val->type != ast_string)
+            vm->error(string_t(name) + " requires string");
+        return val;
+    }
+
+    // 先用memchr（库中为SIMD实现）定位首字节，再比较其余部分
+    static const char *string_search(const char *s, size_t n, const char *p, size_t m) {
+        if (m == 0)
+            return s;
+        if (m > n)
+            return nullptr;
+        auto end = s + (n - m + 1);
+        for (auto i = s; i < end; i++) {
+            i = (const char *) memchr(i, p[0], end - i);
+            if (!i)
+                return nullptr;
+            if (memcmp(i + 1, p + 1, m - 1) == 0)
+                return i;
+        }
+        return nullptr;
+    }
+
+    status_t builtins::substring(cvm *vm, cframe *frame) {
+        auto &val = frame->val;
+        auto count = val->val._v.count;
+        if (count != 3 && count != 4)
+            vm->error("substring requires 2 or 3 args");
+        auto op = string_arg(vm, VM_OP(val), "substring");
+        auto size = (slong) cvm::string_size(op);
+        slong start = 0, end = size;
+        if (!int_arg(op->next, start) || (count == 4 && !int_arg(op->next->next, end)))
+            vm->error("substring requires int index");
+        if (start < 0 || end > size || start > end)
+            vm->error("substring index out of range");
+        VM_RET(vm->val_slice(op, (size_t) start, (size_t) (end - start)));
+    }
+
+    status_t builtins::string_find(cvm *vm, cframe *frame) {
+        auto &val = frame->val;
+        auto count = val->val._v.count;
+        if (count != 3 && count != 4)
+            vm->error("string-find requires 2 or 3 args");
+        auto op = string_arg(vm, VM_OP(val), "string-find");
+        auto pat = string_arg(vm, op->next, "string-find");
+        auto size = cvm::string_size(op);
+        slong start = 0;
+        if (count == 4 && !int_arg(pat->next, start))
+            vm->error("string-find requires int index");
+        if (start < 0 || (size_t) start > size)
+            vm->error("string-find index out of range");
+        auto s = cvm::string_data(op);
+        auto r = string_search(s + start, size - start, cvm::string_data(pat), cvm::string_size(pat));
+        auto v = vm->val_obj(ast_int);
+        v->val._int = r ? (int) (r - s) : -1;
+        VM_RET(v);
+    }
+
+    status_t builtins::string_split(cvm *vm, cframe *frame) {
+        auto &val = frame->val;
+        if (val->val._v.count != 3)
+            vm->error("string-split requires 2 args");
+        auto op = string_arg(vm, VM_OP(val), "string-split");
+        auto sep = string_arg(vm, op->next, "string-split");
+        auto m = cvm::string_size(sep);
+        if (m == 0)
+            vm->error("string-split requires non-empty separator");
+        auto s = cvm::string_data(op), p = cvm::string_data(sep);
+        auto n = cvm::string_size(op);
+        auto v = vm->val_obj(ast_qexpr);
+        v->val._v.count = 0;
+        v->val._v.child = nullptr;
+        vm->mem.push_root(v);
+        cval *local = nullptr;
+        size_t start = 0;
+        while (true) {
+            auto r = string_search(s + start, n - start, p, m);
+            auto end = r ? (size_t) (r - s) : n;
+            auto item = vm->val_slice(op, start, end - start); // 长字符串的切片共享数据
+            if (local)
+                local->next = item;
+            else
+                v->val._v.child = item;
+            local = item;
+            v->val._v.count++;
+            if (!r)
+                break;
+            start = end + m;
+        }
+        vm->mem.pop_root();
+        VM_RET(v);
+    }
+
+    status_t builtins::string_join(cvm *vm, cframe *frame) {
+        auto &val = frame->val;
+        if (val->val._v.count != 3)
+            vm->error("string-join requires 2 args");
+        auto op = VM_OP(val);
+        if (op->type != ast_qexpr)
+            vm->error("string-join requires Q-exp");
+        auto sep = string_arg(vm, op->next, "string-join");
+        size_t len = 0;
+        for (auto i = op->val._v.child; i; i = i->next) {
+            string_arg(vm, i, "string-join");
+            len += cvm::string_size(i) + (i->next ? cvm::string_size(sep) : 0);
+        }
+        string_t s;
+        s.reserve(len);
+        for (auto i = op->val._v.child; i; i = i->next) {
+            s.append(cvm::string_data(i), cvm::string_size(i));
+            if (i->next)
+                s.append(cvm::string_data(sep), cvm::string_size(sep));
+        }
+        VM_RET(vm->val_str(ast_string, s.c_str(), s.length()));
+    }
+
+    status_t builtins::string_replace(cvm *vm, cframe *frame) {
+        auto &val = frame->val;
+        if (val->val._v.count != 4)
+            vm->error("string-replace requires 3 args");
+        auto op = string_arg(vm, VM_OP(val), "string-replace");
+        auto from = string_arg(vm, op->next, "string-replace");
+        auto to = string_arg(vm, from->next, "string-replace");
+        auto m = cvm::string_size(from);
+        if (m == 0)
+            vm->error("string-replace requires non-empty pattern");
+        auto s = cvm::string_data(op), p = cvm::string_data(from);
+        auto n = cvm::string_size(op);
+        auto r = string_search(s, n, p, m);
+        if (!r)
+            VM_RET(vm->copy(op));
+        string_t out;
+        out.reserve(n);
+        size_t start = 0;
+        while (r) {
+            out.append(s + start, r - s - start);
+            out.append(cvm::string_data(to), cvm::string_size(to));
+            start = r - s + m;
+            r = string_search(s + start, n - start, p, m);
+        }
+        out.append(s + start, n - start);
+        VM_RET(vm->val_str(ast_string, out.c_str(), out.length()));
+    }
+
+    static string_t string_map(cvm *vm, cframe *frame, const char *name, int (*f)(int)) {
+        auto &val = frame->val;
+        if (val->val._v.count != 2)
+            vm->error(string_t(name) + " requires 1 args");
+        auto op = string_arg(vm, VM_OP(val), name);
+        auto s = cvm::string_data(op);
+        string_t out(s, cvm::string_size(op));
+        for (auto &c : out)
+            c = (char) f((unsigned char) c);
+        return out;
+    }
+
+    status_t builtins::string_upcase(cvm *vm, cframe *frame) {
+        auto s = string_map(vm, frame, "string-upcase", toupper);
+        VM_RET(vm->val_str(ast_string, s.c_str(), s.length()));
+    }
+
+    status_t builtins::string_downcase(cvm *vm, cframe *frame) {
+        auto s = string_map(vm, frame, "string-downcase", tolower);
+        VM_RET(vm->val_str(ast_string, s.c_str(), s.length()));
+    }
+
+    status_t builtins::string_to_number(cvm *vm, cframe *frame) {
+        auto &val = frame->val;
+        if (val->val._v.count != 2)
+            vm->error("string->number requires 1 args");
+        auto op = string_arg(vm, VM_OP(val), "string->number");
+        auto s = cvm::string_data(op);
+        auto n = cvm::string_size(op);
+        size_t i = s[0] == '-' || s[0] == '+' ? 1 : 0;
+        if (i < n && std::all_of(s + i, s + n, [](char c) { return isdigit(c) != 0; })) {
+            // 每次累加9位，超出long时得到大整数
+            cbignum r(0);
+            while (i < n) {
+                auto k = std::min<size_t>(9, n - i);
+                slong chunk = 0, scale = 1;
+                for (size_t j = 0; j < k; j++) {
+                    chunk = chunk * 10 + (s[i + j] - '0');
+                    scale *= 10;
+                }
+                r = r * cbignum(scale) + cbignum(chunk);
+                i += k;
+            }
+            VM_RET(vm->val_integer(s[0] == '-' ? -r : r));
+        }
+        auto str = cvm::string_cstr(op);
+        char *end;
+        auto d = strtod(str, &end);
+        if (n > 0 && end == str + n) {
+            auto v = vm->val_obj(ast_double);
+            v->val._double = d;
+            VM_RET(v);
+        }
+        VM_RET(VM_NIL);
+    }
+
+    // 序列
+
+    static slong range_size(slong a, slong b, slong step) {
+        // 半开区间[a, b)
+        auto n = step > 0 ? (b - a + step - 1) / step : (a - b - step - 1) / -step;
+        return std::max<slong>(n, 0);
+    }
+
+    status_t builtins::apply_each(cvm *vm, cframe *frame, apply_t kind) {
+        // 逐个元素经调度器调用函数，调用表达式只分配一次，结果只分配一个列表
+        struct tmp_bag {
+            cval *app; // (f x) 或 (f acc x)，参数每步重新接上
+            cval *i; // 下一个元素
+            cval **rev; // foldr按逆序访问
+            uint n;
+            lazy_iter *it; // 惰性序列逐个拉取
+            bool pull;
+            cval *x;
+            cval *acc;
+            cval *v;
+            cval *local;
+            cval *r;
+            cval *scratch; // 本元素调用的临时根
+            cval *keep; // fold的累积值所在的临时根
+        };
+        static const char *names[] = {"map", "filter", "for-each", "foldl", "foldr"};
+        auto &val = frame->val;
+        auto fold = kind == ap_foldl || kind == ap_foldr;
+        auto tmp = (tmp_bag *) frame->arg;
+        if (tmp == nullptr) {
+            if (val->val._v.count != (fold ? 4 : 3))
+                vm->error(string_t(names[kind]) + (fold ? " requires 3 args" : " requires 2 args"));
+            auto f = VM_OP(val);
+            auto L = fold ? f->next->next : f->next;
+            if (!is_callable(f))
+                vm->error(string_t(names[kind]) + " requires function");
+            if (L->type == ast_seq && (kind == ap_map || kind == ap_filter))
+                VM_RET(vm->val_seq(kind == ap_map ? lz_map : lz_filter, L, f)); // 惰性阶段，遍历时才调用
+            if (L->type != ast_qexpr && !(L->type == ast_seq && kind != ap_foldr))
+                vm->error(string_t(names[kind]) + " requires Q-exp");
+            tmp = vm->tmp_alloc<tmp_bag>();
+            memset(tmp, 0, sizeof(tmp_bag));
+            if (kind == ap_foldr && L->val._v.count > 0) {
+                tmp->rev = vm->tmp_alloc<cval *>(L->val._v.count);
+                if (!tmp->rev) {
+                    vm->eval_tmp.free(tmp);
+                    vm->error("foldr list too long");
+                }
+                for (auto i = L->val._v.child; i; i = i->next)
+                    tmp->rev[tmp->n++] = i;
+            }
+            frame->arg = tmp;
+            auto app = vm->val_obj(ast_sexpr);
+            vm->mem.push_root(app);
+            app->val._v.child = vm->copy(f);
+            app->val._v.count = fold ? 3 : 2;
+            if (fold)
+                tmp->acc = vm->copy(f->next); // 初值仍连在参数表中
+            vm->mem.pop_root();
+            tmp->app = app;
+            if (L->type == ast_seq)
+                tmp->it = lazy_open(vm, L);
+            else
+                tmp->i = L->val._v.child;
+            if (kind == ap_map || kind == ap_filter) {
+                auto v = vm->val_obj(ast_qexpr);
+                v->val._v.child = nullptr;
+                v->val._v.count = 0;
+                tmp->v = v;
+            }
+        } else if (!tmp->pull) {
+            // 每个元素的调用都在自己的临时根下，结果复制进列表后整体摘下，
+            // fold的累积值留在其临时根中，到下一个累积值产生时再摘下
+            auto r = tmp->r;
+            cval *item = nullptr;
+            switch (kind) {
+                case ap_map:
+                case ap_filter:
+                    if (kind == ap_map || !(r->type == ast_int && r->val._int == 0)) {
+                        vm->mem.push_root(tmp->v);
+                        item = vm->copy(kind == ap_map ? r : tmp->x);
+                        vm->mem.pop_root();
+                    }
+                    break;
+                case ap_foldl:
+                case ap_foldr:
+                    tmp->acc = vm->copy(r); // 结果可能与上一个累积值共用结点，复制到本次的临时根中
+                    break;
+                default:
+                    break;
+            }
+            if (fold) {
+                vm->mem.pop_root();
+                if (tmp->keep)
+                    vm->mem.unlink(tmp->keep);
+                tmp->keep = tmp->scratch;
+            } else {
+                scratch_end(vm, tmp->scratch);
+            }
+            tmp->scratch = nullptr;
+            if (item) {
+                item->next = nullptr;
+                if (tmp->local)
+                    tmp->local->next = item;
+                else
+                    tmp->v->val._v.child = item;
+                tmp->local = item;
+                tmp->v->val._v.count++;
+            }
+        }
+        cval *x;
+        if (tmp->it) {
+            if (!tmp->pull) {
+                tmp->pull = true;
+                tmp->scratch = scratch_begin(vm); // 拉取的元素与上游的临时值也挂在本元素的临时根下
+                return lazy_next(vm, tmp->it, frame->env, &tmp->r);
+            }
+            tmp->pull = false;
+            x = tmp->r;
+        } else if (kind == ap_foldr) {
+            x = tmp->n > 0 ? tmp->rev[--tmp->n] : nullptr;
+        } else {
+            x = tmp->i;
+            if (x)
+                tmp->i = x->next;
+        }
+        if (!x) {
+            if (tmp->scratch)
+                scratch_end(vm, tmp->scratch);
+            cval *r;
+            if (fold)
+                r = tmp->acc;
+            else if (tmp->v)
+                r = tmp->v;
+            else
+                r = VM_NIL;
+            if (tmp->rev)
+                vm->eval_tmp.free_array(tmp->rev);
+            if (tmp->it)
+                lazy_close(vm, tmp->it);
+            vm->eval_tmp.free(tmp);
+            VM_RET(r);
+        }
+        auto f = tmp->app->val._v.child;
+        cval *arg = x; // 拉取到的元素是新值
+        if (!tmp->it) {
+            tmp->scratch = scratch_begin(vm);
+            arg = vm->copy(x);
+        }
+        arg->next = nullptr;
+        tmp->x = arg;
+        if (kind == ap_foldl) {
+            f->next = tmp->acc;
+            tmp->acc->next = arg;
+        } else if (kind == ap_foldr) {
+            f->next = arg;
+            arg->next = tmp->acc;
+            tmp->acc->next = nullptr;
+        } else {
+            f->next = arg;
+        }
+        tmp->r = nullptr;
+        return vm->call(cvm::eval_child, tmp->app, frame->env, &tmp->r);
+    }
+
+    status_t builtins::map(cvm *vm, cframe *frame) {
+        return apply_each(vm, frame, ap_map);
+    }
+
+    status_t builtins::filter(cvm *vm, cframe *frame) {
+        return apply_each(vm, frame, ap_filter);
+    }
+
+    status_t builtins::for_each(cvm *vm, cframe *frame) {
+        return apply_each(vm, frame, ap_for_each);
+    }
+
+    status_t builtins::foldl(cvm *vm, cframe *frame) {
+        return apply_each(vm, frame, ap_foldl);
+    }
+
+    status_t builtins::foldr(cvm *vm, cframe *frame) {
+        return apply_each(vm, frame, ap_foldr);
+    }
+
+    cval *builtins::int_val(cvm *vm, slong n) {
+        if (n >= std::numeric_limits<int>::min() && n <= std::numeric_limits<int>::max()) {
+            auto v = vm->val_obj(ast_int);
+            v->val._int = (int) n;
+            return v;
+        }
+        auto v = vm->val_obj(ast_long);
+        v->val._long = n;
+        return v;
+    }
+
+    status_t builtins::int_list(cvm *vm, cframe *frame, slong start, slong step, slong n) {
+        // 参数每步重新解析，进度记在tmp->k
+        auto tmp = (chunk_bag *) frame->arg;
+        if (tmp == nullptr) {
+            auto v = vm->val_obj(ast_qexpr);
+            v->val._v.child = nullptr;
+            v->val._v.count = 0;
+            if (n == 0)
+                VM_RET(v);
+            vm->mem.push_root(v);
+            tmp = chunk_begin(vm, frame, v);
+        }
+        for (auto c = 0; c < VM_CHUNK && (slong) tmp->k < n; c++, tmp->k++)
+            chunk_link(tmp, int_val(vm, start + (slong) tmp->k * step));
+        if ((slong) tmp->k < n)
+            return s_call;
+        VM_RET(chunk_end(vm, tmp));
+    }
+
+    status_t builtins::range(cvm *vm, cframe *frame) {
+        auto &val = frame->val;
+        auto count = val->val._v.count;
+        if (count != 3 && count != 4)
+            vm->error("range requires 2 or 3 args");
+        auto op = VM_OP(val);
+        slong a = 0, b = 0, step = 1;
+        if (!int_arg(op, a) || !int_arg(op->next, b) || (count == 4 && !int_arg(op->next->next, step)))
+            vm->error("range requires integer");
+        if (step == 0)
+            vm->error("range requires non-zero step");
+        return int_list(vm, frame, a, step, range_size(a, b, step));
+    }
+
+    status_t builtins::iota(cvm *vm, cframe *frame) {
+        auto &val = frame->val;
+        auto count = val->val._v.count;
+        if (count < 2 || count > 4)
+            vm->error("iota requires 1 to 3 args");
+        auto op = VM_OP(val);
+        slong n, start = 0, step = 1;
+        if (!int_arg(op, n) || (count >= 3 && !int_arg(op->next, start)) ||
+            (count == 4 && !int_arg(op->next->next, step)))
+            vm->error("iota requires integer");
+        if (n < 0)
+            vm->error("iota requires non-negative size");
+        return int_list(vm, frame, start, step, n);
+    }
+
+    status_t builtins::reverse(cvm *vm, cframe *frame) {
+        auto &val = frame->val;
+        if (val->val._v.count != 2)
+            vm->error("reverse requires 1 args");
+        auto op = VM_OP(val);
+        if (op->type != ast_qexpr)
+            vm->error("reverse requires Q-exp");
+        auto tmp = (chunk_bag *) frame->arg;
+        if (tmp == nullptr) {
+            auto v = vm->val_obj(ast_qexpr);
+            v->val._v.child = nullptr;
+            v->val._v.count = 0;
+            if (op->val._v.count == 0)
+                VM_RET(v);
+            vm->mem.push_root(v);
+            tmp = chunk_begin(vm, frame, v);
+            tmp->i = op->val._v.child;
+        }
+        auto v = tmp->v;
+        for (auto n = 0; n < VM_CHUNK && tmp->i; n++, tmp->i = tmp->i->next) {
+            auto item = vm->copy(tmp->i);
+            item->next = v->val._v.child;
+            v->val._v.child = item;
+            v->val._v.count++;
+        }
+        if (tmp->i)
+            return s_call;
+        VM_RET(chunk_end(vm, tmp));
+    }
+
+    // 排序
+
+    struct sort_item {
+        cval *key;
+        cval *val;
+    };
+
+    enum sort_key_t {
+        sk_none,
+        sk_int,
+        sk_float,
+        sk_string,
+    };
+
+    static sort_key_t sort_key_class(const sort_item *items, size_t n) {
+        // 键同为整数、同为数值（整数在double精度内）或同为字符串时可原生比较
+        auto ints = 0, floats = 0, strings = 0;
+        for (size_t i = 0; i < n; i++) {
+            auto k = items[i].key;
+            slong l;
+            if (k->type == ast_string) {
+                strings++;
+            } else if (k->type == ast_float || k->type == ast_double) {
+                floats++;
+            } else if (int_arg(k, l)) {
+                if (l > (1LL << 53) || l < -(1LL << 53))
+                    ints = -1;
+                if (ints >= 0)
+                    ints++;
+            } else {
+                return sk_none;
+            }
+        }
+        if (strings)
+            return (size_t) strings == n ? sk_string : sk_none;
+        if (floats)
+            return ints >= 0 ? sk_float : sk_none;
+        return sk_int;
+    }
+
+    static slong sort_long(cval *v) {
+        return v->type == ast_int ? v->val._int : v->val._long;
+    }
+
+    static double sort_double(cval *v) {
+        switch (v->type) {
+            case ast_float:
+                return v->val._float;
+            case ast_double:
+                return v->val._double;
+            default:
+                return (double) sort_long(v);
+        }
+    }
+
+    static bool sort_less(const sort_item &x, const sort_item &y, sort_key_t cls, bool desc) {
+        auto a = desc ? y.key : x.key, b = desc ? x.key : y.key;
+        switch (cls) {
+            case sk_int:
+                return sort_long(a) < sort_long(b);
+            case sk_float: {
+                // NaN排在最后，与数组排序一致
+                auto dx = sort_double(x.key), dy = sort_double(y.key);
+                if (std::isnan(dx) || std::isnan(dy))
+                    return !std::isnan(dx) && std::isnan(dy);
+                return desc ? dy < dx : dx < dy;
+            }
+            default:
+                return cvm::string_compare(a, b) < 0;
+        }
+    }
+
+    static carray *sort_array(carray *src, bool desc) {
+        auto arr = carray::create(src->type, src->size);
+        if (src->type == arr_f64) {
+            std::copy(src->f64, src->f64 + src->size, arr->f64);
+            // NaN排在最后，保证严格弱序
+            std::sort(arr->f64, arr->f64 + arr->size, [=](double a, double b) {
+                if (std::isnan(a) || std::isnan(b))
+                    return !std::isnan(a);
+                return desc ? b < a : a < b;
+            });
+        } else {
+            std::copy(src->i64, src->i64 + src->size, arr->i64);
+            if (desc)
+                std::sort(arr->i64, arr->i64 + arr->size, std::greater<slong>());
+            else
+                std::sort(arr->i64, arr->i64 + arr->size);
+        }
+        return arr;
+    }
+
+    struct sort_merge {
+        // 自底向上的归并，每次比较都交给调度器，状态保存在此处
+        sort_item *a, *b;
+        size_t n, width, lo, mid, hi, i, j, k;
+
+        void start() {
+            width = 1;
+            next_block(0);
+        }
+
+        void next_block(size_t from) {
+            lo = from;
+            mid = std::min(lo + width, n);
+            hi = std::min(lo + width * 2, n);
+            i = k = lo;
+            j = mid;
+        }
+
+        // 推进到下一次比较，归并完成时返回false，结果在a中
+        bool advance() {
+            while (width < n) {
+                if (i < mid && j < hi)
+                    return true;
+                while (i < mid)
+                    b[k++] = a[i++];
+                while (j < hi)
+                    b[k++] = a[j++];
+                if (hi < n) {
+                    next_block(hi);
+                } else {
+                    std::swap(a, b);
+                    width *= 2;
+                    next_block(0);
+                }
+            }
+            return false;
+        }
+
+        // 比较结果为(cmp right left)，成立时取右侧，否则取左侧以保持稳定
+        void take(bool right) {
+            b[k++] = right ? a[j++] : a[i++];
+        }
+    };
+
+    status_t builtins::sort_list(cvm *vm, cframe *frame, bool by) {
+        // 复制、原生归并与最后的链接都按VM_CHUNK分步，step记录所处阶段
+        struct tmp_bag {
+            int step;
+            sort_merge m;
+            size_t key;
+            cval *app;
+            cval *cmp;
+            bool array;
+            array_t type;
+            cval *r;
+            sort_key_t cls;
+            bool desc;
+            size_t pos;
+            cval *src;
+            cval *v;
+        };
+        auto &val = frame->val;
+        auto &env = frame->env;
+        auto name = by ? "sort-by" : "sort";
+        auto op = VM_OP(val);
+        auto L = by ? op->next : op;
+        auto tmp = (tmp_bag *) frame->arg;
+        if (tmp == nullptr) {
+            auto count = val->val._v.count - (by ? 1 : 0);
+            if (count != 2 && count != 3)
+                vm->error(string_t(name) + (by ? " requires 2 or 3 args" : " requires 1 or 2 args"));
+            auto f = by ? op : nullptr;
+            auto cmp = count == 3 ? L->next : nullptr;
+            if ((f && !is_callable(f)) || (cmp && !is_callable(cmp)))
+                vm->error(string_t(name) + " requires function");
+            if (L->type != ast_qexpr && L->type != ast_array)
+                vm->error(string_t(name) + " requires Q-exp or array");
+            auto sub = cmp && cmp->type == ast_sub ? cmp->val._sub.sub : nullptr;
+            if (L->type == ast_array && !by && (!cmp || sub == builtins::lt || sub == builtins::gt) &&
+                L->val._array->size <= VM_CHUNK) {
+                // 数组元素同类型，相等即不可区分，直接对数据做内省排序；长数组走下面的分步归并
+                VM_RET(vm->val_array(sort_array(L->val._array, sub == builtins::gt)));
+            }
+            auto n = L->type == ast_array ? L->val._array->size : (size_t) L->val._v.count;
+            tmp = vm->tmp_alloc<tmp_bag>();
+            memset(tmp, 0, sizeof(tmp_bag));
+            auto &m = tmp->m;
+            m.n = n;
+            frame->arg = tmp;
+            if (n > 0) {
+                m.a = vm->eval_tmp.alloc_array<sort_item>((uint) n);
+                m.b = m.a ? vm->eval_tmp.alloc_array<sort_item>((uint) n) : nullptr;
+                if (!m.b) {
+                    // 临时池放不下时改在堆外申请，由帧持有，返回、出错或取消时释放
+                    if (m.a)
+                        vm->eval_tmp.free_array(m.a);
+                    auto buf = std::make_shared<std::vector<sort_item>>(n * 2);
+                    vm->frame_owned[frame] = buf;
+                    m.a = buf->data();
+                    m.b = m.a + n;
+                }
+            }
+            tmp->cmp = cmp;
+            tmp->array = L->type == ast_array;
+            if (tmp->array)
+                tmp->type = L->val._array->type;
+            else
+                tmp->src = L->val._v.child;
+        }
+        auto &m = tmp->m;
+        if (tmp->step == 0) {
+            // 元素各复制一次，排序只移动指针，最后按序重新链接
+            for (auto c = 0; c < VM_CHUNK && tmp->pos < m.n; c++, tmp->pos++) {
+                cval *v;
+                if (!tmp->array) {
+                    v = vm->copy(tmp->src);
+                    tmp->src = tmp->src->next;
+                } else if (tmp->type == arr_f64) {
+                    v = vm->val_obj(ast_double);
+                    v->val._double = L->val._array->f64[tmp->pos];
+                } else {
+                    v = int_val(vm, L->val._array->i64[tmp->pos]);
+                }
+                m.a[tmp->pos].key = m.a[tmp->pos].val = v;
+            }
+            if (tmp->pos < m.n)
+                return s_call;
+            tmp->step = 2;
+            if (by && m.n > 0) {
+                auto app = vm->val_obj(ast_sexpr);
+                vm->mem.push_root(app);
+                app->val._v.child = vm->copy(op);
+                app->val._v.count = 2;
+                vm->mem.pop_root();
+                tmp->app = app;
+                tmp->step = 1;
+                auto x = m.a[0].val;
+                x->next = nullptr;
+                app->val._v.child->next = x;
+                return vm->call(cvm::eval_child, app, env, &tmp->r);
+            }
+        }
+        if (tmp->step == 1) {
+            // sort-by：先逐个求键
+            m.a[tmp->key++].key = tmp->r;
+            if (tmp->key < m.n) {
+                auto x = m.a[tmp->key].val;
+                x->next = nullptr;
+                tmp->app->val._v.child->next = x;
+                return vm->call(cvm::eval_child, tmp->app, env, &tmp->r);
+            }
+            tmp->step = 2;
+        }
+        if (tmp->step == 2) {
+            auto cmp = tmp->cmp;
+            auto sub = cmp && cmp->type == ast_sub ? cmp->val._sub.sub : nullptr;
+            m.start();
+            if ((!cmp || sub == builtins::lt || sub == builtins::gt) && (tmp->cls = sort_key_class(m.a, m.n)) != sk_none) {
+                tmp->desc = sub == builtins::gt;
+                tmp->step = 4;
+            } else {
+                auto app = vm->val_obj(ast_sexpr);
+                vm->mem.push_root(app);
+                app->val._v.child = cmp ? vm->copy(cmp) : vm->val_sub("<", builtins::lt);
+                app->val._v.count = 3;
+                vm->mem.pop_root();
+                tmp->app = app;
+                tmp->step = 3;
+                tmp->r = nullptr;
+            }
+        }
+        if (tmp->step == 3) {
+            if (tmp->r) {
+                auto r = tmp->r;
+                m.take(!(r->type == ast_int && r->val._int == 0));
+            }
+            if (m.advance()) {
+                // (cmp right left)，键互相链接作为参数
+                auto right = m.a[m.j].key, left = m.a[m.i].key;
+                tmp->app->val._v.child->next = right;
+                right->next = left;
+                left->next = nullptr;
+                tmp->r = nullptr;
+                return vm->call(cvm::eval_child, tmp->app, env, &tmp->r);
+            }
+            tmp->step = 5;
+        }
+        if (tmp->step == 4) {
+            // 键可原生比较时同样逐块归并，每步至多VM_CHUNK次比较
+            for (auto c = 0; c < VM_CHUNK && m.advance(); c++)
+                m.take(sort_less(m.a[m.j], m.a[m.i], tmp->cls, tmp->desc));
+            if (m.advance())
+                return s_call;
+            tmp->step = 5;
+        }
+        if (!tmp->v) {
+            tmp->pos = 0;
+            if (tmp->array) {
+                tmp->v = vm->val_array(carray::create(tmp->type, m.n));
+            } else {
+                tmp->v = vm->val_obj(ast_qexpr);
+                tmp->v->val._v.count = (uint) m.n;
+                tmp->v->val._v.child = m.n > 0 ? m.a[0].val : nullptr;
+            }
+        }
+        auto v = tmp->v;
+        for (auto c = 0; c < VM_CHUNK && tmp->pos < m.n; c++, tmp->pos++) {
+            auto i = tmp->pos;
+            auto x = m.a[i].val;
+            if (!tmp->array)
+                x->next = i + 1 < m.n ? m.a[i + 1].val : nullptr;
+            else if (tmp->type == arr_f64)
+                v->val._array->f64[i] = x->val._double;
+            else
+                v->val._array->i64[i] = sort_long(x);
+        }
+        if (tmp->pos < m.n)
+            return s_call;
+        if (m.n > 0 && vm->frame_owned.erase(frame) == 0) {
+            // 归并中a、b可能已交换，两块一起释放
+            vm->eval_tmp.free_array(m.a);
+            vm->eval_tmp.free_array(m.b);
+        }
+        vm->eval_tmp.free(tmp);
+        VM_RET(v);
+    }
+
+    status_t builtins::sort(cvm *vm, cframe *frame) {
+        return sort_list(vm, frame, false);
+    }
+
+    status_t builtins::sort_by(cvm *vm, cframe *frame) {
+        return sort_list(vm, frame, true);
+    }
+
+    // 惰性序列
+
+    // 一次遍历中某个阶段的状态，遍历结束时随拉取链一起释放
+    struct lazy_iter {
+        cseq *seq;
+        lazy_iter *up, *up2;
+        cval *app; // map/filter复用的调用表达式
+        cval *cur; // 源列表的下一个元素
+        slong i;
+        int step; // 拉取帧在上游或函数返回后从这里继续
+        cval *x;
+        cval *r;
+    };
+
+    lazy_iter *builtins::lazy_open(cvm *vm, cval *val) {
+        auto it = vm->tmp_alloc<lazy_iter>();
+        if (!it)
+            vm->error("lazy sequence too deep");
+        memset(it, 0, sizeof(lazy_iter));
+        auto seq = cvm::seq_data(val);
+        it->seq = seq;
+        switch (seq->kind) {
+            case lz_list:
+                it->cur = seq->src->val._v.child;
+                break;
+            case lz_map:
+            case lz_filter: {
+                it->up = lazy_open(vm, seq->src);
+                auto app = vm->val_obj(ast_sexpr);
+                vm->mem.push_root(app);
+                app->val._v.child = vm->copy(seq->fn);
+                app->val._v.count = 2;
+                vm->mem.pop_root();
+                it->app = app;
+            }
+                break;
+            case lz_take:
+            case lz_drop:
+                it->up = lazy_open(vm, seq->src);
+                break;
+            case lz_zip:
+                it->up = lazy_open(vm, seq->src);
+                it->up2 = lazy_open(vm, seq->fn);
+                break;
+            default:
+                break;
+        }
+        return it;
+    }
+
+    void builtins::lazy_close(cvm *vm, lazy_iter *it) {
+        if (it->up)
+            lazy_close(vm, it->up);
+        if (it->up2)
+            lazy_close(vm, it->up2);
+        vm->eval_tmp.free(it);
+    }
+
+    status_t builtins::lazy_next(cvm *vm, lazy_iter *it, cval *env, cval **ret) {
+        // 取下一个元素，序列结束时*ret为nullptr
+        auto s = vm->call(lazy_pull, nullptr, env, ret);
+        vm->eval_stack.back()->arg = it;
+        return s;
+    }
+
+    status_t builtins::lazy_pull(cvm *vm, cframe *frame) {
+        auto it = (lazy_iter *) frame->arg;
+        auto seq = it->seq;
+        auto &env = frame->env;
+        switch (seq->kind) {
+            case lz_list: {
+                auto x = it->cur;
+                if (!x)
+                    VM_RET(nullptr);
+                it->cur = x->next;
+                VM_RET(vm->copy(x));
+            }
+            case lz_array: {
+                auto arr = seq->src->val._array;
+                if ((size_t) it->i >= arr->size)
+                    VM_RET(nullptr);
+                auto i = it->i++;
+                if (arr->type == arr_f64) {
+                    auto v = vm->val_obj(ast_double);
+                    v->val._double = arr->f64[i];
+                    VM_RET(v);
+                }
+                VM_RET(int_val(vm, arr->i64[i]));
+            }
+            case lz_range: {
+                if (seq->count >= 0 && it->i >= seq->count)
+                    VM_RET(nullptr);
+                auto i = it->i++;
+                VM_RET(int_val(vm, seq->start + i * seq->step));
+            }
+            case lz_map:
+            case lz_filter:
+                if (it->step == 0) {
+                    it->step = 1;
+                    return lazy_next(vm, it->up, env, &it->r);
+                }
+                if (it->step == 1) {
+                    if (!it->r) {
+                        it->step = 0;
+                        VM_RET(nullptr);
+                    }
+                    // 上游的元素是新值，直接作为参数
+                    it->x = it->r;
+                    it->x->next = nullptr;
+                    it->app->val._v.child->next = it->x;
+                    it->step = 2;
+                    return vm->call(cvm::eval_child, it->app, env, &it->r);
+                }
+                if (seq->kind == lz_map) {
+                    it->step = 0;
+                    VM_RET(it->r);
+                }
+                if (!(it->r->type == ast_int && it->r->val._int == 0)) {
+                    it->step = 0;
+                    VM_RET(it->x);
+                }
+                it->step = 1;
+                return lazy_next(vm, it->up, env, &it->r);
+            case lz_take:
+                if (it->step == 0) {
+                    if (it->i >= seq->count)
+                        VM_RET(nullptr); // 不再拉取上游
+                    it->i++;
+                    it->step = 1;
+                    return lazy_next(vm, it->up, env, &it->r);
+                }
+                it->step = 0;
+                if (!it->r)
+                    it->i = seq->count;
+                VM_RET(it->r);
+            case lz_drop:
+                if (it->step == 0) {
+                    it->step = 1;
+                    return lazy_next(vm, it->up, env, &it->r);
+                }
+                if (it->r && it->i < seq->count) {
+                    it->i++;
+                    return lazy_next(vm, it->up, env, &it->r);
+                }
+                it->step = 0;
+                VM_RET(it->r);
+            case lz_zip:
+                if (it->step == 0) {
+                    it->step = 1;
+                    return lazy_next(vm, it->up, env, &it->r);
+                }
+                if (it->step == 1) {
+                    if (!it->r) {
+                        it->step = 0;
+                        VM_RET(nullptr);
+                    }
+                    it->x = it->r;
+                    it->step = 2;
+                    return lazy_next(vm, it->up2, env, &it->r);
+                }
+                it->step = 0;
+                if (!it->r)
+                    VM_RET(nullptr);
+                {
+                    auto v = vm->val_obj(ast_qexpr);
+                    v->val._v.child = it->x;
+                    v->val._v.count = 2;
+                    it->x->next = it->r;
+                    it->r->next = nullptr;
+                    VM_RET(v);
+                }
+            default:
+                break;
+        }
+        vm->error("invalid lazy sequence");
+        VM_RET(nullptr);
+    }
+
+    cval *builtins::lazy_arg(cvm *vm, cval *val, const char *name) {
+        // 列表与数组按源序列包装
+        switch (val->type) {
+            case ast_seq:
+                return val;
+            case ast_qexpr:
+                return vm->val_seq(lz_list, val, nullptr);
+            case ast_array:
+                return vm->val_seq(lz_array, val, nullptr);
+            default:
+                break;
+        }
+        vm->error(string_t(name) + " requires seq");
+        return nullptr;
+    }
+
+    status_t builtins::seq(cvm *vm, cframe *frame) {
+        auto &val = frame->val;
+        if (val->val._v.count != 2)
+            vm->error("seq requires 1 args");
+        VM_RET(lazy_arg(vm, VM_OP(val), "seq"));
+    }
+
+    status_t builtins::seq_range(cvm *vm, cframe *frame) {
+        auto &val = frame->val;
+        auto count = val->val._v.count;
+        if (count < 2 || count > 4)
+            vm->error("seq-range requires 1 to 3 args");
+        auto op = VM_OP(val);
+        slong a = 0, b = 0, step = 1;
+        if (!int_arg(op, a) || (count >= 3 && !int_arg(op->next, b)) ||
+            (count == 4 && !int_arg(op->next->next, step)))
+            vm->error("seq-range requires integer");
+        if (step == 0)
+            vm->error("seq-range requires non-zero step");
+        // 只给起点时无穷
+        VM_RET(vm->val_seq(lz_range, nullptr, nullptr, a, step, count == 2 ? -1 : range_size(a, b, step)));
+    }
+
+    status_t builtins::seq_count(cvm *vm, cframe *frame, lazy_t kind, const char *name) {
+        auto &val = frame->val;
+        if (val->val._v.count != 3)
+            vm->error(string_t(name) + " requires 2 args");
+        auto op = VM_OP(val);
+        slong n;
+        if (!int_arg(op, n) || n < 0)
+            vm->error(string_t(name) + " requires non-negative integer");
+        VM_RET(vm->val_seq(kind, lazy_arg(vm, op->next, name), nullptr, 0, 0, n));
+    }
+
+    status_t builtins::seq_take(cvm *vm, cframe *frame) {
+        return seq_count(vm, frame, lz_take, "seq-take");
+    }
+
+    status_t builtins::seq_drop(cvm *vm, cframe *frame) {
+        return seq_count(vm, frame, lz_drop, "seq-drop");
+    }
+
+    status_t builtins::seq_zip(cvm *vm, cframe *frame) {
+        auto &val = frame->val;
+        if (val->val._v.count != 3)
+            vm->error("seq-zip requires 2 args");
+        auto op = VM_OP(val);
+        auto a = lazy_arg(vm, op, "seq-zip");
+        vm->mem.push_root(a);
+        auto b = lazy_arg(vm, op->next, "seq-zip");
+        vm->mem.pop_root();
+        VM_RET(vm->val_seq(lz_zip, a, b));
+    }
+
+    status_t builtins::seq_to_list(cvm *vm, cframe *frame) {
+        struct tmp_bag {
+            lazy_iter *it;
+            cval *v;
+            cval *local;
+            cval *r;
+            cval *scratch; // 每次拉取的临时根，元素复制进列表后摘下
+        };
+        auto &val = frame->val;
+        auto tmp = (tmp_bag *) frame->arg;
+        if (tmp == nullptr) {
+            if (val->val._v.count != 2)
+                vm->error("seq->list requires 1 args");
+            auto op = VM_OP(val);
+            if (op->type == ast_qexpr)
+                VM_RET(vm->copy(op));
+            if (op->type != ast_seq)
+                vm->error("seq->list requires seq");
+            tmp = vm->tmp_alloc<tmp_bag>();
+            memset(tmp, 0, sizeof(tmp_bag));
+            frame->arg = tmp;
+            tmp->it = lazy_open(vm, op);
+            auto v = vm->val_obj(ast_qexpr);
+            v->val._v.child = nullptr;
+            v->val._v.count = 0;
+            tmp->v = v;
+        } else {
+            auto item = tmp->r;
+            if (item) {
+                vm->mem.push_root(tmp->v);
+                item = vm->copy(item);
+                vm->mem.pop_root();
+            }
+            scratch_end(vm, tmp->scratch);
+            if (!item) {
+                auto v = tmp->v;
+                lazy_close(vm, tmp->it);
+                vm->eval_tmp.free(tmp);
+                VM_RET(v);
+            }
+            item->next = nullptr;
+            if (tmp->local)
+                tmp->local->next = item;
+            else
+                tmp->v->val._v.child = item;
+            tmp->local = item;
+            tmp->v->val._v.count++;
+        }
+        tmp->scratch = scratch_begin(vm);
+        return lazy_next(vm, tmp->it, frame->env, &tmp->r);
+    }
+
+    // 记忆化
+
+    status_t builtins::memo(cvm *vm, cframe *frame) {
+        auto &val = frame->val;
+        auto count = val->val._v.count;
+        if (count != 2 && count != 3)
+            vm->error("memo requires 1 or 2 args");
+        auto op = VM_OP(val);
+        if (!is_callable(op))
+            vm->error("memo requires function");
+        slong capacity = MEMO_CAPACITY;
+        if (count == 3 && (!int_arg(op->next, capacity) || capacity <= 0))
+            vm->error("memo requires positive capacity");
+        VM_RET(vm->val_memo(vm->memo_create(vm->copy(op), (size_t) capacity)));
+    }
+
+    status_t builtins::call_memo(cvm *vm, cframe *frame) {
+        auto &val = frame->val;
+        auto memo = val->val._v.child->val._memo;
+        // 参数仍连在调用表达式中，以此为键查询
+        cval key;
+        key.type = ast_qexpr;
+        key.flag = 0;
+        key.next = nullptr;
+        key.val._v.child = VM_OP(val);
+        key.val._v.count = val->val._v.count - 1;
+        if (frame->arg == nullptr) {
+            auto f = memo->index.find(&key);
+            if (f != memo->index.end()) {
+                memo->hits++;
+                memo->lru.splice(memo->lru.begin(), memo->lru, f->second);
+                VM_RET(vm->copy(f->first->next));
+            }
+            memo->misses++;
+            auto app = vm->val_obj(ast_sexpr);
+            vm->mem.push_root(app);
+            app->val._v.child = vm->copy(memo->fn);
+            vm->mem.pop_root();
+            app->val._v.child->next = key.val._v.child;
+            app->val._v.count = val->val._v.count;
+            return vm->call(cvm::eval_child, app, frame->env, &(cval *&) frame->arg);
+        }
+        auto r = (cval *) frame->arg;
+        if (memo->index.find(&key) == memo->index.end()) { // 递归中可能已算出同一个键
+            auto entry = vm->val_obj(ast_qexpr);
+            vm->mem.push_root(entry);
+            auto args = vm->copy(&key);
+            args->next = vm->copy(r);
+            entry->val._v.child = args;
+            entry->val._v.count = 2;
+            vm->mem.pop_root();
+            vm->mem.protect(entry);
+            memo->lru.push_front(entry);
+            memo->index[args] = memo->lru.begin();
+            if (memo->lru.size() > memo->capacity) {
+                auto old = memo->lru.back();
+                memo->index.erase(old->val._v.child);
+                memo->lru.pop_back();
+                vm->mem.unprotect(old); // 下次回收时释放
+            }
+        }
+        VM_RET(r);
+    }
+
+    status_t builtins::memo_stats(cvm *vm, cframe *frame) {
+        auto &val = frame->val;
+        if (val->val._v.count != 2)
+            vm->error("memo-stats requires 1 args");
+        auto op = VM_OP(val);
+        if (op->type != ast_memo)
+            vm->error("memo-stats requires memo");
+        auto memo = op->val._memo;
+        slong stats[] = {(slong) memo->hits, (slong) memo->misses, (slong) memo->lru.size(), (slong) memo->capacity};
+        auto v = vm->val_obj(ast_qexpr);
+        v->val._v.count = 4;
+        vm->mem.push_root(v);
+        auto local = v->val._v.child = int_val(vm, stats[0]);
+        for (auto i = 1; i < 4; i++)
+            local = local->next = int_val(vm, stats[i]);
+        vm->mem.pop_root();
+        VM_RET(v);
+    }
+
+    // 紧凑数组
+
+    status_t builtins::make_array(cvm *vm, cframe *frame, array_t type) {
+        auto &val = frame->val;
+        auto op = VM_OP(val);
+        if (op && !op->next && op->type == ast_array) {
+            auto src = op->val._array;
+            if (src->type == type)
+                VM_RET(vm->val_array(src->retain()));
+            auto r = carray::create(type, src->size);
+            if (type == arr_f64) {
+                simd::i64_to_f64(src->i64, r->f64, src->size);
+            } else {
+                for (size_t i = 0; i < src->size; i++)
+                    r->i64[i] = (slong) src->f64[i];
+            }
+            VM_RET(vm->val_array(r));
+        }
+        if (op && !op->next && op->type == ast_qexpr)
+            op = op->val._v.child;
+        size_t n = 0;
+        for (auto i = op; i; i = i->next)
+            n++;
+        auto r = carray::create(type, n);
+        size_t k = 0;
+        for (auto i = op; i; i = i->next, k++) {
+            if (i->type == ast_bigint) {
+                auto b = cvm::bigint(i);
+                if (type == arr_f64) {
+                    r->f64[k] = b.to_double();
+                } else if (!b.to_long(r->i64[k])) {
+                    r->release();
+                    vm->error("integer too large for i64");
+                }
+            } else if (is_number(i->type)) {
+                cval tmp;
+                tmp.type = type == arr_f64 ? ast_double : ast_long;
+                kernels[c_set][tmp.type - ast_char][i->type - ast_char](&tmp, i);
+                if (type == arr_f64)
+                    r->f64[k] = tmp.val._double;
+                else
+                    r->i64[k] = tmp.val._long;
+            } else {
+                r->release();
+                vm->error("array requires numbers");
+            }
+        }
+        VM_RET(vm->val_array(r));
+    }
+
+    status_t builtins::f64(cvm *vm, cframe *frame) {
+        return make_array(vm, frame, arr_f64);
+    }
+
+    status_t builtins::i64(cvm *vm, cframe *frame) {
+        return make_array(vm, frame, arr_i64);
+    }
+
+    status_t builtins::vec_iota(cvm *vm, cframe *frame) {
+        auto &val = frame->val;
+        if (val->val._v.count != 2)
+            vm->error("vec-iota requires 1 args");
+        auto op = VM_OP(val);
+        slong n;
+        if (op->type == ast_int)
+            n = op->val._int;
+        else if (op->type == ast_long)
+            n = op->val._long;
+        else
+            vm->error("vec-iota requires integer");
+        if (n < 0)
+            vm->error("vec-iota requires non-negative size");
+        auto r = carray::create(arr_i64, (size_t) n);
+        for (slong i = 0; i < n; i++)
+            r->i64[i] = i;
+        VM_RET(vm->val_array(r));
+    }
+
+    static carray *array_arg(cvm *vm, cframe *frame, const char *name) {
+        auto &val = frame->val;
+        if (val->val._v.count != 2)
+            vm->error(string_t(name) + " requires 1 args");
+        auto op = VM_OP(val);
+        if (op->type != ast_array)
+            vm->error(string_t(name) + " requires array");
+        return op->val._array;
+    }
+
+    status_t builtins::vec_sum(cvm *vm, cframe *frame) {
+        auto arr = array_arg(vm, frame, "vec-sum");
+        if (arr->type == arr_f64) {
+            auto v = vm->val_obj(ast_double);
+            v->val._double = simd::f64_sum(arr->f64, arr->size);
+            VM_RET(v);
+        }
+        VM_RET(vm->val_integer(cbignum(simd::i64_sum(arr->i64, arr->size))));
+    }
+
+    status_t builtins::vec_min(cvm *vm, cframe *frame) {
+        auto arr = array_arg(vm, frame, "vec-min");
+        if (arr->size == 0)
+            vm->error("vec-min requires non-empty array");
+        if (arr->type == arr_f64) {
+            auto v = vm->val_obj(ast_double);
+            v->val._double = simd::f64_min(arr->f64, arr->size);
+            VM_RET(v);
+        }
+        VM_RET(vm->val_integer(cbignum(simd::i64_min(arr->i64, arr->size))));
+    }
+
+    status_t builtins::vec_max(cvm *vm, cframe *frame) {
+        auto arr = array_arg(vm, frame, "vec-max");
+        if (arr->size == 0)
+            vm->error("vec-max requires non-empty array");
+        if (arr->type == arr_f64) {
+            auto v = vm->val_obj(ast_double);
+            v->val._double = simd::f64_max(arr->f64, arr->size);
+            VM_RET(v);
+        }
+        VM_RET(vm->val_integer(cbignum(simd::i64_max(arr->i64, arr->size))));
+    }
+
+    status_t builtins::vec_dot(cvm *vm, cframe *frame) {
+        auto &val = frame->val;
+        if (val->val._v.count != 3)
+            vm->error("vec-dot requires 2 args");
+        auto op = VM_OP(val);
+        if (op->type != ast_array || op->next->type != ast_array)
+            vm->error("vec-dot requires array");
+        auto a = op->val._array, b = op->next->val._array;
+        if (a->size != b->size)
+            vm->error("array size mismatch");
+        if (a->type == arr_i64 && b->type == arr_i64)
+            VM_RET(vm->val_integer(cbignum(simd::i64_dot(a->i64, b->i64, a->size))));
+        auto x = array_to_f64(a), y = array_to_f64(b);
+        auto v = vm->val_obj(ast_double);
+        v->val._double = simd::f64_dot(x->f64, y->f64, x->size);
+        x->release();
+        y->release();
+        VM_RET(v);
+    }
+
+    status_t builtins::vec_isa(cvm *vm, cframe *frame) {
+        auto &val = frame->val;
+        if (val->val._v.count > 2)
+            vm->error("vec-isa requires at most 1 args");
+        if (val->val._v.count == 2) {
+            auto op = VM_OP(val);
+            if (op->type != ast_string)
+                vm->error("vec-isa requires string");
+            auto name = cvm::string_cstr(op);
+            if (strequ(name, "avx2"))
+                simd::select(simd::isa_avx2);
+            else if (strequ(name, "sse2"))
+                simd::select(simd::isa_sse2);
+            else if (strequ(name, "scalar"))
+                simd::select(simd::isa_scalar);
+            else
+                vm->error("unknown isa");
+        }
+        VM_RET(vm->val_str(ast_string, simd::isa_name(simd::current())));
+    }
+
+    // 线程
+
+    status_t builtins::spawn(cvm *vm, cframe *frame) {
+        // (spawn f args...)，在新的绿色线程中调用f，返回线程号
+        auto &val = frame->val;
+        auto op = VM_OP(val);
+        if (!op || !is_callable(op))
+            vm->error("spawn requires function");
+        auto f = vm->eval_mem.alloc<cframe>();
+        if (!f)
+            vm->quota_error("frames");
+        auto t = new cthread();
+        vm->threads.emplace_back(t);
+        t->id = ++vm->thread_id;
+        t->root = vm->val_obj(ast_qexpr);
+        t->root->val._v.count = 0;
+        t->root->val._v.child = nullptr;
+        vm->mem.unlink(t->root);
+        vm->mem.protect(t->root);
+        vm->mem.push_root(t->root);
+        auto app = vm->val_obj(ast_sexpr);
+        vm->mem.push_root(app);
+        auto local = app->val._v.child = vm->copy(op);
+        app->val._v.count = 1;
+        for (auto i = op->next; i; i = i->next) {
+            local = local->next = vm->copy(i);
+            app->val._v.count++;
+        }
+        vm->mem.pop_root();
+        vm->mem.pop_root();
+        memset(f, 0, sizeof(cframe));
+        f->fun = cvm::eval_child;
+        f->val = app;
+        f->env = vm->global_env;
+        f->ret = &t->ret;
+        t->stack.push_back(f);
+        vm->yielded = true; // 让新线程尽快得到时间片
+        VM_RET(int_val(vm, t->id));
+    }
+
+    status_t builtins::join(cvm *vm, cframe *frame) {
+        // (join id)，等待线程结束并取回结果，线程随之回收
+        auto &val = frame->val;
+        auto op = VM_OP(val);
+        slong id;
+        if (val->val._v.count != 2 || !int_arg(op, id))
+            vm->error("join requires thread id");
+        auto t = vm->find_thread((uint) id);
+        if (!t)
+            vm->error("join: no such thread");
+        if (t == vm->current)
+            vm->error("join: thread cannot join itself");
+        if (!t->done) {
+            vm->join_wait = t->id; // 调度器在目标结束前不再调用本帧
+            return s_sleep;
+        }
+        auto error = t->error;
+        auto r = error.empty() ? vm->copy(t->ret) : nullptr;
+        vm->mem.unprotect(t->root);
+        vm->threads.erase(std::find_if(vm->threads.begin(), vm->threads.end(),
+                                       [t](const std::unique_ptr<cthread> &p) { return p.get() == t; }));
+        if (!error.empty())
+            vm->error("thread " + std::to_string(id) + ": " + error);
+        VM_RET(r);
+    }
+
+    status_t builtins::detach(cvm *vm, cframe *frame) {
+        // (detach id)，不再join该线程，结束后由调度器回收，出错时交给宿主输出
+        auto &val = frame->val;
+        auto op = VM_OP(val);
+        slong id;
+        if (val->val._v.count != 2 || !int_arg(op, id))
+            vm->error("detach requires thread id");
+        auto t = vm->find_thread((uint) id);
+        if (!t)
+            vm->error("detach: no such thread");
+        t->detached = true;
+        if (t->done)
+            vm->reap_thread(t);
+        VM_RET(VM_NIL);
+    }
+
+    status_t builtins::yield(cvm *vm, cframe *frame) {
+        // (yield x)，结束当前时间片并返回x，没有其他线程时立即继续
+        auto &val = frame->val;
+        if (val->val._v.count != 2)
+            vm->error("yield requires one argument");
+        vm->yielded = true;
+        VM_RET(vm->copy(VM_OP(val)));
+    }
+
+    status_t builtins::special_yield(cvm *vm, cframe *frame) {
+        // (yield)，不带值让出时间片，返回nil
+        vm->yielded = true;
+        VM_RET(VM_NIL);
+    }
+
+    status_t builtins::sleep(cvm *vm, cframe *frame) {
+        // (sleep t)，休眠t秒，帧挂在时间轮上，到期前不再被调度
+        if (frame->arg != nullptr)
+            VM_RET(VM_NIL); // 只在到期后重入
+        auto &val = frame->val;
+        auto op = VM_OP(val);
+        double t = 0;
+        slong n;
+        if (val->val._v.count != 2)
+            vm->error("sleep requires seconds");
+        if (op->type == ast_float)
+            t = op->val._float;
+        else if (op->type == ast_double)
+            t = op->val._double;
+        else if (int_arg(op, n))
+            t = (double) n;
+        else
+            vm->error("sleep requires seconds");
+        auto ms = (slong) (t * 1000.0);
+        if (ms <= 0)
+            VM_RET(VM_NIL);
+        auto now = vm->host->clock();
+        vm->park = ++vm->timer_id;
+        vm->timers.add(now, now + (ulong) ms, vm->park);
+        frame->arg = (void *) 1;
+        return s_sleep;
+    }
+
+    // 通道
+
+    status_t builtins::chan(cvm *vm, cframe *frame) {
+        // (chan n)，容量为n的有界通道
+        auto &val = frame->val;
+        auto op = VM_OP(val);
+        slong n = 0;
+        if (val->val._v.count != 2 || !int_arg(op, n) || n <= 0)
+            vm->error("chan requires positive capacity");
+        auto ch = cchan::create((size_t) n);
+        ch->owner = vm;
+        VM_RET(vm->val_chan(ch));
+    }
+
+    status_t builtins::send(cvm *vm, cframe *frame) {
+        // (send c x)，通道满时休眠到通道有收发，值移入通道，返回nil
+        // 通道还没有离开本cvm时接收方只能是本cvm的线程，直接移交副本，否则打包
+        auto &val = frame->val;
+        auto op = VM_OP(val);
+        if (val->val._v.count != 3 || op->type != ast_chan)
+            vm->error("send requires chan and value");
+        auto ch = op->val._chan;
+        auto seen = ch->events.load();
+        if (ch->full()) {
+            vm->wait_chan(ch, seen); // 满时不打包，醒来后重试
+            return s_sleep;
+        }
+        auto p = new cpacket();
+        try {
+            vm->post(ch, op->next, *p);
+        } catch (...) {
+            delete p;
+            throw;
+        }
+        if (!ch->try_send(p)) {
+            delete p; // 被其他发送方抢先
+            vm->wait_chan(ch, seen);
+            return s_sleep;
+        }
+        VM_RET(VM_NIL);
+    }
+
+    status_t builtins::recv(cvm *vm, cframe *frame) {
+        // (recv c)，通道空时休眠到通道有收发，取出的值在当前根下
+        auto &val = frame->val;
+        auto op = VM_OP(val);
+        if (val->val._v.count != 2 || op->type != ast_chan)
+            vm->error("recv requires chan");
+        auto ch = op->val._chan;
+        auto seen = ch->events.load();
+        std::unique_ptr<cpacket> p(ch->try_recv());
+        if (!p) {
+            vm->wait_chan(ch, seen);
+            return s_sleep;
+        }
+        VM_RET(vm->take(*p));
+    }
+
+    status_t builtins::select(cvm *vm, cframe *frame) {
+        // (select c1 c2 ...)，从第一个非空的通道接收，返回`(序号 值)，全空时休眠到其中之一有收发
+        auto &val = frame->val;
+        if (val->val._v.count < 2)
+            vm->error("select requires chan");
+        for (auto i = VM_OP(val); i; i = i->next) {
+            if (i->type != ast_chan)
+                vm->error("select requires chan");
+        }
+        auto k = 0;
+        for (auto i = VM_OP(val); i; i = i->next, k++) {
+            auto ch = i->val._chan;
+            auto seen = ch->events.load();
+            std::unique_ptr<cpacket> p(ch->try_recv());
+            if (!p) {
+                vm->wait_chan(ch, seen);
+                continue;
+            }
+            vm->release_chans(vm->chan_wait); // 前面登记的空通道不再等待
+            auto v = vm->val_obj(ast_qexpr);
+            vm->mem.push_root(v);
+            v->val._v.count = 2;
+            v->val._v.child = int_val(vm, k);
+            v->val._v.child->next = vm->take(*p);
+            vm->mem.pop_root();
+            VM_RET(v);
+        }
+        return s_sleep;
+    }
+
+    // 并行
+
+    struct pmap_chunk {
+        cpacket items; // `(...)，按顺序切分的一段输入
+        cpacket result;
+        string_t error;
+        bool ok{false};
+    };
+
+    // 调用方与工作线程共享，最后一个持有者释放
+    struct pmap_state {
+        cpacket fn;
+        std::deque<pmap_chunk> chunks;
+        std::atomic<size_t> done{0};
+        ccancel cancel; // 调用方不再等待时置位，未开始的块跳过，进行中的块在安全点放弃
+    };
+
+    // 调用方的帧经cvm::frame_owned持有，帧返回、语句出错或被取消时释放并取消剩余的块
+    struct pmap_owner {
+        std::shared_ptr<pmap_state> s;
+
+        ~pmap_owner() { s->cancel.cancel(); }
+    };
+
+    void builtins::parallel_start(cvm &w, pmap_state &s, pmap_chunk &chunk, apply_t kind) {
+        // 在工作线程的隔离体上对一段输入执行map/for-each，与prepare一样以顶层表达式的方式运行
+        if (s.cancel.cancelled())
+            w.error("cancelled");
+        auto app = w.val_obj(ast_sexpr);
+        w.mem.push_root(app);
+        auto head = w.val_obj(ast_qexpr);
+        head->val._v.count = 0;
+        head->val._v.child = nullptr;
+        auto f = w.unpack(s.fn);
+        auto L = w.unpack(chunk.items);
+        w.mem.pop_root();
+        head->next = f;
+        f->next = L;
+        L->next = nullptr;
+        app->val._v.count = 3;
+        app->val._v.child = head;
+        w.root = app;
+        w.ret = nullptr;
+        w.call(kind == ap_map ? builtins::map : builtins::for_each, app, w.global_env, &w.ret);
+    }
+
+    status_t builtins::parallel_each(cvm *vm, cframe *frame, apply_t kind) {
+        // 输入按顺序切块，打包后交给宿主的隔离体池，等待期间以s_sleep让出
+        // 函数连同其引用的全局定义一起打包；工作线程上的def与输出不会回到调用方
+        auto &val = frame->val;
+        auto name = string_t(kind == ap_map ? "pmap" : "pfor-each");
+        auto owner = (pmap_owner *) frame->arg;
+        if (owner == nullptr) {
+            if (val->val._v.count != 3)
+                vm->error(name + " requires 2 args");
+            auto f = VM_OP(val);
+            auto L = f->next;
+            if (!is_callable(f))
+                vm->error(name + " requires function");
+            if (L->type != ast_qexpr)
+                vm->error(name + " requires Q-exp");
+            auto pool = vm->host->pool();
+            if (pool == nullptr || L->val._v.count == 0) {
+                frame->fun = kind == ap_map ? builtins::map : builtins::for_each; // 没有线程池时顺序执行
+                return s_call;
+            }
+            auto s = std::make_shared<pmap_state>();
+            vm->pack(f, s->fn);
+            size_t n = L->val._v.count;
+            auto k = std::min(n, pool->size() * PMAP_SPLIT);
+            auto item = L->val._v.child;
+            for (size_t c = 0; c < k; c++) {
+                s->chunks.emplace_back();
+                auto &items = s->chunks.back().items;
+                auto m = n / k + (c < n % k ? 1 : 0);
+                items.nodes.push_back(cpacket::node{ast_qexpr, 0, (uint) m, {}, ""});
+                std::unordered_set<cval *> visiting;
+                for (size_t j = 0; j < m; j++, item = item->next) {
+                    vm->pack_node(item, items, visiting);
+                }
+            }
+            for (size_t c = 0; c < k; c++) {
+                cjob j;
+                j.start = [s, c, kind](cvm &w, cparser &) {
+                    parallel_start(w, *s, s->chunks[c], kind);
+                };
+                j.finish = [s, c, kind](cvm &w, cval *r, const string_t &error, int) {
+                    auto &chunk = s->chunks[c];
+                    if (r) {
+                        if (kind == ap_map)
+                            w.pack(r, chunk.result);
+                        chunk.ok = true;
+                    } else {
+                        chunk.error = error;
+                    }
+                    s->done++;
+                };
+                j.token = &s->cancel;
+                pool->post(std::move(j));
+            }
+            auto held = std::make_shared<pmap_owner>();
+            held->s = s;
+            vm->frame_owned[frame] = held;
+            frame->arg = held.get();
+            return s_sleep;
+        }
+        if (owner->s->done < owner->s->chunks.size())
+            return s_sleep;
+        auto state = owner->s;
+        vm->frame_owned.erase(frame);
+        frame->arg = nullptr;
+        auto &s = *state;
+        for (auto &chunk : s.chunks) {
+            if (!chunk.ok)
+                vm->error(name + ": " + chunk.error);
+        }
+        if (kind != ap_map)
+            VM_RET(VM_NIL);
+        auto v = vm->val_obj(ast_qexpr);
+        v->val._v.count = 0;
+        v->val._v.child = nullptr;
+        vm->mem.push_root(v);
+        cval *local = nullptr;
+        for (auto &chunk : s.chunks) {
+            auto &nodes = chunk.result.nodes;
+            size_t i = 1; // 跳过结果列表自身
+            for (uint j = 0; j < nodes[0].count; j++) {
+                auto r = vm->unpack_node(chunk.result, i);
+                if (local)
+                    local->next = r;
+                else
+                    v->val._v.child = r;
+                local = r;
+                v->val._v.count++;
+            }
+        }
+        vm->mem.pop_root();
+        VM_RET(v);
+    }
+
+    status_t builtins::pmap(cvm *vm, cframe *frame) {
+        return parallel_each(vm, frame, ap_map);
+    }
+
+    status_t builtins::pfor_each(cvm *vm, cframe *frame) {
+        return parallel_each(vm, frame, ap_for_each);
+    }
+
     // GUI
 
     status_t builtins::ui_put(cvm *vm, cframe *frame) {
@@ -1020,7 +3644,7 @@ MM.           MM      ,   MM    MM    `Y   MM      ,   MM  .     `MM   MM
         if (op->type != ast_char)
             vm->error("ui-put requires char type");
         auto c = op->val._char;
-        cgui::singleton().put_char(c);
+        vm->host->put_char(c);
         VM_RET(VM_NIL);
     }
 }
\ No newline at end of file
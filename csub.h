@@ -12,6 +12,20 @@ namespace clib {
     struct cval;
     class cvm;
 
+    enum apply_t {
+        ap_map,
+        ap_filter,
+        ap_for_each,
+        ap_foldl,
+        ap_foldr,
+    };
+
+    struct lazy_iter;
+    struct pmap_state;
+    struct pmap_chunk;
+    struct chunk_bag;
+    struct loop_bag;
+
     class builtins {
     public:
         static status_t add(cvm *vm, cframe *frame);
@@ -24,6 +38,12 @@ namespace clib {
         static status_t cdr(cvm *vm, cframe *frame);
         static status_t cons(cvm *vm, cframe *frame);
 
+        static chunk_bag *chunk_begin(cvm *vm, cframe *frame, cval *v);
+        static void chunk_link(chunk_bag *tmp, cval *c);
+        static void chunk_push(cvm *vm, chunk_bag *tmp, cval *x);
+        static bool chunk_copy(cvm *vm, chunk_bag *tmp);
+        static cval *chunk_end(cvm *vm, chunk_bag *tmp);
+
         static status_t def(cvm *vm, cframe *frame);
         static status_t lambda(cvm *vm, cframe *frame);
         static status_t call_lambda(cvm *vm, cframe *frame);
@@ -39,11 +59,28 @@ namespace clib {
         static status_t begin(cvm *vm, cframe *frame);
         static status_t _if(cvm *vm, cframe *frame);
 
+        static status_t special_if(cvm *vm, cframe *frame);
+        static status_t special_lambda(cvm *vm, cframe *frame);
+        static status_t special_def(cvm *vm, cframe *frame);
+        static status_t special_begin(cvm *vm, cframe *frame);
+        static cval *scratch_begin(cvm *vm);
+        static void scratch_end(cvm *vm, cval *v);
+        static status_t loop_eval(cvm *vm, loop_bag *tmp, cval *expr, cval *env);
+        static void loop_release(cvm *vm, loop_bag *tmp, bool keep);
+        static status_t special_while(cvm *vm, cframe *frame);
+        static status_t special_do(cvm *vm, cframe *frame);
+        static status_t special_dotimes(cvm *vm, cframe *frame);
+        static status_t special_let(cvm *vm, cframe *frame);
+        static status_t special_let_star(cvm *vm, cframe *frame);
+        static status_t special_yield(cvm *vm, cframe *frame);
+
         static status_t len(cvm *vm, cframe *frame);
         static status_t index(cvm *vm, cframe *frame);
         static status_t append(cvm *vm, cframe *frame);
 
         static status_t is_null(cvm *vm, cframe *frame);
+        static status_t is_equal(cvm *vm, cframe *frame);
+        static status_t hash(cvm *vm, cframe *frame);
         static status_t type(cvm *vm, cframe *frame);
         static status_t str(cvm *vm, cframe *frame);
         static status_t word(cvm *vm, cframe *frame);
@@ -52,6 +89,75 @@ namespace clib {
         static status_t conf(cvm *vm, cframe *frame);
         static status_t attr(cvm *vm, cframe *frame);
 
+        static status_t substring(cvm *vm, cframe *frame);
+        static status_t string_find(cvm *vm, cframe *frame);
+        static status_t string_split(cvm *vm, cframe *frame);
+        static status_t string_join(cvm *vm, cframe *frame);
+        static status_t string_replace(cvm *vm, cframe *frame);
+        static status_t string_upcase(cvm *vm, cframe *frame);
+        static status_t string_downcase(cvm *vm, cframe *frame);
+        static status_t string_to_number(cvm *vm, cframe *frame);
+
+        static status_t apply_each(cvm *vm, cframe *frame, apply_t kind);
+        static status_t map(cvm *vm, cframe *frame);
+        static status_t filter(cvm *vm, cframe *frame);
+        static status_t for_each(cvm *vm, cframe *frame);
+        static status_t foldl(cvm *vm, cframe *frame);
+        static status_t foldr(cvm *vm, cframe *frame);
+        static void parallel_start(cvm &w, pmap_state &s, pmap_chunk &chunk, apply_t kind);
+        static status_t parallel_each(cvm *vm, cframe *frame, apply_t kind);
+        static status_t pmap(cvm *vm, cframe *frame);
+        static status_t pfor_each(cvm *vm, cframe *frame);
+
+        static status_t spawn(cvm *vm, cframe *frame);
+        static status_t join(cvm *vm, cframe *frame);
+        static status_t detach(cvm *vm, cframe *frame);
+        static status_t yield(cvm *vm, cframe *frame);
+        static status_t sleep(cvm *vm, cframe *frame);
+
+        static status_t chan(cvm *vm, cframe *frame);
+        static status_t send(cvm *vm, cframe *frame);
+        static status_t recv(cvm *vm, cframe *frame);
+        static status_t select(cvm *vm, cframe *frame);
+
+        static status_t let_bind(cvm *vm, cframe *frame, bool seq);
+        static cval *int_val(cvm *vm, slong n);
+        static status_t int_list(cvm *vm, cframe *frame, slong start, slong step, slong n);
+        static status_t range(cvm *vm, cframe *frame);
+        static status_t iota(cvm *vm, cframe *frame);
+        static status_t reverse(cvm *vm, cframe *frame);
+
+        static status_t sort_list(cvm *vm, cframe *frame, bool by);
+        static status_t sort(cvm *vm, cframe *frame);
+        static status_t sort_by(cvm *vm, cframe *frame);
+
+        static status_t memo(cvm *vm, cframe *frame);
+        static status_t call_memo(cvm *vm, cframe *frame);
+        static status_t memo_stats(cvm *vm, cframe *frame);
+
+        static lazy_iter *lazy_open(cvm *vm, cval *val);
+        static void lazy_close(cvm *vm, lazy_iter *it);
+        static status_t lazy_next(cvm *vm, lazy_iter *it, cval *env, cval **ret);
+        static status_t lazy_pull(cvm *vm, cframe *frame);
+        static cval *lazy_arg(cvm *vm, cval *val, const char *name);
+        static status_t seq(cvm *vm, cframe *frame);
+        static status_t seq_range(cvm *vm, cframe *frame);
+        static status_t seq_count(cvm *vm, cframe *frame, lazy_t kind, const char *name);
+        static status_t seq_take(cvm *vm, cframe *frame);
+        static status_t seq_drop(cvm *vm, cframe *frame);
+        static status_t seq_zip(cvm *vm, cframe *frame);
+        static status_t seq_to_list(cvm *vm, cframe *frame);
+
+        static status_t make_array(cvm *vm, cframe *frame, array_t type);
+        static status_t f64(cvm *vm, cframe *frame);
+        static status_t i64(cvm *vm, cframe *frame);
+        static status_t vec_iota(cvm *vm, cframe *frame);
+        static status_t vec_sum(cvm *vm, cframe *frame);
+        static status_t vec_min(cvm *vm, cframe *frame);
+        static status_t vec_max(cvm *vm, cframe *frame);
+        static status_t vec_dot(cvm *vm, cframe *frame);
+        static status_t vec_isa(cvm *vm, cframe *frame);
+
         // GUI
         static status_t ui_put(cvm *vm, cframe *frame);
     };
@@ -0,0 +1,106 @@
+//
+// Project: cliblisp
+// Created by bajdcc
+//
+
+#include <algorithm>
+#include "ctimer.h"
+
+namespace clib {
+
+    void ctimer_wheel::add(ulong current, ulong deadline, ulong id) {
+        if (count == 0 && current > now)
+            now = current; // 空轮不推进，插入时对齐到当前时刻
+        count++;
+        if (deadline <= now) {
+            due.push_back({deadline, id});
+            return;
+        }
+        place({deadline, id});
+    }
+
+    void ctimer_wheel::place(const entry &e) {
+        // 剩余时间落在第l层一圈之内就放入第l层，超出顶层的先停在顶层最远的槽
+        auto delta = e.deadline - now;
+        for (auto l = 0; l < TIMER_LEVELS; l++) {
+            auto shift = TIMER_BITS * l;
+            if (delta < ((ulong) TIMER_SLOTS << shift)) {
+                wheel[l][(e.deadline >> shift) & (TIMER_SLOTS - 1)].push_back(e);
+                return;
+            }
+        }
+        auto shift = TIMER_BITS * (TIMER_LEVELS - 1);
+        wheel[TIMER_LEVELS - 1][((now >> shift) - 1) & (TIMER_SLOTS - 1)].push_back(e);
+    }
+
+    void ctimer_wheel::advance(ulong t, std::vector<ulong> &fired) {
+        for (auto &e : due)
+            fired.push_back(e.id);
+        count -= due.size();
+        due.clear();
+        if (count == 0)
+            return;
+        while (now < t) {
+            now++;
+            // 低层转完一圈时，从高到低依次把上层当前槽下放
+            auto l = 1;
+            while (l < TIMER_LEVELS && ((now >> (TIMER_BITS * (l - 1))) & (TIMER_SLOTS - 1)) == 0)
+                l++;
+            for (auto k = l - 1; k >= 1; k--) {
+                auto &slot = wheel[k][(now >> (TIMER_BITS * k)) & (TIMER_SLOTS - 1)];
+                auto moved = std::move(slot);
+                slot.clear();
+                for (auto &e : moved) {
+                    if (e.deadline <= now) {
+                        fired.push_back(e.id);
+                        count--;
+                    } else {
+                        place(e);
+                    }
+                }
+            }
+            auto &slot = wheel[0][now & (TIMER_SLOTS - 1)];
+            for (auto &e : slot)
+                fired.push_back(e.id);
+            count -= slot.size();
+            slot.clear();
+            if (count == 0) {
+                now = t;
+                break;
+            }
+        }
+    }
+
+    bool ctimer_wheel::next(ulong &deadline) const {
+        if (count == 0)
+            return false;
+        auto found = false;
+        auto check = [&](const std::vector<entry> &slot) {
+            for (auto &e : slot) {
+                if (!found || e.deadline < deadline) {
+                    deadline = e.deadline;
+                    found = true;
+                }
+            }
+        };
+        check(due);
+        for (auto &level : wheel) {
+            for (auto &slot : level)
+                check(slot);
+        }
+        return found;
+    }
+
+    bool ctimer_wheel::empty() const {
+        return count == 0;
+    }
+
+    void ctimer_wheel::clear() {
+        for (auto &level : wheel) {
+            for (auto &slot : level)
+                slot.clear();
+        }
+        due.clear();
+        count = 0;
+    }
+}
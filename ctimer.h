@@ -0,0 +1,50 @@
+//
+// Project: cliblisp
+// Created by bajdcc
+//
+
+#ifndef CLIBLISP_CTIMER_H
+#define CLIBLISP_CTIMER_H
+
+#include <vector>
+#include "types.h"
+
+#define TIMER_BITS 6 // 每层2^6个槽
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_LEVELS 4 // 以毫秒计覆盖约4.6小时，更远的在顶层循环
+
+namespace clib {
+
+    // 分层时间轮：第0层每槽一毫秒，上层每槽是下层一整圈
+    // 插入按剩余时间选层，O(1)；推进到上层槽时把其中的计时器按新的剩余时间重新下放
+    // 不支持删除，持有者按编号忽略已失效的计时器
+    class ctimer_wheel {
+    public:
+        ctimer_wheel() = default;
+        ~ctimer_wheel() = default;
+
+        ctimer_wheel(const ctimer_wheel &) = delete;
+        ctimer_wheel &operator=(const ctimer_wheel &) = delete;
+
+        void add(ulong current, ulong deadline, ulong id); // 时刻均以毫秒计，current为当前时刻
+        void advance(ulong now, std::vector<ulong> &fired); // 到期的编号追加到fired
+        bool next(ulong &deadline) const; // 最早的到期时刻，没有计时器时返回false
+        bool empty() const;
+        void clear();
+
+    private:
+        struct entry {
+            ulong deadline;
+            ulong id;
+        };
+
+        void place(const entry &e);
+
+        std::vector<entry> wheel[TIMER_LEVELS][TIMER_SLOTS];
+        std::vector<entry> due; // 插入时已到期
+        ulong now{0};
+        size_t count{0};
+    };
+}
+
+#endif //CLIBLISP_CTIMER_H
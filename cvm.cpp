@@ -5,18 +5,29 @@
 
 #include <iostream>
 #include <iomanip>
+#include <sstream>
 #include <cstring>
+#include <algorithm>
+#include <limits>
 #include "cvm.h"
 #include "cast.h"
 #include "csub.h"
+#include "cexception.h"
 
 namespace clib {
 
     cvm::cvm() {
         set_free_callback();
+        set_oom_callback();
         builtin();
     }
 
+    cvm::cvm(cvm *base) {
+        set_free_callback();
+        set_oom_callback();
+        clone(*base);
+    }
+
     void cvm::builtin() {
         global_env = val_obj(ast_env);
         global_env->val._env.env = new cval::cenv_t();
@@ -28,30 +39,84 @@ namespace clib {
         builtin_init();
         mem.pop_root();
         mem.protect(global_env);
+        consts = val_obj(ast_qexpr);
+        consts->val._v.count = 0;
+        consts->val._v.child = nullptr;
+        mem.protect(consts);
         builtin_load();
     }
 
     cval *cvm::val_obj(ast_t type) {
         auto v = mem.alloc<cval>();
         v->type = type;
+        v->flag = 0;
         v->next = nullptr;
+        std::memset(&v->val, 0, sizeof(v->val)); // 语句中的回收会沿数据指针标记，填好之前不能留有垃圾
         return v;
     }
 
     cval *cvm::val_str(ast_t type, const char *str) {
-        auto len = strlen(str);
-        auto v = (cval *) mem.alloc(sizeof(cval) + len + 1);
+        return val_str(type, str, strlen(str));
+    }
+
+    cval *cvm::val_str(ast_t type, const char *str, size_t len) {
+        if (type == ast_string && len >= ROPE_MIN)
+            return val_rope(crope::leaf(str, len)); // 长字符串放在堆外，复制与切片时共享
+        // 数据紧跟在cval之后：长度，字符串，'\0'
+        auto v = (cval *) mem.alloc(sizeof(cval) + sizeof(uint) + len + 1);
         v->type = type;
+        v->flag = 0;
         v->next = nullptr;
-        v->val._string = ((char *) v) + sizeof(cval);
-        strncpy((char *) v->val._string, str, len);
+        *(uint *) ((char *) v + sizeof(cval)) = (uint) len;
+        v->val._string = ((char *) v) + sizeof(cval) + sizeof(uint);
+        std::memcpy((char *) v->val._string, str, len);
         return v;
     }
 
+    cval *cvm::val_rope(crope *rope) {
+        auto v = val_obj(ast_string);
+        v->flag = f_rope;
+        v->val._rope = rope;
+        return v;
+    }
+
+    cval *cvm::val_slice(cval *str, size_t start, size_t len) {
+        if (len < ROPE_MIN || !(str->flag & f_rope))
+            return val_str(ast_string, string_data(str) + start, len);
+        return val_rope(crope::slice(str->val._rope, start, len));
+    }
+
+    const char *cvm::string_data(cval *val) {
+        if (val->flag & f_rope)
+            return val->val._rope->data();
+        return val->val._string;
+    }
+
+    const char *cvm::string_cstr(cval *val) {
+        if (val->flag & f_rope)
+            return val->val._rope->c_str();
+        return val->val._string;
+    }
+
+    int cvm::string_compare(cval *a, cval *b) {
+        auto la = string_size(a), lb = string_size(b);
+        auto c = memcmp(string_data(a), string_data(b), std::min(la, lb));
+        if (c != 0)
+            return c;
+        return la < lb ? -1 : (la > lb ? 1 : 0);
+    }
+
+    size_t cvm::string_size(cval *val) {
+        if (val->flag & f_rope)
+            return val->val._rope->size();
+        return *(uint *) ((char *) val + sizeof(cval));
+    }
+
     cval *cvm::val_sub(const char *name, csub sub) {
         auto len = strlen(name);
         auto v = (cval *) mem.alloc(sizeof(cval) + len + 1);
         v->type = ast_sub;
+        v->flag = 0;
         v->next = nullptr;
         auto str = ((char *) v) + sizeof(cval);
         strncpy(str, name, len);
@@ -64,6 +129,7 @@ namespace clib {
         auto v = mem.alloc<cval>();
         v->type = ast_char;
         v->val._char = c;
+        v->flag = 0;
         v->next = nullptr;
         return v;
     }
@@ -81,25 +147,201 @@ namespace clib {
         return v;
     }
 
+    static cbignum::limb_t *bigint_data(cval *val) {
+        return (cbignum::limb_t *) ((char *) val + sizeof(cval));
+    }
+
+    cval *cvm::val_bigint(const cbignum &n) {
+        auto &limbs = n.limbs();
+        auto v = (cval *) mem.alloc(sizeof(cval) + limbs.size() * sizeof(cbignum::limb_t));
+        v->type = ast_bigint;
+        v->flag = 0;
+        v->next = nullptr;
+        v->val._bigint.size = (uint) limbs.size();
+        v->val._bigint.neg = n.negative();
+        std::copy(limbs.begin(), limbs.end(), bigint_data(v));
+        return v;
+    }
+
+    cval *cvm::val_integer(const cbignum &n) {
+        // 结果能放入定长整数时降级
+        slong l;
+        if (!n.to_long(l))
+            return val_bigint(n);
+        cval *v;
+        if (l >= std::numeric_limits<int>::min() && l <= std::numeric_limits<int>::max()) {
+            v = val_obj(ast_int);
+            v->val._int = (int) l;
+        } else {
+            v = val_obj(ast_long);
+            v->val._long = l;
+        }
+        return v;
+    }
+
+    cbignum cvm::bigint(cval *val) {
+        switch (val->type) {
+#define DEFINE_BIGINT(t) case ast_##t: return cbignum((slong) val->val._##t);
+            DEFINE_BIGINT(char)
+            DEFINE_BIGINT(uchar)
+            DEFINE_BIGINT(short)
+            DEFINE_BIGINT(ushort)
+            DEFINE_BIGINT(int)
+            DEFINE_BIGINT(uint)
+            DEFINE_BIGINT(long)
+#undef DEFINE_BIGINT
+            case ast_ulong: {
+                auto n = val->val._ulong;
+                cbignum::limb_t limbs[] = {(cbignum::limb_t) n, (cbignum::limb_t) (n >> 32)};
+                return cbignum(limbs, 2, false);
+            }
+            case ast_bigint:
+                return cbignum(bigint_data(val), val->val._bigint.size, val->val._bigint.neg);
+            default:
+                break;
+        }
+        assert(!"not an integer");
+        return cbignum();
+    }
+
+    cval *cvm::val_array(carray *arr) {
+        auto v = val_obj(ast_array);
+        v->val._array = arr;
+        return v;
+    }
+
+    cseq *cvm::seq_data(cval *val) {
+        return (cseq *) ((char *) val + sizeof(cval));
+    }
+
+    cslot *cvm::slot_data(cval *env) {
+        return (cslot *) ((char *) env + sizeof(cval));
+    }
+
+    cval *cvm::val_seq(lazy_t kind, cval *src, cval *fn, slong start, slong step, slong count) {
+        auto v = (cval *) mem.alloc(sizeof(cval) + sizeof(cseq));
+        v->type = ast_seq;
+        v->flag = 0;
+        v->next = nullptr;
+        auto seq = seq_data(v);
+        seq->kind = kind;
+        seq->start = start;
+        seq->step = step;
+        seq->count = count;
+        seq->src = seq->fn = nullptr;
+        mem.push_root(v);
+        seq->src = src ? copy(src) : nullptr;
+        seq->fn = fn ? copy(fn) : nullptr;
+        mem.pop_root();
+        return v;
+    }
+
+    cval *cvm::val_memo(cmemo *memo) {
+        auto v = val_obj(ast_memo);
+        v->val._memo = memo;
+        return v;
+    }
+
+    cval *cvm::val_chan(cchan *ch) {
+        auto v = val_obj(ast_chan);
+        v->val._chan = ch;
+        return v;
+    }
+
+    cmemo *cvm::memo_create(cval *fn, size_t capacity) {
+        auto memo = new cmemo();
+        memo->ref = 1;
+        memo->capacity = capacity;
+        memo->fn = fn;
+        mem.protect(fn);
+        memos.insert(memo);
+        return memo;
+    }
+
+    void cvm::memo_release(cmemo *memo) {
+        if (--memo->ref > 0)
+            return;
+        for (auto &entry : memo->lru)
+            mem.unprotect(entry);
+        mem.unprotect(memo->fn);
+        memos.erase(memo);
+        delete memo;
+    }
+
+    bool cvm::memo_trim(bool all) {
+        // 缓存条目可随时重算，内存紧张时先丢弃：all时全部丢弃，否则每个表丢弃较旧的一半
+        auto dropped = false;
+        for (auto &memo : memos) {
+            auto keep = all ? 0 : memo->lru.size() / 2;
+            while (memo->lru.size() > keep) {
+                auto old = memo->lru.back();
+                memo->index.erase(old->val._v.child);
+                memo->lru.pop_back();
+                mem.unprotect(old); // 下次回收时释放
+                dropped = true;
+            }
+        }
+        return dropped;
+    }
+
     static cval **lambda_env(cval *val) {
         return (cval **) ((char *) val + sizeof(cval));
     }
 
-    cval *cvm::val_lambda(cval *param, cval *body, cval *env) {
-        auto v = (cval *) mem.alloc(sizeof(cval) + sizeof(cval *));
+    static cval **lambda_code(cval *val) {
+        return (cval **) ((char *) val + sizeof(cval) + sizeof(cval *));
+    }
+
+    cval *cvm::val_lambda(cval *param, cval *body, cval *env, cval *code) {
+        auto v = (cval *) mem.alloc(sizeof(cval) + sizeof(cval *) * 2);
         v->type = ast_lambda;
+        v->flag = 0;
         v->next = nullptr;
+        v->val._lambda.param = v->val._lambda.body = nullptr;
+        *lambda_env(v) = *lambda_code(v) = nullptr;
         mem.push_root(v);
-        v->val._lambda.param = copy(param);
-        v->val._lambda.body = copy(body);
-        if (env == global_env) {
+        // 常量代码（conv时生成）不可变，直接共享
+        v->val._lambda.param = param->flag & f_const ? param : copy(param);
+        if (code == nullptr) {
+            // 新建lambda时折叠函数体，结果缓存在code中，拷贝lambda时直接复用
+            if (body->flag & f_const) {
+                v->val._lambda.body = body;
+                *lambda_code(v) = fold_const(param, body, env);
+            } else {
+                auto _code = copy(body, false);
+                auto ctx = fold_lambda(param, _code, env);
+                v->val._lambda.body = ctx.folds > 0 ? copy(body) : _code;
+                *lambda_code(v) = _code;
+            }
+        } else {
+            v->val._lambda.body = body->flag & f_const ? body : copy(body);
+            if (code == body)
+                *lambda_code(v) = v->val._lambda.body;
+            else
+                *lambda_code(v) = code->flag & f_const ? code : copy(code);
+        }
+        // let的槽环境随帧释放，捕获时展开到闭包自己的环境中，内层优先
+        auto e = env;
+        while (e->flag & f_slots)
+            e = e->val._slots.parent;
+        if (e == env && env == global_env) {
             *lambda_env(v) = new_env(env);
         } else {
-            auto _env = *lambda_env(v) = new_env(env->val._env.parent);
+            auto _env = *lambda_env(v) = new_env(e == global_env ? e : e->val._env.parent);
             mem.push_root(_env);
             auto &_new_env = *_env->val._env.env;
-            for (auto &en : *env->val._env.env) {
-                _new_env.insert(std::make_pair(en.first, copy(en.second)));
+            for (auto s = env; s != e; s = s->val._slots.parent) {
+                auto slots = slot_data(s);
+                for (auto i = (int) s->val._slots.count - 1; i >= 0; i--) {
+                    if (_new_env.find(slots[i].name) == _new_env.end())
+                        _new_env.insert(std::make_pair(slots[i].name, copy(slots[i].val)));
+                }
+            }
+            if (e != global_env) {
+                for (auto &en : *e->val._env.env) {
+                    if (_new_env.find(en.first) == _new_env.end())
+                        _new_env.insert(std::make_pair(en.first, copy(en.second)));
+                }
             }
             mem.pop_root();
         }
@@ -107,6 +349,51 @@ namespace clib {
         return v;
     }
 
+    cvm::fold_ctx cvm::fold_lambda(cval *param, cval *code, cval *env) {
+        fold_ctx ctx{env, {}, 0};
+        for (auto i = param->val._v.child; i; i = i->next) {
+            ctx.shadow.insert(i->val._string);
+        }
+        fold_defs(code, ctx.shadow);
+        if (code->type == ast_sexpr && code->val._v.child)
+            fold_args(code, ctx); // 不带引号的lambda体，根节点即调用本身，原地折叠其参数
+        else
+            fold_code(code, ctx);
+        return ctx;
+    }
+
+    cval *cvm::fold_const(cval *param, cval *body, cval *env) {
+        // 同一段常量代码只折叠一次，但折叠结果依赖环境中内建函数的绑定：
+        // 全局重定义或局部遮蔽后缓存失效，重新折叠且不入缓存
+        auto f = fold_cache.find(body);
+        auto cached = f != fold_cache.end();
+        if (cached) {
+            auto valid = true;
+            for (auto &d : f->second.deps) {
+                auto sub = lookup(d.first.c_str(), env);
+                if (!sub || sub->type != ast_sub || sub->val._sub.sub != d.second) {
+                    valid = false;
+                    break;
+                }
+            }
+            if (valid)
+                return f->second.code;
+        }
+        mem.push_root(consts);
+        auto _code = copy(body, false);
+        auto ctx = fold_lambda(param, _code, env);
+        mem.pop_root();
+        if (ctx.folds > 0) {
+            mark_const(_code);
+        } else {
+            mem.unlink(consts, _code);
+            _code = body;
+        }
+        if (!cached)
+            fold_cache.insert(std::make_pair(body, fold_entry{_code, std::move(ctx.deps)}));
+        return _code;
+    }
+
     static char *sub_name(cval *val) {
         return (char *) val + sizeof(cval);
     }
@@ -139,13 +426,20 @@ namespace clib {
                     auto local = conv(i, env);
                     v->val._v.child = local;
                     v->val._v.count = 1;
+                    auto form = special_form(local, cast::children_size(node));
                     i = i->next;
                     while (i != node->child) {
                         v->val._v.count++;
-                        local->next = conv(i, env);
+                        if (form == sp_lambda)
+                            local->next = conv_lambda(i, env, type == ast_sexpr && v->val._v.count == 2);
+                        else
+                            local->next = conv(i, env);
                         local = local->next;
                         i = i->next;
                     }
+                    v->flag = form;
+                    if (form == sp_lambda) // 相同的lambda共用一份参数与函数体
+                        v->val._v.child->next = intern(v, v->val._v.child->next);
                     mem.pop_root();
                     return v;
                 } else {
@@ -170,21 +464,29 @@ namespace clib {
                     auto local = conv(i, env);
                     v->val._v.child = local;
                     v->val._v.count = 1;
+                    auto form = special_form(local, cast::children_size(node));
                     i = i->next;
                     while (i != node->child) {
                         v->val._v.count++;
-                        local->next = conv(i, env);
+                        if (form == sp_lambda)
+                            local->next = conv_lambda(i, env, type == ast_sexpr && v->val._v.count == 2);
+                        else
+                            local->next = conv(i, env);
                         local = local->next;
                         i = i->next;
                     }
+                    v->flag = form;
                     mem.pop_root();
+                    // 引用的表是常量，驻留后求值与拷贝时共享
+                    mark_const(v);
+                    v->val._v.child = intern(v, v->val._v.child);
                     return v;
                 }
             case ast_string: {
                 auto v = val_str(type, node->data._string);
 #if SHOW_ALLOCATE_NODE
                 printf("[DEBUG] ALLOC | addr: 0x%p, node: %-10s, val: %s\n", v, cast::ast_str(type).c_str(),
-                       v->val._string);
+                       string_cstr(v));
 #endif
                 return v;
             }
@@ -230,8 +532,337 @@ namespace clib {
         return nullptr;
     }
 
+    special_t cvm::special_form(cval *head, uint size) {
+        if (head->type != ast_literal)
+            return sp_none;
+        auto name = head->val._string;
+        if (strcmp(name, "if") == 0)
+            return size == 4 ? sp_if : sp_none;
+        if (strcmp(name, "\\") == 0)
+            return size == 3 ? sp_lambda : sp_none;
+        if (strcmp(name, "def") == 0)
+            return size >= 3 ? sp_def : sp_none;
+        if (strcmp(name, "begin") == 0)
+            return size >= 2 ? sp_begin : sp_none;
+        if (strcmp(name, "while") == 0)
+            return size >= 3 ? sp_while : sp_none;
+        if (strcmp(name, "do") == 0)
+            return size >= 2 ? sp_do : sp_none;
+        if (strcmp(name, "dotimes") == 0)
+            return size >= 3 ? sp_dotimes : sp_none;
+        if (strcmp(name, "let") == 0)
+            return size >= 3 ? sp_let : sp_none;
+        if (strcmp(name, "let*") == 0)
+            return size >= 3 ? sp_let_star : sp_none;
+        if (strcmp(name, "yield") == 0)
+            return size == 1 ? sp_yield : sp_none; // 单元素表达式按求值元素处理，无参的(yield)须在此识别
+        return sp_none;
+    }
+
+    cval *cvm::conv_lambda(ast_node *node, cval *env, bool param) {
+        // lambda的参数与函数体是常量代码，由其创建的所有闭包共享，conv随后将二者一并驻留
+        auto v = conv(node, env);
+        if (param) {
+            if (v->type == ast_sexpr) { // (\ (x y) ...)
+                v->type = ast_qexpr;
+                v->flag = sp_none;
+            } else if (v->type == ast_literal) { // (\ x ...)
+                auto q = val_obj(ast_qexpr);
+                mem.unlink(v);
+                mem.link(q, v);
+                q->val._v.count = 1;
+                q->val._v.child = v;
+                v = q;
+            }
+        }
+        mark_const(v);
+        return v;
+    }
+
+    void cvm::mark_const(cval *val) {
+        val->flag |= f_const;
+        if (val->type == ast_sexpr || val->type == ast_qexpr) {
+            for (auto i = val->val._v.child; i; i = i->next) {
+                mark_const(i);
+            }
+        }
+    }
+
+    static size_t hash_node(cval *val) {
+        auto h = std::hash<uint>()(val->type);
+        switch (val->type) {
+            case ast_sexpr:
+            case ast_qexpr:
+                // 子表已驻留，按指针比较即可
+                h = h * 31 + (val->flag & f_special);
+                h = h * 31 + std::hash<void *>()(val->val._v.child);
+                break;
+            case ast_literal:
+            case ast_string:
+                h = h * 31 + std::hash<string_t>()(string_t(cvm::string_data(val), cvm::string_size(val)));
+                break;
+#define DEFINE_HASH(t) case ast_##t: h = h * 31 + std::hash<decltype(val->val._##t)>()(val->val._##t); break;
+            DEFINE_HASH(char)
+            DEFINE_HASH(uchar)
+            DEFINE_HASH(short)
+            DEFINE_HASH(ushort)
+            DEFINE_HASH(int)
+            DEFINE_HASH(uint)
+            DEFINE_HASH(long)
+            DEFINE_HASH(ulong)
+            DEFINE_HASH(float)
+            DEFINE_HASH(double)
+#undef DEFINE_HASH
+            default:
+                h = h * 31 + std::hash<void *>()(val);
+                break;
+        }
+        return h;
+    }
+
+    static bool equal_node(cval *a, cval *b) {
+        if (a->type != b->type)
+            return false;
+        switch (a->type) {
+            case ast_sexpr:
+            case ast_qexpr:
+                return (a->flag & f_special) == (b->flag & f_special) &&
+                       a->val._v.count == b->val._v.count && a->val._v.child == b->val._v.child;
+            case ast_literal:
+            case ast_string:
+                return cvm::string_compare(a, b) == 0;
+#define DEFINE_EQUAL(t) case ast_##t: return a->val._##t == b->val._##t;
+            DEFINE_EQUAL(char)
+            DEFINE_EQUAL(uchar)
+            DEFINE_EQUAL(short)
+            DEFINE_EQUAL(ushort)
+            DEFINE_EQUAL(int)
+            DEFINE_EQUAL(uint)
+            DEFINE_EQUAL(long)
+            DEFINE_EQUAL(ulong)
+            DEFINE_EQUAL(float)
+            DEFINE_EQUAL(double)
+#undef DEFINE_EQUAL
+            default:
+                return a == b;
+        }
+    }
+
+    cval *cvm::intern(cval *parent, cval *head) {
+        // 常量表做散列合并（hash-consing），相同结构只保留一份，返回规范的表
+        // parent的子对象整体移入consts，重复的一份不再被引用，随后由gc回收
+        size_t h = 0;
+        for (auto i = head; i; i = i->next) {
+            if ((i->type == ast_sexpr || i->type == ast_qexpr) && i->val._v.child &&
+                interned_hash.find(i->val._v.child) == interned_hash.end())
+                i->val._v.child = intern(i, i->val._v.child);
+            h = h * 131 + hash_node(i);
+        }
+        mem.adopt(consts, parent);
+        auto range = interned.equal_range(h);
+        for (auto it = range.first; it != range.second; ++it) {
+            auto a = it->second, b = head;
+            while (a && b && equal_node(a, b)) {
+                a = a->next;
+                b = b->next;
+            }
+            if (!a && !b)
+                return it->second;
+        }
+        interned.insert(std::make_pair(h, head));
+        interned_hash[head] = h;
+        return head;
+    }
+
+    static bool is_const(cval *val) {
+        switch (val->type) {
+            case ast_string:
+            case ast_char:
+            case ast_uchar:
+            case ast_short:
+            case ast_ushort:
+            case ast_int:
+            case ast_uint:
+            case ast_long:
+            case ast_ulong:
+            case ast_float:
+            case ast_double:
+            case ast_qexpr:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    static bool is_zero(cval *val) {
+        switch (val->type) {
+#define DEFINE_ZERO(t) case ast_##t: return val->val._##t == 0;
+            DEFINE_ZERO(char)
+            DEFINE_ZERO(uchar)
+            DEFINE_ZERO(short)
+            DEFINE_ZERO(ushort)
+            DEFINE_ZERO(int)
+            DEFINE_ZERO(uint)
+            DEFINE_ZERO(long)
+            DEFINE_ZERO(ulong)
+#undef DEFINE_ZERO
+            default:
+                return false;
+        }
+    }
+
+    // 常量折叠：纯内建函数作用于常量参数时，在准备阶段直接求值
+    cval *cvm::fold(cval *val, fold_ctx &ctx) {
+        if (val->type != ast_sexpr || !val->val._v.child)
+            return val;
+        if (!fold_args(val, ctx) || val->val._v.count < 2)
+            return val;
+        return fold_call(val, ctx);
+    }
+
+    bool cvm::fold_args(cval *val, fold_ctx &ctx) {
+        auto head = val->val._v.child;
+        if (val->val._v.count > 1 && head->type == ast_literal) {
+            auto name = head->val._string;
+            if (strcmp(name, "quote") == 0 || strcmp(name, "\\") == 0)
+                return false; // 引用为数据，lambda体在创建时折叠
+            if (strcmp(name, "if") == 0 && val->val._v.count == 4) {
+                fold_code(head->next->next, ctx);
+                fold_code(head->next->next->next, ctx);
+            }
+        }
+        fold_children(val, ctx);
+        return true;
+    }
+
+    void cvm::fold_children(cval *val, fold_ctx &ctx) {
+        cval *prev = nullptr;
+        for (auto i = val->val._v.child; i; i = i->next) {
+            auto r = fold(i, ctx);
+            if (r != i) {
+                r->next = i->next;
+                if (prev)
+                    prev->next = r;
+                else
+                    val->val._v.child = r;
+                i = r;
+            }
+            prev = i;
+        }
+    }
+
+    void cvm::fold_code(cval *val, fold_ctx &ctx) {
+        // 作为代码求值的Q-exp（if分支、lambda体）
+        if (val->type != ast_qexpr || val->val._v.count == 0)
+            return;
+        val->type = ast_sexpr;
+        auto r = fold(val, ctx);
+        val->type = ast_qexpr;
+        if (r != val) {
+            r->next = nullptr;
+            val->val._v.child = r;
+            val->val._v.count = 1;
+        }
+    }
+
+    cval *cvm::fold_call(cval *val, fold_ctx &ctx) {
+        auto head = val->val._v.child;
+        if (head->type != ast_literal || ctx.shadow.find(head->val._string) != ctx.shadow.end())
+            return val;
+        auto sub = lookup(head->val._string, ctx.env);
+        if (!sub || sub->type != ast_sub || sub != lookup(head->val._string, global_env))
+            return val;
+        auto fun = sub->val._sub.sub;
+        auto arg = head->next;
+        auto argc = val->val._v.count - 1;
+        for (auto i = arg; i; i = i->next) {
+            if (!is_const(i))
+                return val;
+        }
+        auto type = arg->type;
+        if (fun == builtins::len || fun == builtins::car) {
+            if (argc != 1 || type != ast_qexpr)
+                return val;
+        } else {
+            auto cmp = fun == builtins::lt || fun == builtins::le || fun == builtins::gt ||
+                       fun == builtins::ge || fun == builtins::eq || fun == builtins::ne;
+            auto calc = fun == builtins::add || fun == builtins::sub ||
+                        fun == builtins::mul || fun == builtins::div;
+            if (!cmp && !calc)
+                return val;
+            if (cmp && argc != 2)
+                return val;
+            if (type == ast_string) {
+                if (!cmp && fun != builtins::add)
+                    return val;
+            } else if (type < ast_char || type > ast_double) {
+                return val;
+            }
+            for (auto i = arg->next; i; i = i->next) {
+                // 数值可混合运算，由calc_op提升类型
+                if (type == ast_string ? i->type != type : (i->type < ast_char || i->type > ast_double))
+                    return val;
+                if (fun == builtins::div && is_zero(i))
+                    return val;
+            }
+        }
+        cval op = *sub; // 栈上的临时算符，参数接在其后
+        op.next = arg;
+        cval app = *val;
+        app.val._v.child = &op;
+        cval *ret = nullptr;
+        cframe frame{fun, &app, ctx.env, &ret, nullptr};
+        if (fun(this, &frame) != s_ret || !ret)
+            return val;
+        ctx.folds++;
+        ctx.deps.emplace_back(head->val._string, fun);
+        return ret;
+    }
+
+    void cvm::fold_defs(cval *val, std::unordered_set<string_t> &shadow) {
+        // 被def重新定义的符号、dotimes与let的绑定不参与折叠
+        if (val->type != ast_sexpr && val->type != ast_qexpr)
+            return;
+        auto head = val->val._v.child;
+        if (head && head->type == ast_literal && strcmp(head->val._string, "dotimes") == 0 && head->next) {
+            auto spec = head->next;
+            if ((spec->type == ast_sexpr || spec->type == ast_qexpr) && spec->val._v.child &&
+                spec->val._v.child->type == ast_literal)
+                shadow.insert(spec->val._v.child->val._string);
+        }
+        if (head && head->type == ast_literal && head->next &&
+            (strcmp(head->val._string, "let") == 0 || strcmp(head->val._string, "let*") == 0)) {
+            auto spec = head->next;
+            if (spec->type == ast_sexpr || spec->type == ast_qexpr) {
+                for (auto i = spec->val._v.child; i; i = i->next) {
+                    if ((i->type == ast_sexpr || i->type == ast_qexpr) && i->val._v.child &&
+                        i->val._v.child->type == ast_literal)
+                        shadow.insert(i->val._v.child->val._string);
+                }
+            }
+        }
+        if (head && head->type == ast_literal && strcmp(head->val._string, "def") == 0 && head->next) {
+            auto names = head->next;
+            if (names->type == ast_literal) {
+                shadow.insert(names->val._string);
+            } else if (names->type == ast_sexpr || names->type == ast_qexpr) {
+                for (auto i = names->val._v.child; i; i = i->next) {
+                    if (i->type == ast_literal)
+                        shadow.insert(i->val._string);
+                }
+            }
+        }
+        for (auto i = head; i; i = i->next) {
+            fold_defs(i, shadow);
+        }
+    }
+
     status_t cvm::call(csub fun, cval *val, cval *env, cval **ret) {
+        if (depth_limit && eval_stack.size() >= depth_limit)
+            quota_error("depth");
         auto frame = eval_mem.alloc<cframe>();
+        if (!frame)
+            quota_error("frames");
         memset(frame, 0, sizeof(cframe));
         frame->fun = fun;
         frame->val = val;
@@ -245,38 +876,393 @@ namespace clib {
         if (!root) {
             mem.save_stack();
             root = conv(node, global_env);
+            fold_ctx ctx{global_env, {}, 0};
+            fold_defs(root, ctx.shadow);
+            root = fold(root, ctx);
             ret = nullptr;
             call(eval, root, global_env, &ret);
         }
     }
 
-    cval *cvm::run(int cycle, int &cycles) {
-        // 自己实现调用栈
-        for (auto i = 0; !eval_stack.empty() && i < cycle; i++) {
+    status_t cvm::run_slice(int &budget, int &cycles) {
+        // 自己实现调用栈，运行到栈空、休眠、让出或预算用完
+        while (!eval_stack.empty() && budget > 0) {
+            if (--safepoint <= 0) {
+                safepoint = VM_SAFEPOINT;
+                if (check_halt())
+                    return s_call;
+            }
+            budget--;
             cycles++;
             auto frame = eval_stack.back();
+            auto before = mem.count();
             auto r = frame->fun(this, frame);
+            // 代价模型：每步一个周期，另按本步分配的结点计费，使原生的批量操作与解释步公平竞争
+            auto after = mem.count(); // 本步内回收过时可能变少
+            auto extra = after > before ? (int) ((after - before) / VM_COST_NODES) : 0;
+            budget -= extra;
+            cycles += extra;
             if (r == s_ret) {
                 eval_mem.free(frame);
                 eval_stack.pop_back();
             }
-            if (r == s_sleep) {
-                return nullptr;
+            if (r == s_sleep)
+                return s_sleep;
+            if (yielded) {
+                yielded = false;
+                return s_call;
+            }
+        }
+        return eval_stack.empty() ? s_ret : s_call;
+    }
+
+    status_t cvm::run_thread(cthread *t, int &budget, int &cycles) {
+        // 换入线程的帧栈与GC栈根，出错只结束该线程，错误留给join
+        std::swap(eval_stack, t->stack);
+        current = t;
+        auto depth = mem.stack_depth();
+        mem.push_root(t->root);
+        mem.unstash_stack(t->roots);
+        auto quantum = std::min(budget, VM_QUANTUM);
+        auto left = quantum;
+        status_t r;
+        try {
+            r = run_slice(left, cycles);
+            park_context(t);
+        } catch (const cexception &e) {
+            t->error = e.msg;
+            r = s_error;
+        } catch (const std::exception &e) {
+            t->error = e.what();
+            r = s_error;
+        }
+        budget -= quantum - left;
+        if (r == s_error) {
+            for (auto &frame : eval_stack) {
+                frame_owned.erase(frame);
+                eval_mem.free(frame);
+            }
+            eval_stack.clear();
+            yielded = false;
+            release_chans(chan_wait);
+        }
+        mem.stash_stack(depth + 1, t->roots);
+        mem.pop_root();
+        if (eval_stack.empty())
+            t->done = true;
+        current = nullptr;
+        std::swap(eval_stack, t->stack);
+        if (t->done)
+            finish_thread(t);
+        return r;
+    }
+
+    cval *cvm::run(int cycle, int &cycles) {
+        check_halt();
+        while (cycle > 0) {
+            if (halt) {
+                auto reason = halt;
+                halt = nullptr;
+                error(reason);
+            }
+            if (threads.empty()) {
+                if (eval_stack.empty() || main_timer || blocked(main_joining, main_chans))
+                    break;
+                auto r = run_slice(cycle, cycles);
+                park_context(nullptr);
+                if (halt)
+                    continue;
+                if (r == s_sleep && threads.empty())
+                    return nullptr;
+                continue;
             }
+            // 主线程与各线程轮流运行一个时间片，全部休眠时交还宿主
+            // 等待计时器的上下文不再调用其帧，到期后才重新参与轮转；等待线程的在其结束后、等待通道的在通道有收发后才重试
+            auto active = false;
+            if (root && !eval_stack.empty() && !main_timer && !blocked(main_joining, main_chans)) {
+                auto quantum = std::min(cycle, VM_QUANTUM);
+                auto left = quantum;
+                auto r = run_slice(left, cycles);
+                park_context(nullptr);
+                cycle -= quantum - left;
+                if (halt)
+                    continue;
+                if (eval_stack.empty())
+                    break;
+                if (r != s_sleep)
+                    active = true;
+            }
+            for (size_t i = 0; i < threads.size() && cycle > 0 && !halt; i++) {
+                auto t = threads[i].get();
+                if (!t->done && !t->timer && !blocked(t->joining, t->chans) && run_thread(t, cycle, cycles) != s_sleep)
+                    active = true;
+            }
+            for (size_t i = 0; i < threads.size();) {
+                if (threads[i]->done && threads[i]->detached)
+                    reap_thread(threads[i].get());
+                else
+                    i++;
+            }
+            if (!active)
+                break;
         }
-        if (ret == nullptr)
+        if (!root || !eval_stack.empty() || ret == nullptr)
             return nullptr;
-        assert(ret);
         root = nullptr;
-        eval_stack.clear();
-        eval_mem.clear();
-        eval_tmp.clear();
+        deadline = 0;
+        if (threads.empty()) { // 线程的帧与临时数据也在这两个池中
+            eval_mem.clear();
+            eval_tmp.clear();
+        }
         return ret;
     }
 
+    bool cvm::check_halt() {
+        // 安全点：令牌只需一次原子读，时钟每VM_SAFEPOINT步才读一次，顺带推进时间轮
+        if (cancel && cancel->cancelled())
+            halt = "cancelled";
+        else if (deadline && host->clock() >= deadline)
+            halt = "deadline exceeded";
+        else
+            poll_timers();
+        return halt != nullptr;
+    }
+
+    void cvm::set_deadline(ulong ms) {
+        deadline = ms ? host->clock() + ms : 0;
+    }
+
+    void cvm::set_cancel(ccancel *token) {
+        cancel = token;
+    }
+
+    void cvm::set_heap_limit(size_t bytes) {
+        mem.set_limit(bytes);
+    }
+
+    void cvm::set_depth_limit(uint depth) {
+        depth_limit = depth;
+    }
+
+    size_t cvm::heap_used() const {
+        return mem.used();
+    }
+
+    void cvm::collect() {
+        // 语句执行中的回收：栈底下的临时值都保留，只能回收已被摘下的对象，
+        // 如被def替换的旧值、已返回的lambda调用环境
+        // 各帧的环境链可能挂在摘下的调用环境上，需要额外标记；let的槽环境不在堆上，只标记槽中的值
+        std::vector<void *> extra;
+        std::unordered_set<cval *> visited;
+        auto mark_frames = [&](const std::vector<cframe *> &stack) {
+            for (auto &frame : stack) {
+                if (frame->val && !(frame->val->flag & f_slots))
+                    extra.push_back(frame->val);
+                for (auto e = frame->env; e && e != global_env && visited.insert(e).second;) {
+                    if (e->flag & f_slots) {
+                        auto slots = slot_data(e);
+                        for (uint i = 0; i < e->val._slots.count; i++) {
+                            extra.push_back(slots[i].val);
+                        }
+                        e = e->val._slots.parent;
+                    } else {
+                        extra.push_back(e);
+                        e = e->val._env.parent;
+                    }
+                }
+            }
+        };
+        std::vector<void *> stashed;
+        mark_frames(eval_stack);
+        for (auto &t : threads) {
+            mark_frames(t->stack); // 线程运行时与主线程交换了帧栈，这里恰好是主线程的
+            stashed.insert(stashed.end(), t->roots.begin(), t->roots.end());
+        }
+        mem.gc_running(extra, stashed, [this](void *ptr, std::vector<void *> &out) {
+            trace(ptr, out);
+        });
+    }
+
+    void cvm::quota_error(const char *what, size_t need) {
+        std::stringstream ss;
+        ss << "quota exceeded: " << what << " (heap " << mem.used() << "/"
+           << (mem.get_limit() ? mem.get_limit() : mem.capacity()) << " bytes, ";
+        if (need)
+            ss << "need " << need << " bytes, ";
+        ss << mem.count() << " objects, depth "
+           << eval_stack.size();
+        if (depth_limit)
+            ss << "/" << depth_limit;
+        ss << ")";
+        error(ss.str());
+    }
+
+    void cvm::poll_timers() {
+        if (timers.empty())
+            return;
+        std::vector<ulong> fired;
+        timers.advance(host->clock(), fired);
+        for (auto id : fired) {
+            auto s = sleepers.find(id);
+            if (s == sleepers.end())
+                continue; // 休眠者已被回收
+            if (s->second)
+                s->second->timer = 0;
+            else
+                main_timer = 0;
+            sleepers.erase(s);
+        }
+    }
+
+    void cvm::park_context(cthread *t) {
+        // 每个时间片后记录上下文在等什么，供wait判断
+        (t ? t->joining : main_joining) = join_wait;
+        join_wait = 0;
+        auto &chans = t ? t->chans : main_chans;
+        release_chans(chans);
+        chans.swap(chan_wait);
+        if (!park)
+            return;
+        (t ? t->timer : main_timer) = park;
+        sleepers[park] = t;
+        park = 0;
+    }
+
+    bool cvm::blocked(uint joining, const std::vector<std::pair<cchan *, size_t>> &chans) {
+        // 休眠时等待的线程还没有结束，或等待的通道都还没有收发过，再调用帧也只会继续休眠
+        if (joining) {
+            auto t = find_thread(joining);
+            return t && !t->done;
+        }
+        if (chans.empty())
+            return false;
+        for (auto &c : chans) {
+            if (c.first->events != c.second)
+                return false;
+        }
+        return true;
+    }
+
+    void cvm::wait_chan(cchan *ch, size_t seen) {
+        // seen须在尝试收发之前读取，期间的收发使休眠者立即重试
+        chan_wait.emplace_back(ch->retain(), seen);
+    }
+
+    void cvm::release_chans(std::vector<std::pair<cchan *, size_t>> &chans) {
+        for (auto &c : chans) {
+            c.first->release();
+        }
+        chans.clear();
+    }
+
+    bool cvm::wait() {
+        // 只有主线程与所有线程都在等计时器、未结束的线程或通道时才能阻塞
+        // 通道可能由其他cvm收发：先在通道上登记令牌再确认一次，收发时经令牌唤醒
+        std::vector<std::pair<cchan *, size_t>> chans;
+        auto parked = [&](uint joining, ulong timer, const std::vector<std::pair<cchan *, size_t>> &waits) {
+            if (!timer && !blocked(joining, waits))
+                return false;
+            chans.insert(chans.end(), waits.begin(), waits.end());
+            return true;
+        };
+        if (root && !eval_stack.empty() && !parked(main_joining, main_timer, main_chans))
+            return false;
+        for (auto &t : threads) {
+            if (!t->done && !parked(t->joining, t->timer, t->chans))
+                return false;
+        }
+        ulong next;
+        auto timed = timers.next(next);
+        if (!timed && chans.empty())
+            return false;
+        if (!chans.empty()) {
+            auto poll = host->clock() + VM_IDLE_POLL;
+            next = timed ? std::min(next, poll) : poll;
+        }
+        auto token = cancel ? cancel : &wake;
+        for (auto &c : chans) {
+            c.first->watch(token);
+        }
+        if (chans.empty() || blocked(0, chans))
+            host->idle(deadline ? std::min(next, deadline) : next, token);
+        for (auto &c : chans) {
+            c.first->unwatch(token);
+        }
+        return true;
+    }
+
+    bool cvm::has_threads() const {
+        for (auto &t : threads) {
+            if (!t->done)
+                return true;
+        }
+        return false;
+    }
+
+    cthread *cvm::find_thread(uint id) {
+        for (auto &t : threads) {
+            if (t->id == id)
+                return t.get();
+        }
+        return nullptr;
+    }
+
+    void cvm::finish_thread(cthread *t) {
+        // 结束的线程只保留结果，其余临时值随旧根在下次回收时释放
+        auto keep = val_obj(ast_qexpr);
+        keep->val._v.count = 0;
+        keep->val._v.child = nullptr;
+        mem.unlink(keep);
+        mem.protect(keep);
+        if (t->error.empty() && t->ret) {
+            mem.push_root(keep);
+            t->ret = copy(t->ret);
+            mem.pop_root();
+        }
+        mem.unprotect(t->root);
+        t->root = keep;
+        release_chans(t->chans); // 出错结束时还留着上次休眠的通道
+    }
+
+    void cvm::report_thread(cthread *t) {
+        // 没有被join的线程出错时交给宿主输出，不静默丢弃
+        if (t->done && !t->error.empty())
+            host->put_string("thread " + std::to_string(t->id) + ": " + t->error + "\n");
+    }
+
+    void cvm::reap_thread(cthread *t) {
+        report_thread(t);
+        mem.unprotect(t->root);
+        threads.erase(std::find_if(threads.begin(), threads.end(),
+                                   [t](const std::unique_ptr<cthread> &p) { return p.get() == t; }));
+    }
+
+    void cvm::kill_threads() {
+        for (auto &t : threads) {
+            report_thread(t.get());
+            mem.unprotect(t->root);
+            release_chans(t->chans);
+        }
+        threads.clear();
+        current = nullptr;
+        yielded = false;
+        timers.clear();
+        sleepers.clear();
+        main_timer = 0;
+        main_joining = 0;
+        park = 0;
+        join_wait = 0;
+        release_chans(main_chans);
+        release_chans(chan_wait);
+    }
+
+    void cvm::set_host(chost *h) {
+        host = h ? h : &default_host;
+    }
+
     void cvm::error(const string_t &info) {
         printf("COMPILER ERROR: %s\n", info.c_str());
-        throw std::exception();
+        throw cexception(info);
     }
 
     void cvm::print(cval *val, std::ostream &os) {
@@ -289,7 +1275,11 @@ namespace clib {
                 break;
             case ast_lambda:
                 os << "<lambda ";
-                print(val->val._lambda.param, os);
+                {
+                    cval param = *val->val._lambda.param; // 共享的参数表仍连着函数体
+                    param.next = nullptr;
+                    print(&param, os);
+                }
                 os << ' ';
                 print(val->val._lambda.body, os);
                 os << ">";
@@ -329,7 +1319,7 @@ namespace clib {
                 os << val->val._string;
                 break;
             case ast_string:
-                os << '"' << cast::display_str(val->val._string) << '"';
+                os << '"' << cast::display_str(string_cstr(val)) << '"';
                 break;
             case ast_char:
                 if (isprint(val->val._char))
@@ -368,23 +1358,318 @@ namespace clib {
             case ast_double:
                 os << val->val._double;
                 break;
+            case ast_bigint:
+                os << bigint(val).to_string();
+                break;
+            case ast_array: {
+                auto arr = val->val._array;
+                os << (arr->type == arr_f64 ? "#f64(" : "#i64(");
+                for (size_t i = 0; i < arr->size; i++) {
+                    if (i > 0)
+                        os << ' ';
+                    if (arr->type == arr_f64)
+                        os << arr->f64[i];
+                    else
+                        os << arr->i64[i];
+                }
+                os << ')';
+            }
+                break;
+            case ast_memo:
+                os << "<memo ";
+                print(val->val._memo->fn, os);
+                os << '>';
+                break;
+            case ast_chan:
+                os << "<chan " << val->val._chan->size() << '/' << val->val._chan->capacity << '>';
+                break;
+            case ast_seq: {
+                static const char *names[] = {"list", "array", "range", "map", "filter", "take", "drop", "zip"};
+                os << "<seq " << names[seq_data(val)->kind] << '>';
+            }
+                break;
         }
         if (val->next) {
             os << ' ';
         }
     }
 
+    // 结构相等与哈希：整数按数值比较（不区分宽度），浮点数之间按double比较，
+    // 整数与浮点数不相等；表、字符串、数组逐元素比较，lambda比较参数与函数体
+
+    enum num_class_t {
+        nc_none,
+        nc_int,
+        nc_big, // 超出long的整数
+        nc_float,
+    };
+
+    static num_class_t num_class(cval *val, slong &i, double &d) {
+        switch (val->type) {
+#define DEFINE_NUM_CLASS(t) case ast_##t: i = (slong) val->val._##t; return nc_int;
+            DEFINE_NUM_CLASS(char)
+            DEFINE_NUM_CLASS(uchar)
+            DEFINE_NUM_CLASS(short)
+            DEFINE_NUM_CLASS(ushort)
+            DEFINE_NUM_CLASS(int)
+            DEFINE_NUM_CLASS(uint)
+            DEFINE_NUM_CLASS(long)
+#undef DEFINE_NUM_CLASS
+            case ast_ulong:
+                if (val->val._ulong > (ulong) std::numeric_limits<slong>::max())
+                    return nc_big;
+                i = (slong) val->val._ulong;
+                return nc_int;
+            case ast_bigint:
+                return nc_big;
+            case ast_float:
+                d = val->val._float;
+                return nc_float;
+            case ast_double:
+                d = val->val._double;
+                return nc_float;
+            default:
+                return nc_none;
+        }
+    }
+
+    static bool equal_atom(cval *a, cval *b) {
+        slong ia = 0, ib = 0;
+        double da = 0, db = 0;
+        auto ca = num_class(a, ia, da), cb = num_class(b, ib, db);
+        if (ca != nc_none || cb != nc_none) {
+            if (ca == nc_int && cb == nc_int)
+                return ia == ib;
+            if (ca == nc_float && cb == nc_float)
+                return da == db;
+            if ((ca == nc_big || ca == nc_int) && (cb == nc_big || cb == nc_int))
+                return cvm::bigint(a).compare(cvm::bigint(b)) == 0;
+            return false;
+        }
+        if (a->type != b->type)
+            return false;
+        switch (a->type) {
+            case ast_literal:
+            case ast_string:
+                return cvm::string_compare(a, b) == 0;
+            case ast_sub:
+                return a->val._sub.sub == b->val._sub.sub;
+            case ast_memo:
+                return a->val._memo == b->val._memo;
+            case ast_chan:
+                return a->val._chan == b->val._chan;
+            case ast_array: {
+                auto x = a->val._array, y = b->val._array;
+                if (x->type != y->type || x->size != y->size)
+                    return false;
+                if (x->type == arr_f64)
+                    return std::equal(x->f64, x->f64 + x->size, y->f64);
+                return std::equal(x->i64, x->i64 + x->size, y->i64);
+            }
+            default:
+                return a == b;
+        }
+    }
+
+    bool cvm::equal(cval *a, cval *b) {
+        // 显式栈，遇到第一个不同立即返回
+        std::vector<std::pair<cval *, cval *>> stack{{a, b}};
+        while (!stack.empty()) {
+            auto x = stack.back().first, y = stack.back().second;
+            stack.pop_back();
+            if (x == y)
+                continue;
+            switch (x->type) {
+                case ast_sexpr:
+                case ast_qexpr:
+                    if (x->type != y->type || x->val._v.count != y->val._v.count)
+                        return false;
+                    for (auto i = x->val._v.child, j = y->val._v.child; i; i = i->next, j = j->next)
+                        stack.emplace_back(i, j);
+                    break;
+                case ast_lambda:
+                    if (y->type != ast_lambda)
+                        return false;
+                    stack.emplace_back(x->val._lambda.body, y->val._lambda.body);
+                    stack.emplace_back(x->val._lambda.param, y->val._lambda.param);
+                    break;
+                default:
+                    if (!equal_atom(x, y))
+                        return false;
+                    break;
+            }
+        }
+        return true;
+    }
+
+    static size_t hash_combine(size_t h, size_t v) {
+        return h ^ (v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2));
+    }
+
+    static size_t hash_bytes(const char *data, size_t len) {
+        // FNV-1a
+        size_t h = 14695981039346656037ULL;
+        for (size_t i = 0; i < len; i++) {
+            h ^= (unsigned char) data[i];
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    static size_t hash_atom(cval *val) {
+        slong i = 0;
+        double d = 0;
+        switch (num_class(val, i, d)) {
+            case nc_int:
+                return hash_combine(nc_int, std::hash<slong>()(i));
+            case nc_big: {
+                auto n = cvm::bigint(val);
+                auto &limbs = n.limbs();
+                return hash_combine(hash_combine(nc_big, n.negative()),
+                                    hash_bytes((const char *) limbs.data(), limbs.size() * sizeof(limbs[0])));
+            }
+            case nc_float:
+                return hash_combine(nc_float, std::hash<double>()(d == 0 ? 0.0 : d)); // -0.0 == 0.0
+            default:
+                break;
+        }
+        auto h = std::hash<uint>()(val->type);
+        switch (val->type) {
+            case ast_literal:
+            case ast_string:
+                return hash_combine(h, hash_bytes(cvm::string_data(val), cvm::string_size(val)));
+            case ast_sub:
+                return hash_combine(h, std::hash<void *>()((void *) val->val._sub.sub));
+            case ast_memo:
+                return hash_combine(h, std::hash<void *>()(val->val._memo));
+            case ast_chan:
+                return hash_combine(h, std::hash<void *>()(val->val._chan));
+            case ast_array: {
+                auto arr = val->val._array;
+                h = hash_combine(h, arr->type);
+                if (arr->type == arr_i64)
+                    return hash_combine(h, hash_bytes((const char *) arr->i64, arr->size * sizeof(slong)));
+                for (size_t k = 0; k < arr->size; k++)
+                    h = hash_combine(h, std::hash<double>()(arr->f64[k] == 0 ? 0.0 : arr->f64[k]));
+                return h;
+            }
+            default:
+                return hash_combine(h, std::hash<void *>()(val));
+        }
+    }
+
+    size_t cvm::hash(cval *val) {
+        // 先序遍历，与equal一致：相等的值哈希相同
+        size_t h = 0;
+        std::vector<cval *> stack{val};
+        while (!stack.empty()) {
+            auto v = stack.back();
+            stack.pop_back();
+            switch (v->type) {
+                case ast_sexpr:
+                case ast_qexpr: {
+                    h = hash_combine(h, hash_combine(v->type, v->val._v.count));
+                    auto size = stack.size();
+                    for (auto i = v->val._v.child; i; i = i->next)
+                        stack.push_back(i);
+                    std::reverse(stack.begin() + size, stack.end());
+                }
+                    break;
+                case ast_lambda:
+                    h = hash_combine(h, ast_lambda);
+                    stack.push_back(v->val._lambda.body);
+                    stack.push_back(v->val._lambda.param);
+                    break;
+                default:
+                    h = hash_combine(h, hash_atom(v));
+                    break;
+            }
+        }
+        return h;
+    }
+
     void cvm::gc() {
 #if SHOW_ALLOCATE_NODE
         dump();
 #endif
-        mem.gc();
+        // consts是弱根：常量代码只在仍被存活的值（闭包、全局定义等）引用时保留
+        auto trace = [this](void *ptr, std::vector<void *> &out) {
+            this->trace(ptr, out);
+        };
+        mem.gc(consts, trace);
+        // 回收后仍超过上限的3/4时，memo缓存让出较旧的一半
+        auto budget = mem.get_limit() ? mem.get_limit() : mem.capacity();
+        if (mem.used() > budget / 4 * 3 && memo_trim(false))
+            mem.gc(consts, trace);
 #if SHOW_ALLOCATE_NODE
         printf("[DEBUG] MEM   | Alive objects: %lu\n", mem.count());
 #endif
     }
 
-    cval *cvm::copy(cval *val) {
+    void cvm::trace(void *ptr, std::vector<void *> &out) {
+        // 回收时的引用：对象数据中的引用，加上常量折叠缓存的结果
+        auto val = (cval *) ptr;
+        refs(val, out);
+        if (val->flag & f_const) {
+            auto f = fold_cache.find(val);
+            if (f != fold_cache.end())
+                out.push_back(f->second.code);
+        }
+    }
+
+    void cvm::refs(cval *val, std::vector<void *> &out) {
+        // 对象数据中引用、但不一定归其所有的对象，所有权树之外的引用都在这里
+        switch (val->type) {
+            case ast_sexpr:
+            case ast_qexpr:
+                for (auto i = val->val._v.child; i; i = i->next) {
+                    out.push_back(i);
+                }
+                break;
+            case ast_lambda:
+                out.push_back(val->val._lambda.param);
+                out.push_back(val->val._lambda.body);
+                out.push_back(*lambda_env(val));
+                if (*lambda_code(val))
+                    out.push_back(*lambda_code(val));
+                break;
+            case ast_env:
+                if (val->val._env.parent)
+                    out.push_back(val->val._env.parent);
+                for (auto &en : *val->val._env.env) {
+                    out.push_back(en.second);
+                }
+                break;
+            case ast_seq: {
+                auto seq = seq_data(val);
+                if (seq->src)
+                    out.push_back(seq->src);
+                if (seq->fn)
+                    out.push_back(seq->fn);
+            }
+                break;
+            default:
+                break;
+        }
+    }
+
+    void cvm::forget(cval *val) {
+        // 常量被回收时移出折叠缓存与驻留表
+        fold_cache.erase(val);
+        auto h = interned_hash.find(val);
+        if (h == interned_hash.end())
+            return;
+        auto range = interned.equal_range(h->second);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second == val) {
+                interned.erase(it);
+                break;
+            }
+        }
+        interned_hash.erase(h);
+    }
+
+    cval *cvm::copy(cval *val, bool share) {
         cval *new_val{nullptr};
         switch (val->type) {
             case ast_root:
@@ -392,7 +1677,8 @@ namespace clib {
                 error("not supported");
                 break;
             case ast_lambda:
-                new_val = val_lambda(val->val._lambda.param, val->val._lambda.body, *lambda_env(val));
+                new_val = val_lambda(val->val._lambda.param, val->val._lambda.body, *lambda_env(val),
+                                     *lambda_code(val));
                 break;
             case ast_sub:
                 new_val = val_sub(val);
@@ -401,16 +1687,20 @@ namespace clib {
             case ast_sexpr:
             case ast_qexpr:
                 new_val = val_obj(val->type);
+                new_val->flag = val->flag & f_special;
                 new_val->val._v.count = val->val._v.count;
-                if (new_val->val._v.count > 0) {
+                if (share && new_val->val._v.count > 0 && (val->val._v.child->flag & f_const)) {
+                    // 常量子表不可变，只需新建表头
+                    new_val->val._v.child = val->val._v.child;
+                } else if (new_val->val._v.count > 0) {
                     mem.push_root(new_val);
                     auto head = val->val._v.child;
-                    new_val->val._v.child = copy(head);
+                    new_val->val._v.child = copy(head, share);
                     if (val->val._v.count > 1) {
                         auto _head = new_val->val._v.child;
                         head = head->next;
                         while (head) {
-                            _head->next = copy(head);
+                            _head->next = copy(head, share);
                             head = head->next;
                             _head = _head->next;
                         }
@@ -422,7 +1712,10 @@ namespace clib {
                 break;
             case ast_literal:
             case ast_string:
-                new_val = val_str(val->type, val->val._string);
+                if (val->flag & f_rope)
+                    new_val = val_rope(val->val._rope->retain());
+                else
+                    new_val = val_str(val->type, val->val._string, string_size(val));
                 break;
             case ast_char:
             case ast_uchar:
@@ -437,6 +1730,30 @@ namespace clib {
                 new_val = val_obj(val->type);
                 std::memcpy((char *) &new_val->val, (char *) &val->val, sizeof(val->val));
                 break;
+            case ast_bigint: {
+                auto size = sizeof(cval) + val->val._bigint.size * sizeof(cbignum::limb_t);
+                new_val = (cval *) mem.alloc(size);
+                std::memcpy((char *) new_val, (char *) val, size);
+                new_val->flag = 0;
+                new_val->next = nullptr;
+            }
+                break;
+            case ast_array:
+                // 数组不可变，共享数据
+                new_val = val_array(val->val._array->retain());
+                break;
+            case ast_memo:
+                val->val._memo->ref++;
+                new_val = val_memo(val->val._memo);
+                break;
+            case ast_chan:
+                new_val = val_chan(val->val._chan->retain());
+                break;
+            case ast_seq: {
+                auto seq = seq_data(val);
+                new_val = val_seq(seq->kind, seq->src, seq->fn, seq->start, seq->step, seq->count);
+            }
+                break;
             default:
                 error("invalid copy");
                 break;
@@ -449,23 +1766,52 @@ namespace clib {
         return new_val;
     }
 
-    cval *cvm::calc_symbol(const char *sym, cval *env) {
+    cval *cvm::lookup(const char *sym, cval *env) {
         while (env) {
+            if (env->flag & f_slots) {
+                auto slots = slot_data(env);
+                for (auto i = (int) env->val._slots.count - 1; i >= 0; i--) {
+                    if (strcmp(slots[i].name, sym) == 0)
+                        return slots[i].val;
+                }
+                env = env->val._slots.parent;
+                continue;
+            }
             auto &_env = *env->val._env.env;
             auto f = _env.find(sym);
             if (f != _env.end()) {
-                return copy(f->second);
+                return f->second;
             }
             env = env->val._env.parent;
         }
+        return nullptr;
+    }
+
+    cval *cvm::calc_symbol(const char *sym, cval *env) {
+        auto f = lookup(sym, env);
+        if (f) {
+            return copy(f);
+        }
         printf("invalid symbol: %s\n", sym);
         error("cannot find symbol");
         return nullptr;
     }
 
     cval *cvm::def(cval *env, const char *sym, cval *val) {
+        while (env->flag & f_slots) { // 新名字定义到let之外的环境
+            auto slots = slot_data(env);
+            for (auto i = (int) env->val._slots.count - 1; i >= 0; i--) {
+                if (strcmp(slots[i].name, sym) == 0)
+                    return slots[i].val = copy(val);
+            }
+            env = env->val._slots.parent;
+        }
         auto e = env;
         while (env) {
+            if (env->flag & f_slots) {
+                env = env->val._slots.parent;
+                continue;
+            }
             auto &_env = *env->val._env.env;
             auto f = _env.find(sym);
             if (f != _env.end()) {
@@ -473,6 +1819,11 @@ namespace clib {
                 auto new_val = copy(val);
                 mem.pop_root();
                 mem.unlink(env, f->second);
+                if (pinned && env == global_env) {
+                    auto p = pinned->find(sym);
+                    if (p != pinned->end() && p->second == f->second)
+                        mem.protect(f->second);
+                }
                 _env[sym] = new_val;
                 return new_val;
             }
@@ -485,6 +1836,263 @@ namespace clib {
         return new_val;
     }
 
+    cpacket::~cpacket() {
+        if (local)
+            owner->mem.unprotect(local);
+        for (auto &n : nodes) {
+            if (n.type == ast_array)
+                n.val._array->release();
+            else if (n.type == ast_chan)
+                n.val._chan->release();
+        }
+    }
+
+    void cvm::pack(cval *val, cpacket &p) {
+        std::unordered_set<cval *> visiting;
+        pack_node(val, p, visiting);
+    }
+
+    cval *cvm::unpack(const cpacket &p) {
+        size_t i = 0;
+        return unpack_node(p, i);
+    }
+
+    void cvm::post(cchan *ch, cval *val, cpacket &p) {
+        if (ch->owner != this) {
+            pack(val, p);
+            return;
+        }
+        p.local = copy(val);
+        p.owner = this;
+        mem.unlink(p.local);
+        mem.protect(p.local);
+    }
+
+    cval *cvm::take(cpacket &p) {
+        if (!p.local)
+            return unpack(p);
+        auto val = p.local;
+        p.local = nullptr;
+        mem.unprotect(val);
+        mem.link(val);
+        return val;
+    }
+
+    void cvm::share(cchan *ch) {
+        // 通道第一次离开本cvm时，把队列中移交的值就地打包，此后与其他cvm一样收发打包的值
+        // 有值无法打包时原样放回并报错，通道仍只在本cvm内使用
+        if (ch->owner != this)
+            return;
+        std::vector<cpacket *> queued;
+        while (auto p = ch->try_recv())
+            queued.push_back(p);
+        ch->owner = nullptr; // 值中可能再次引用本通道
+        try {
+            for (auto &p : queued) {
+                if (!p->local)
+                    continue;
+                cpacket tmp;
+                pack(p->local, tmp);
+                p->nodes.swap(tmp.nodes);
+                mem.unprotect(p->local);
+                p->local = nullptr;
+            }
+        } catch (...) {
+            ch->owner = this;
+            for (auto &p : queued)
+                ch->try_send(p);
+            throw;
+        }
+        for (auto &p : queued)
+            ch->try_send(p);
+    }
+
+    void cvm::pack_node(cval *val, cpacket &p, std::unordered_set<cval *> &visiting) {
+        cpacket::node n{val->type, 0, 0, val->val, ""};
+        switch (val->type) {
+            case ast_sexpr:
+            case ast_qexpr: {
+                n.flag = val->flag & f_special;
+                n.count = val->val._v.count;
+                p.nodes.push_back(n);
+                for (auto i = val->val._v.child; i; i = i->next) {
+                    pack_node(i, p, visiting);
+                }
+                return;
+            }
+            case ast_literal:
+                n.str = val->val._string;
+                break;
+            case ast_string:
+                n.str.assign(string_data(val), string_size(val));
+                break;
+            case ast_sub:
+                n.str = sub_name(val);
+                break;
+            case ast_bigint:
+                n.str.assign((const char *) bigint_data(val), val->val._bigint.size * sizeof(cbignum::limb_t));
+                break;
+            case ast_array:
+                val->val._array->retain();
+                break;
+            case ast_chan:
+                share(val->val._chan);
+                val->val._chan->retain();
+                break;
+            case ast_lambda:
+                pack_lambda(val, p, visiting);
+                return;
+            case ast_memo:
+                n.count = 1;
+                n.val._ulong = (ulong) val->val._memo->capacity;
+                p.nodes.push_back(n);
+                pack_node(val->val._memo->fn, p, visiting);
+                return;
+            case ast_char:
+            case ast_uchar:
+            case ast_short:
+            case ast_ushort:
+            case ast_int:
+            case ast_uint:
+            case ast_long:
+            case ast_ulong:
+            case ast_float:
+            case ast_double:
+                break;
+            default:
+                error("pack: unsupported type " + cast::ast_str(val->type));
+        }
+        p.nodes.push_back(n);
+    }
+
+    static void free_symbols(cval *val, std::unordered_set<string_t> &names) {
+        if (val->type == ast_literal) {
+            names.insert(val->val._string);
+        } else if (val->type == ast_sexpr || val->type == ast_qexpr) {
+            for (auto i = val->val._v.child; i; i = i->next) {
+                free_symbols(i, names);
+            }
+        }
+    }
+
+    void cvm::pack_lambda(cval *val, cpacket &p, std::unordered_set<cval *> &visiting) {
+        // 依次为参数表、函数体、捕获的绑定，以及函数体引用的全局定义
+        // 递归引用自身的全局定义不再打包，运行时沿调用者的环境找到
+        visiting.insert(val);
+        auto index = p.nodes.size();
+        p.nodes.push_back(cpacket::node{ast_lambda, 0, 2, val->val, ""});
+        cval param = *val->val._lambda.param; // 共享的参数表仍连着函数体
+        param.next = nullptr;
+        pack_node(&param, p, visiting);
+        pack_node(val->val._lambda.body, p, visiting);
+        std::unordered_set<string_t> bound;
+        for (auto i = param.val._v.child; i; i = i->next) {
+            bound.insert(i->val._string);
+        }
+        auto bind = [&](const string_t &name, cval *v) {
+            p.nodes.push_back(cpacket::node{ast_env, 0, 1, v->val, name});
+            pack_node(v, p, visiting);
+            p.nodes[index].count++;
+            bound.insert(name);
+        };
+        auto env = *lambda_env(val);
+        if (env != global_env) {
+            for (auto &en : *env->val._env.env) {
+                if (bound.find(en.first) == bound.end() && visiting.find(en.second) == visiting.end())
+                    bind(en.first, en.second);
+            }
+        }
+        std::unordered_set<string_t> names;
+        free_symbols(val->val._lambda.body, names);
+        for (auto &name : names) {
+            if (bound.find(name) != bound.end())
+                continue;
+            auto g = lookup(name.c_str(), global_env);
+            if (!g || visiting.find(g) != visiting.end())
+                continue;
+            if (g->type == ast_sub && name == sub_name(g))
+                continue; // 内建函数在各cvm中都有
+            bind(name, g);
+        }
+        visiting.erase(val);
+    }
+
+    cval *cvm::unpack_node(const cpacket &p, size_t &i) {
+        auto &n = p.nodes[i++];
+        switch (n.type) {
+            case ast_sexpr:
+            case ast_qexpr: {
+                auto v = val_obj(n.type);
+                v->flag = n.flag;
+                v->val._v.count = n.count;
+                v->val._v.child = nullptr;
+                mem.push_root(v);
+                cval *local = nullptr;
+                for (uint k = 0; k < n.count; k++) {
+                    auto child = unpack_node(p, i);
+                    if (local)
+                        local->next = child;
+                    else
+                        v->val._v.child = child;
+                    local = child;
+                }
+                mem.pop_root();
+                return v;
+            }
+            case ast_literal:
+                return val_str(ast_literal, n.str.c_str());
+            case ast_string:
+                return val_str(ast_string, n.str.data(), n.str.size());
+            case ast_sub: {
+                auto sub = lookup(n.str.c_str(), global_env);
+                if (!sub || sub->type != ast_sub)
+                    error("unpack: cannot find subroutine " + n.str);
+                return copy(sub);
+            }
+            case ast_bigint:
+                return val_bigint(cbignum((const cbignum::limb_t *) n.str.data(), n.val._bigint.size,
+                                          n.val._bigint.neg));
+            case ast_array:
+                return val_array(n.val._array->retain());
+            case ast_chan:
+                return val_chan(n.val._chan->retain());
+            case ast_lambda: {
+                // 参数与函数体先在当前根下解出，再与conv一样驻留，相同的代码共用一份，闭包拷贝时共享
+                // 绑定先放入临时环境，创建lambda时按闭包规则复制进去
+                auto code = val_obj(ast_qexpr);
+                mem.push_root(code);
+                auto param = unpack_node(p, i);
+                auto body = unpack_node(p, i);
+                mem.pop_root();
+                mark_const(param);
+                mark_const(body);
+                param->next = body;
+                body->next = nullptr;
+                param = intern(code, param);
+                body = param->next;
+                auto env = new_env(global_env);
+                mem.push_root(env);
+                auto &_env = *env->val._env.env;
+                for (uint k = 2; k < n.count; k++) {
+                    auto &name = p.nodes[i++].str;
+                    _env[name] = unpack_node(p, i);
+                }
+                auto v = val_lambda(param, body, env);
+                mem.pop_root();
+                return v;
+            }
+            case ast_memo: {
+                auto capacity = (size_t) n.val._ulong;
+                return val_memo(memo_create(unpack_node(p, i), capacity));
+            }
+            default: {
+                auto v = val_obj(n.type);
+                v->val = n.val;
+                return v;
+            }
+        }
+    }
+
     cval *cvm::new_env(cval *env) {
         auto _env = val_obj(ast_env);
         _env->val._env.env = new cval::cenv_t();
@@ -492,11 +2100,23 @@ namespace clib {
         return _env;
     }
 
+    cval *cvm::slot_env(cval *env, uint size) {
+        auto _env = (cval *) tmp_alloc<char>(sizeof(cval) + sizeof(cslot) * size);
+        _env->type = ast_env;
+        _env->flag = f_slots;
+        _env->next = nullptr;
+        _env->val._slots.parent = env;
+        _env->val._slots.count = 0;
+        return _env;
+    }
+
     void cvm::set_free_callback() {
 #if SHOW_ALLOCATE_NODE
-        mem.set_callback([](void *ptr) {
+        mem.set_callback([this](void *ptr) {
             cval *val = (cval *) ptr;
             printf("[DEBUG] GC    | free: 0x%p, node: %-10s, ", ptr, cast::ast_str(val->type).c_str());
+            if (val->flag & f_const)
+                forget(val);
             if (val->type == ast_sexpr || val->type == ast_qexpr) {
                 printf("count: %lu\n", children_size(val));
             } else if (val->type == ast_literal) {
@@ -504,6 +2124,18 @@ namespace clib {
             } else if (val->type == ast_env) {
                 printf("env: %d\n", val->val._env.env->size());
                 delete val->val._env.env;
+            } else if (val->type == ast_array) {
+                printf("array: %lu\n", val->val._array->size);
+                val->val._array->release();
+            } else if (val->type == ast_string && (val->flag & f_rope)) {
+                printf("rope: %lu\n", val->val._rope->size());
+                val->val._rope->release();
+            } else if (val->type == ast_memo) {
+                printf("memo: %lu\n", val->val._memo->lru.size());
+                memo_release(val->val._memo);
+            } else if (val->type == ast_chan) {
+                printf("chan: %lu\n", val->val._chan->size());
+                val->val._chan->release();
             } else if (val->type == ast_sub) {
                 printf("name: %s\n", sub_name(val));
             } else {
@@ -532,23 +2164,48 @@ namespace clib {
             }
         });
 #else
-        mem.set_callback([](void *ptr) {
+        mem.set_callback([this](void *ptr) {
             cval *val = (cval *) ptr;
+            if (val->flag & f_const)
+                forget(val);
             if (val->type == ast_env) {
                 delete val->val._env.env;
+            } else if (val->type == ast_array) {
+                val->val._array->release();
+            } else if (val->type == ast_string && (val->flag & f_rope)) {
+                val->val._rope->release();
+            } else if (val->type == ast_memo) {
+                memo_release(val->val._memo);
+            } else if (val->type == ast_chan) {
+                val->val._chan->release();
             }
         });
 #endif
     }
 
+    void cvm::set_oom_callback() {
+        mem.set_oom_callback([this](size_t size, bool fatal) {
+            if (fatal)
+                quota_error("heap", size);
+            if (!eval_stack.empty()) { // 只在运行期间回收，prepare与初始化时直接报错
+                memo_trim(true);
+                collect();
+            }
+        });
+    }
+
     void cvm::save() {
         mem.save_stack();
     }
 
     void cvm::restore() {
+        kill_threads();
         root = nullptr;
+        deadline = 0;
+        halt = nullptr;
         mem.restore_stack();
         eval_stack.clear();
+        frame_owned.clear();
         eval_mem.clear();
         eval_tmp.clear();
     }
@@ -561,10 +2218,161 @@ namespace clib {
 
     void cvm::reset() {
         global_env = nullptr;
+        pinned.reset();
+        consts = nullptr;
+        fold_cache.clear();
+        interned.clear();
+        interned_hash.clear();
+        kill_threads();
         mem.clear();
         eval_stack.clear();
+        frame_owned.clear();
         eval_mem.clear();
         eval_tmp.clear();
         builtin();
     }
+
+    void cvm::pin() {
+        pinned = std::make_unique<cval::cenv_t>(*global_env->val._env.env);
+    }
+
+    void cvm::rebase() {
+        // 任务新建或覆盖的全局定义从环境中摘除，被覆盖的旧值重新挂回，然后一并回收
+        kill_threads();
+        auto &env = *global_env->val._env.env;
+        for (auto &e : env) {
+            auto p = pinned->find(e.first);
+            if (p == pinned->end() || p->second != e.second)
+                mem.unlink(global_env, e.second);
+        }
+        for (auto &p : *pinned) {
+            auto e = env.find(p.first);
+            if (e == env.end() || e->second != p.second) {
+                mem.unprotect(p.second);
+                mem.link(global_env, p.second);
+            }
+        }
+        env = *pinned;
+        gc();
+    }
+
+    std::unique_ptr<cvm> cvm::fork() {
+        if (root || !eval_stack.empty() || has_threads())
+            error("fork requires an idle vm");
+        mem.each([this](void *ptr) {
+            auto v = (cval *) ptr;
+            if (v->type == ast_chan)
+                share(v->val._chan);
+        });
+        return std::unique_ptr<cvm>(new cvm(this));
+    }
+
+    void cvm::clone(cvm &base) {
+        // 堆整体复制后按地址差修正指针，比重新初始化快得多
+        // 堆外的环境表与缓存表各复制一份；绳的引用计数与展平缓存不是线程安全的，也复制一份；数组与通道共享引用
+        ptrdiff_t delta = 0;
+        auto fix = [&](cval *&ptr) {
+            if (ptr && base.mem.contains(ptr))
+                ptr = (cval *) ((char *) ptr + delta);
+        };
+        std::vector<cval *> memo_vals;
+        mem.clone(base.mem, [&](void *ptr, ptrdiff_t d) {
+            delta = d;
+            auto v = (cval *) ptr;
+            fix(v->next);
+            switch (v->type) {
+                case ast_env: {
+                    fix(v->val._env.parent);
+                    auto env = new cval::cenv_t(*v->val._env.env);
+                    for (auto &e : *env) {
+                        fix(e.second);
+                    }
+                    v->val._env.env = env;
+                }
+                    break;
+                case ast_sub:
+                    if (v->val._sub.vm == &base)
+                        v->val._sub.vm = this;
+                    break;
+                case ast_lambda:
+                    fix(v->val._lambda.param);
+                    fix(v->val._lambda.body);
+                    fix(*lambda_env(v));
+                    fix(*lambda_code(v));
+                    break;
+                case ast_sexpr:
+                case ast_qexpr:
+                    fix(v->val._v.child);
+                    break;
+                case ast_literal:
+                case ast_string:
+                    if (v->flag & f_rope) {
+                        auto rope = v->val._rope;
+                        v->val._rope = crope::leaf(rope->data(), rope->size());
+                    } else if (base.mem.contains(v->val._string)) {
+                        v->val._string += delta;
+                    }
+                    break;
+                case ast_array:
+                    v->val._array->retain();
+                    break;
+                case ast_chan:
+                    v->val._chan->retain();
+                    break;
+                case ast_seq:
+                    fix(seq_data(v)->src);
+                    fix(seq_data(v)->fn);
+                    break;
+                case ast_memo:
+                    memo_vals.push_back(v); // 索引按值散列，等所有对象修正完再重建
+                    break;
+                default:
+                    break;
+            }
+        });
+        std::unordered_map<cmemo *, cmemo *> copied;
+        for (auto &v : memo_vals) {
+            auto &memo = copied[v->val._memo];
+            if (!memo) {
+                auto old = v->val._memo;
+                memo = new cmemo();
+                memo->ref = old->ref;
+                memo->fn = old->fn;
+                fix(memo->fn);
+                memo->capacity = old->capacity;
+                memo->hits = old->hits;
+                memo->misses = old->misses;
+                for (auto entry : old->lru) {
+                    fix(entry);
+                    memo->lru.push_back(entry);
+                    memo->index[entry->val._v.child] = std::prev(memo->lru.end());
+                }
+                memos.insert(memo);
+            }
+            v->val._memo = memo;
+        }
+        for (auto &t : base.threads) { // 已结束、未被join的线程不随之复制，其结果在副本的下次回收时释放
+            auto r = t->root;
+            fix(r);
+            mem.unprotect(r);
+        }
+        global_env = base.global_env;
+        fix(global_env);
+        consts = base.consts;
+        fix(consts);
+        for (auto &f : base.fold_cache) {
+            auto key = f.first, value = f.second.code;
+            fix(key);
+            fix(value);
+            fold_cache.insert(std::make_pair(key, fold_entry{value, f.second.deps}));
+        }
+        for (auto &i : base.interned) {
+            auto value = i.second;
+            fix(value);
+            interned.insert(std::make_pair(i.first, value));
+            interned_hash[value] = i.first;
+        }
+        host = base.host == &base.default_host ? &default_host : base.host;
+        depth_limit = base.depth_limit;
+    }
 }
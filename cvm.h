@@ -6,19 +6,44 @@
 #ifndef CLIBLISP_CVM_H
 #define CLIBLISP_CVM_H
 
-#define VM_MEM (32 * 1024)
+#ifndef VM_MEM
+#define VM_MEM (32 * 1024) // 堆的块数，是单个cvm的硬上限，软上限见set_heap_limit
+#endif
+#ifndef VM_EVAL
 #define VM_EVAL (32 * 1024)
+#endif
+#ifndef VM_TMP
 #define VM_TMP (32 * 1024)
+#endif
+#define MEMO_CAPACITY 4096
+#define VM_QUANTUM 100
+#define VM_CHUNK 256 // 分块的内建函数每步处理的元素数
+#define VM_COST_NODES 16 // 每步每分配这么多结点多计一个周期
+#define VM_SAFEPOINT 1024 // 每执行这么多步检查一次截止时刻与取消令牌
+#define VM_IDLE_POLL 50 // 等待通道时每次阻塞的毫秒数上限，共享的令牌上的唤醒可能被其他cvm先取走
 #define SHOW_ALLOCATE_NODE 0
 
 #include <vector>
+#include <list>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_set>
 #include "cast.h"
 #include "memory_gc.h"
+#include "cbignum.h"
+#include "carray.h"
+#include "crope.h"
+#include "cchan.h"
+#include "ctimer.h"
+#include "chost.h"
 
 namespace clib {
 
     class cvm;
     struct cframe;
+    struct cmemo;
 
     enum status_t {
         s_ret,
@@ -29,10 +54,33 @@ namespace clib {
 
     using ctmp = void *;
 
+    // 特殊形式，在conv时识别
+    enum special_t {
+        sp_none,
+        sp_if,
+        sp_lambda,
+        sp_def,
+        sp_begin,
+        sp_while,
+        sp_do,
+        sp_dotimes,
+        sp_let,
+        sp_let_star,
+        sp_yield,
+    };
+
+    enum cval_flag_t {
+        f_special = 0xf, // 特殊形式，见special_t
+        f_const = 0x10, // 共享的不可变代码，求值时不可修改
+        f_rope = 0x20, // 字符串以绳结构存放在_rope中，见string_data
+        f_slots = 0x40, // let的环境，绑定存放在槽数组中，见slot_data
+    };
+
     struct cval {
         using cenv_t = std::unordered_map<std::string, cval *>;
         using csub_t = status_t (*)(cvm *vm, cframe *frame);
         ast_t type;
+        uint flag;
         cval *next;
         union {
             struct {
@@ -43,6 +91,10 @@ namespace clib {
                 cval *parent;
                 cenv_t *env;
             } _env;
+            struct {
+                cval *parent; // 与_env.parent位置相同
+                uint count; // 已可见的绑定数，槽数组紧跟在cval之后
+            } _slots;
             struct {
                 void *vm;
                 csub_t sub;
@@ -51,7 +103,15 @@ namespace clib {
                 cval *param;
                 cval *body;
             } _lambda;
-            const char *_string;
+            struct {
+                uint size; // 2^32进制的位数，数据紧跟在cval之后
+                bool neg;
+            } _bigint;
+            carray *_array; // 数据在GC堆外，回收时释放引用
+            crope *_rope;
+            cmemo *_memo; // 缓存表在拷贝间共享
+            cchan *_chan; // 通道在GC堆外，回收时释放引用
+            const char *_string; // 长度存放在字符串之前，见string_size
 #define DEFINE_CVAL(t) LEX_T(t) _##t;
             DEFINE_CVAL(char)
             DEFINE_CVAL(uchar)
@@ -76,6 +136,109 @@ namespace clib {
         void *arg;
     };
 
+    // let绑定的槽，环境不在GC堆上，随帧释放
+    struct cslot {
+        const char *name;
+        cval *val;
+    };
+
+    enum lazy_t {
+        lz_list,
+        lz_array,
+        lz_range,
+        lz_map,
+        lz_filter,
+        lz_take,
+        lz_drop,
+        lz_zip,
+    };
+
+    // 惰性序列的一个阶段，紧跟在cval之后，不可变；遍历时各阶段连成拉取链
+    struct cseq {
+        lazy_t kind;
+        cval *src; // 上游序列，或源列表/数组
+        cval *fn; // map/filter的函数，zip的第二个序列
+        slong start, step;
+        slong count; // range的元素数或take/drop的个数，小于0表示无穷
+    };
+
+    // 每个cvm是独立的隔离体：堆、求值栈、常量表与宿主都是实例成员，不依赖全局状态
+    // 同一时刻只能由一个线程使用，可以在run的间隙交给其他线程
+    // cval及其引用的绳、缓存表都不能跨cvm共享，交换数据需经源码、打印结果或cpacket
+    // 绿色线程：独立的帧栈，与主线程在run的周期预算内按时间片轮转
+    // 运行期间分配的值挂在root下，线程被join回收前一直保留
+    struct cthread {
+        uint id;
+        std::vector<cframe *> stack;
+        std::vector<void *> roots; // 切出时保存的GC栈根
+        cval *root;
+        cval *ret;
+        bool done;
+        ulong timer; // 休眠等待的计时器，为0时可运行
+        uint joining; // 上次休眠在等待的线程，为0表示不在join上
+        std::vector<std::pair<cchan *, size_t>> chans; // 上次休眠在等待的通道及当时的收发次数，持有引用
+        bool detached; // 不再被join，结束后直接回收
+        string_t error;
+    };
+
+    // 跨cvm传递的值，不引用任何cvm的堆，可以在线程间移动
+    // 数组与通道按引用共享，其余数据复制；lambda连同捕获的绑定及引用的全局定义一起打包
+    struct cpacket {
+        struct node {
+            ast_t type;
+            uint flag;
+            uint count; // 子结点数，lambda为参数表、函数体与绑定数之和
+            decltype(cval::val) val; // 标量的值，数组与通道为持有的引用
+            string_t str; // 字符串、符号、子程序或绑定的名字，大整数的数据
+        };
+
+        cpacket() = default;
+        ~cpacket();
+
+        cpacket(const cpacket &) = delete;
+        cpacket &operator=(const cpacket &) = delete;
+
+        std::vector<node> nodes; // 先序排列
+        // 同一cvm内收发时不打包：值的副本从堆上摘下并保护起来，接收时原样挂回，见cvm::post
+        cval *local{nullptr};
+        cvm *owner{nullptr};
+    };
+
+    // 取消令牌，可由任意线程触发，cvm在安全点检查后放弃当前语句
+    // 触发后保持有效，复用前由调用方reset；在chost::idle中休眠的cvm随即被唤醒
+    class ccancel {
+    public:
+        void cancel() {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                flag.store(true, std::memory_order_relaxed);
+            }
+            wake.notify_all();
+        }
+        void reset() { flag.store(false, std::memory_order_relaxed); }
+        bool cancelled() const { return flag.load(std::memory_order_relaxed); }
+        // 只唤醒不取消，没有人在休眠时留给下一次sleep，见cchan::watch
+        void notify() {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                woken = true;
+            }
+            wake.notify_all();
+        }
+        // 阻塞至多ms毫秒，被取消或唤醒时提前返回
+        void sleep(ulong ms) {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait_for(guard, std::chrono::milliseconds(ms), [this] { return cancelled() || woken; });
+            woken = false;
+        }
+
+    private:
+        std::atomic<bool> flag{false};
+        bool woken{false};
+        std::mutex lock;
+        std::condition_variable wake;
+    };
+
     class cvm {
     public:
         cvm();
@@ -85,62 +248,222 @@ namespace clib {
         cvm &operator=(const cvm &) = delete;
 
         friend class builtins;
+        friend struct cpacket;
 
         void prepare(ast_node *node);
         cval *run(int cycle, int &cycles);
         void gc();
 
         static void print(cval *val, std::ostream &os);
+        static const char *string_data(cval *val); // 切片不以'\0'结尾，需配合string_size
+        static const char *string_cstr(cval *val);
+        static size_t string_size(cval *val);
+        static int string_compare(cval *a, cval *b);
+
+        static cseq *seq_data(cval *val);
+        static cslot *slot_data(cval *env);
+
+        static cbignum bigint(cval *val);
+        static bool equal(cval *a, cval *b);
+        static size_t hash(cval *val);
 
         void save();
         void restore();
 
-        void error(const string_t &info);
+        [[noreturn]] void error(const string_t &info);
 
         void dump();
         void reset();
 
+        void set_host(chost *h); // 为空时恢复默认宿主，宿主的生命周期由调用方保证
+        bool has_threads() const; // 存在未结束的绿色线程，宿主空闲时仍需调用run
+        bool wait(); // run返回空且所有上下文都在等计时器或通道时，经宿主阻塞到最早的到期时刻或通道有收发
+
+        // 到达截止时刻或令牌触发时，run在安全点抛出异常，由调用方restore回收
+        void set_deadline(ulong ms); // 当前语句从现在起最多运行ms毫秒，0为不限，语句结束或restore时清除
+        void set_cancel(ccancel *token); // 为空时不检查，令牌的生命周期由调用方保证
+
+        // 配额：堆超限时先就地回收一次，仍不够或帧栈超限时抛出带用量的异常，由调用方restore回收
+        void set_heap_limit(size_t bytes); // 0为只受VM_MEM限制
+        void set_depth_limit(uint depth); // 每个上下文的帧数上限，0为只受VM_EVAL限制
+        size_t heap_used() const;
+
+        void pack(cval *val, cpacket &p); // 不支持的类型报错
+        cval *unpack(const cpacket &p); // 在当前根下分配
+        void post(cchan *ch, cval *val, cpacket &p); // 发往通道的值，通道未离开本cvm时移交副本，否则打包
+        cval *take(cpacket &p); // 从通道取出的值，在当前根下
+
+        // 复制一个预热好的cvm，不再初始化内建函数与预载代码，之后两者互不影响；已结束的线程不随之复制
+        // 只能在run的间隙由当前使用它的线程调用，副本可以交给其他线程
+        std::unique_ptr<cvm> fork();
+        // 记下当前的全局定义；rebase丢弃此后的def与线程，回到记下时的状态，供隔离体池复用而不必再复制
+        void pin();
+        void rebase();
+
     private:
+        explicit cvm(cvm *base);
+        void clone(cvm &base);
+        void set_oom_callback();
+
         void builtin();
         void builtin_init();
         void builtin_load();
         cval *conv(ast_node *node, cval *env);
+        cval *conv_lambda(ast_node *node, cval *env, bool param);
+        static void mark_const(cval *val);
+        cval *intern(cval *parent, cval *head);
+        void forget(cval *val);
+        static void refs(cval *val, std::vector<void *> &out);
+        void trace(void *ptr, std::vector<void *> &out);
+        static special_t special_form(cval *head, uint size);
+
+        struct fold_ctx {
+            cval *env;
+            std::unordered_set<string_t> shadow;
+            int folds;
+            std::vector<std::pair<string_t, csub>> deps; // 折叠时用到的内建函数
+        };
+        struct fold_entry {
+            cval *code;
+            std::vector<std::pair<string_t, csub>> deps; // 命中时须在当前环境下仍指向同一内建
+        };
+        cval *fold(cval *val, fold_ctx &ctx);
+        bool fold_args(cval *val, fold_ctx &ctx);
+        void fold_children(cval *val, fold_ctx &ctx);
+        void fold_code(cval *val, fold_ctx &ctx);
+        cval *fold_call(cval *val, fold_ctx &ctx);
+        fold_ctx fold_lambda(cval *param, cval *code, cval *env);
+        cval *fold_const(cval *param, cval *body, cval *env);
+        static void fold_defs(cval *val, std::unordered_set<string_t> &shadow);
 
         status_t call(csub fun, cval *val, cval *env, cval **ret);
+        status_t run_slice(int &budget, int &cycles);
+        status_t run_thread(cthread *t, int &budget, int &cycles);
+        cthread *find_thread(uint id);
+        void finish_thread(cthread *t);
+        void report_thread(cthread *t);
+        void reap_thread(cthread *t);
+        void kill_threads();
+        void poll_timers();
+        void park_context(cthread *t);
+        bool check_halt();
+        bool blocked(uint joining, const std::vector<std::pair<cchan *, size_t>> &chans);
+        void wait_chan(cchan *ch, size_t seen);
+        static void release_chans(std::vector<std::pair<cchan *, size_t>> &chans);
+        void share(cchan *ch);
+        void collect();
+        [[noreturn]] void quota_error(const char *what, size_t need = 0); // need为引发超限的申请字节数
+
+        template<class T>
+        T *tmp_alloc(uint count = 1) {
+            auto p = eval_tmp.alloc_array<T>(count);
+            if (!p)
+                quota_error("temp", sizeof(T) * count);
+            return p;
+        }
 
-        int calc(int op, ast_t type, cval *r, cval *v, cval *env);
         cval *calc_op(int op, cval *val, cval *env);
         cval *calc_symbol(const char *sym, cval *env);
+        cval *lookup(const char *sym, cval *env);
         cval *def(cval *env, const char *sym, cval *val);
         cval *calc_sub(const char *sub, cval *val, cval *env);
+        cval *calc_big(int op, cval *r, cval *v);
+        cval *calc_array(int op, cval *val);
 
         static status_t eval(cvm *vm, cframe *frame);
         static status_t eval_one(cvm *vm, cframe *frame);
         static status_t eval_child(cvm *vm, cframe *frame);
+        static status_t eval_code(cvm *vm, cframe *frame);
 
         cval *val_obj(ast_t type);
         cval *val_str(ast_t type, const char *str);
+        cval *val_str(ast_t type, const char *str, size_t len);
+        cval *val_rope(crope *rope);
+        cval *val_slice(cval *str, size_t start, size_t len);
         cval *val_char(char c);
         cval *val_sub(const char *name, csub sub);
         cval *val_sub(cval *val);
         cval *val_bool(bool flag);
-        cval *val_lambda(cval *param, cval *body, cval *env);
+        cval *val_lambda(cval *param, cval *body, cval *env, cval *code = nullptr);
+        cval *val_bigint(const cbignum &n);
+        cval *val_integer(const cbignum &n);
+        cval *val_array(carray *arr);
+        cval *val_seq(lazy_t kind, cval *src, cval *fn, slong start = 0, slong step = 0, slong count = 0);
+        cval *val_memo(cmemo *memo);
+        cval *val_chan(cchan *ch);
+        cmemo *memo_create(cval *fn, size_t capacity);
+        void memo_release(cmemo *memo);
+        bool memo_trim(bool all);
 
-        cval *copy(cval *val);
+        cval *copy(cval *val, bool share = true);
         cval *new_env(cval *env);
+        cval *slot_env(cval *env, uint size);
 
         static uint children_size(cval *val);
 
         void set_free_callback();
 
+        void pack_node(cval *val, cpacket &p, std::unordered_set<cval *> &visiting);
+        void pack_lambda(cval *val, cpacket &p, std::unordered_set<cval *> &visiting);
+        cval *unpack_node(const cpacket &p, size_t &i);
+
     private:
         cval *global_env{nullptr};
+        cval *consts{nullptr}; // 常量代码的弱根
+        std::unordered_map<cval *, fold_entry> fold_cache;
+        std::unique_ptr<cval::cenv_t> pinned; // pin时的全局定义，被def覆盖的旧值保护起来留给rebase
+        std::unordered_multimap<size_t, cval *> interned;
+        std::unordered_map<cval *, size_t> interned_hash; // 驻留表头到散列，回收时据此移出
+        std::unordered_set<cmemo *> memos; // 存活的memo表，内存紧张时丢弃其缓存
         memory_pool_gc<VM_MEM> mem;
         std::vector<cframe *> eval_stack;
+        std::unordered_map<cframe *, std::shared_ptr<void>> frame_owned; // 帧持有的堆外状态，返回或出错丢弃帧时释放
         memory_pool<VM_EVAL> eval_mem;
         memory_pool<VM_TMP> eval_tmp;
         cval *root{nullptr};
         cval *ret{nullptr};
+        chost default_host;
+        chost *host{&default_host};
+        std::vector<std::unique_ptr<cthread>> threads; // 不含主线程
+        cthread *current{nullptr}; // 为空表示主线程
+        uint thread_id{0};
+        bool yielded{false};
+        ctimer_wheel timers;
+        std::unordered_map<ulong, cthread *> sleepers; // 计时器编号到休眠者，主线程为空
+        ulong main_timer{0};
+        uint main_joining{0};
+        ulong timer_id{0};
+        ulong park{0}; // 本次休眠要等待的计时器，由sleep设置
+        uint join_wait{0}; // 本次休眠要等待的线程，由join设置
+        std::vector<std::pair<cchan *, size_t>> main_chans;
+        std::vector<std::pair<cchan *, size_t>> chan_wait; // 本次休眠要等待的通道，由send、recv与select设置
+        ccancel wake; // 没有取消令牌时，wait在其上阻塞，等待的通道有收发时被唤醒
+        ulong deadline{0};
+        ccancel *cancel{nullptr};
+        const char *halt{nullptr}; // 安全点发现的放弃原因
+        int safepoint{VM_SAFEPOINT};
+        uint depth_limit{0};
+    };
+
+    // 按结构相等作为容器的键，用于映射、集合与记忆化
+    struct cval_hash {
+        size_t operator()(cval *val) const { return cvm::hash(val); }
+    };
+
+    struct cval_equal {
+        bool operator()(cval *a, cval *b) const { return cvm::equal(a, b); }
+    };
+
+    // memo的缓存表，按引用计数释放
+    // 条目`(args value)作为GC根保留，被淘汰或表释放时解除；内存紧张时由回收整批丢弃，见memo_trim
+    struct cmemo {
+        using lru_t = std::list<cval *>;
+        uint ref;
+        cval *fn;
+        size_t capacity;
+        size_t hits, misses;
+        lru_t lru; // 最近使用的在前
+        std::unordered_map<cval *, lru_t::iterator, cval_hash, cval_equal> index; // 键为条目的参数表
     };
 }
 
@@ -179,7 +179,7 @@ namespace clib {
                 return nullptr;
             auto blk = block_current;
             do {
-                if (block_get_flag(blk, BLOCK_USING) == 0 && blk->size >= size + 1) {
+                if (block_get_flag(blk, BLOCK_USING) == 0 && blk->size >= size) { // 大小正好相同的空闲块也可复用
                     block_current = blk;
                     return alloc_free_block(size);
                 }
@@ -190,14 +190,12 @@ namespace clib {
 
         // 查找空闲块
         void *alloc_free_block(size_t size) {
-            if (block_current->size == size + 1) // 申请的大小正好是空闲块大小
+            if (block_current->size <= size + 1) // 申请的大小正好是空闲块大小，或分裂后只剩一个元信息头
             {
-                return alloc_cur_block(size + 1);
+                return alloc_cur_block(block_current->size);
             }
             // 申请的空间小于空闲块大小，将空闲块分裂
             auto new_size = block_current->size - size - 1;
-            if (new_size == 0)
-                return alloc_cur_block(size); // 分裂后的新块空间过低，放弃分裂
             block *new_blk = block_current + size + 1;
             block_init(new_blk, new_size);
             block_connect(block_current, new_blk);
@@ -344,6 +342,27 @@ namespace clib {
             return block_available_size;
         }
 
+        bool contains(const void *ptr) const {
+            return ptr >= block_head && ptr < block_head + DEFAULT_ALLOC_BLOCK_SIZE;
+        }
+
+        // 复制同样大小的池，只复制块头与在用块的数据，返回新旧地址之差
+        // 块链表随之修正，块内数据中的指针由使用方修正
+        ptrdiff_t clone(const legacy_memory_pool &other) {
+            auto delta = (char *) block_head - (char *) other.block_head;
+            auto blk = other.block_head;
+            do {
+                auto new_blk = block_head + (blk - other.block_head);
+                memcpy(new_blk, blk, block_get_flag(blk, BLOCK_USING) ? (blk->size + 1) * BLOCK_SIZE : BLOCK_SIZE);
+                new_blk->prev = (block *) ((char *) blk->prev + delta);
+                new_blk->next = (block *) ((char *) blk->next + delta);
+                blk = blk->next;
+            } while (blk != other.block_head);
+            block_current = (block *) ((char *) other.block_current + delta);
+            block_available_size = other.block_available_size;
+            return delta;
+        }
+
         void clear() {
             _init();
         }
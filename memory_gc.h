@@ -68,7 +68,13 @@ namespace clib {
         }
 
         void *alloc(size_t size) {
-            auto new_node = static_cast<gc_header *>((void *) memory.template alloc_array<char>(GC_HEADER_SIZE + size));
+            auto new_node = alloc_node(size);
+            if (!new_node && oom_callback) {
+                oom_callback(size, false); // 使用方可先回收，随后重试一次
+                new_node = alloc_node(size);
+                if (!new_node)
+                    oom_callback(size, true); // 仍然不够，使用方应抛出异常
+            }
             assert(new_node);
             memset(new_node, 0, GC_HEADER_SIZE + size);
             auto &top = stack_roots.back();
@@ -99,6 +105,12 @@ namespace clib {
             _link(_parent, _ptr);
         }
 
+        void link(void *ptr) {
+            auto _parent = stack_roots.back();
+            auto _ptr = header(ptr);
+            _link(_parent, _ptr);
+        }
+
         void unlink(void *parent, void *ptr) {
             auto _parent = header(parent);
             auto _ptr = header(ptr);
@@ -111,12 +123,31 @@ namespace clib {
             _unlink(_parent, _ptr);
         }
 
+        // 把from的子对象整体移到to下，不必逐个摘除
+        void adopt(void *to, void *from) {
+            auto _to = header(to);
+            auto _from = header(from);
+            auto i = _from->child;
+            if (!i)
+                return;
+            _from->child = nullptr;
+            if (_to->child) {
+                auto last = i->prev;
+                i->prev = _to->child->prev;
+                i->prev->next = i;
+                last->next = _to->child;
+                _to->child->prev = last;
+            } else {
+                _to->child = i;
+            }
+        }
+
         void protect(void *ptr) {
             roots.insert(header(ptr));
         }
 
         void unprotect(void *ptr) {
-            roots.erase(ptr);
+            roots.erase(header(ptr));
         }
 
         void gc() {
@@ -124,10 +155,129 @@ namespace clib {
             sweep();
         }
 
+        // 带弱根的回收：弱根的子对象不因弱根而存活，只有被其它存活对象经refs引用时才保留
+        // refs给出对象数据中引用的其它对象（数据指针），被引用对象所在的子树随之存活
+        // 弱根下死去的子对象里仍存活的后代直接挂到弱根下，释放其余部分
+        void gc(void *weak, const std::function<void(void *, std::vector<void *> &)> &refs) {
+            auto w = header(weak);
+            stack_roots.front()->child = nullptr;
+            set_marked(w, true);
+            for (auto &root : roots) {
+                if (root != w) {
+                    set_marked(root, true);
+                    mark_children(root);
+                }
+            }
+            for (auto it = stack_roots.begin() + 1; it != stack_roots.end(); it++) {
+                set_marked(*it, true);
+                mark_children(*it);
+            }
+            mark_refs(refs, w);
+            std::vector<gc_header *> alive;
+            if (w->child) {
+                auto i = w->child;
+                do {
+                    rescue(i, alive);
+                    i = i->next;
+                } while (i != w->child);
+            }
+            w->child = nullptr;
+            for (auto &obj : alive) {
+                _link(w, obj);
+            }
+            sweep();
+        }
+
+        // 语句执行中回收：栈底下的临时对象、各栈根以及额外给出的对象都视为存活
+        // extra为数据指针，stashed为stash_stack保存的根
+        void gc_running(const std::vector<void *> &extra, const std::vector<void *> &stashed,
+                        const std::function<void(void *, std::vector<void *> &)> &refs) {
+            for (auto &root : roots) {
+                set_marked(root, true);
+                mark_children(root);
+            }
+            mark_children(stack_roots.front());
+            for (auto it = stack_roots.begin() + 1; it != stack_roots.end(); it++) {
+                set_marked(*it, true);
+                mark_children(*it);
+            }
+            for (auto &ptr : extra) {
+                if (ptr && !is_marked(header(ptr))) {
+                    set_marked(header(ptr), true);
+                    mark_children(header(ptr));
+                }
+            }
+            for (auto &root : stashed) {
+                if (!is_marked(root)) {
+                    set_marked(root, true);
+                    mark_children(static_cast<gc_header *>(root));
+                }
+            }
+            // 被摘下的对象（如闭包捕获的调用环境）只经数据指针引用，同样要沿refs标记
+            mark_refs(refs, nullptr);
+            sweep();
+        }
+
         size_t count() const {
             return objects.size();
         }
 
+        // 已用与总共的字节数，按块计
+        // 空闲块的块头不计入已用；最后一个空闲块被整块分配后块头也归已用，所以总量是全部块
+        size_t used() const {
+            return (memory_pool_t::DEFAULT_ALLOC_BLOCK_SIZE - 1 - memory.available()) * GC_BLOCK_SIZE;
+        }
+
+        size_t capacity() const {
+            return memory_pool_t::DEFAULT_ALLOC_BLOCK_SIZE * GC_BLOCK_SIZE;
+        }
+
+        bool contains(const void *ptr) const {
+            return memory.contains(ptr);
+        }
+
+        // 复制另一个栈上没有根的堆，返回新旧地址之差
+        // 所有权树随之修正，对象数据中的指针由relocate逐个修正
+        ptrdiff_t clone(const legacy_memory_gc &other, const std::function<void(void *, ptrdiff_t)> &relocate) {
+            assert(other.stack_roots.size() == 1);
+            auto delta = memory.clone(other.memory);
+            auto fix = [delta](gc_header *ptr) {
+                return ptr ? (gc_header *) ((char *) ptr + delta) : nullptr;
+            };
+            objects.clear();
+            objects.reserve(other.objects.size());
+            for (auto &obj : other.objects) {
+                auto h = fix(obj);
+                h->child = fix(h->child);
+                h->next = fix(h->next);
+                h->prev = fix(h->prev);
+                objects.push_back(h);
+            }
+            stack_head.child = fix(other.stack_head.child);
+            roots.clear();
+            for (auto &root : other.roots) {
+                roots.insert(fix(root));
+            }
+            saved_stack = other.saved_stack;
+            limit = other.limit;
+            for (auto &obj : objects) {
+                relocate(data(obj), delta);
+            }
+            return delta;
+        }
+
+        size_t get_limit() const {
+            return limit;
+        }
+
+        void set_limit(size_t bytes) {
+            limit = bytes;
+        }
+
+        void set_oom_callback(std::function<void(size_t, bool)> callback) {
+            oom_callback = callback;
+        }
+
         void set_callback(std::function<void(void *)> callback) {
             gc_callback = callback;
         }
@@ -144,6 +294,29 @@ namespace clib {
             stack_roots.erase(stack_roots.begin() + saved_stack, stack_roots.end());
         }
 
+        size_t stack_depth() const {
+            return stack_roots.size();
+        }
+
+        // 切换绿色线程时移出/放回其压入的根，根的压入与弹出可能跨越多个时间片
+        void stash_stack(size_t depth, std::vector<void *> &saved) {
+            saved.assign(stack_roots.begin() + depth, stack_roots.end());
+            stack_roots.erase(stack_roots.begin() + depth, stack_roots.end());
+        }
+
+        void unstash_stack(const std::vector<void *> &saved) {
+            for (auto &root : saved) {
+                stack_roots.push_back(static_cast<gc_header *>(root));
+            }
+        }
+
+        // 逐个访问堆上的对象，访问期间不能分配或回收
+        void each(const std::function<void(void *)> &visit) const {
+            for (auto &obj : objects) {
+                visit(data(obj));
+            }
+        }
+
         void dump(std::ostream &os) {
             memory.dump(os);
             dump_tree();
@@ -162,6 +335,14 @@ namespace clib {
         }
 
     private:
+        gc_header *alloc_node(size_t size) {
+            // 按实际占用的块数（对齐后加上块头）检查，分配成功后的用量不会超出上限
+            auto blocks = (GC_HEADER_SIZE + size + GC_BLOCK_SIZE - 1) / GC_BLOCK_SIZE + 1;
+            if (limit && used() + blocks * GC_BLOCK_SIZE > limit)
+                return nullptr;
+            return static_cast<gc_header *>((void *) memory.template alloc_array<char>(GC_HEADER_SIZE + size));
+        }
+
         void mark_children(gc_header *ptr) {
             if (ptr->child) {
                 auto i = ptr->child;
@@ -176,6 +357,58 @@ namespace clib {
             }
         }
 
+        // 从已标记的对象出发，沿refs给出的数据指针标记被引用对象的子树
+        // 空指针与堆外的指针（如let的槽环境）跳过
+        void mark_refs(const std::function<void(void *, std::vector<void *> &)> &refs, gc_header *skip) {
+            std::vector<gc_header *> work;
+            for (auto &obj : objects) {
+                if (obj != skip && is_marked(obj))
+                    work.push_back(obj);
+            }
+            std::vector<void *> out;
+            while (!work.empty()) {
+                auto obj = work.back();
+                work.pop_back();
+                out.clear();
+                refs(data(obj), out);
+                for (auto &ptr : out) {
+                    if (!ptr || !memory.contains(ptr))
+                        continue;
+                    auto h = header(ptr);
+                    if (!is_marked(h))
+                        mark_trace(h, work);
+                }
+            }
+        }
+
+        void mark_trace(gc_header *ptr, std::vector<gc_header *> &work) {
+            set_marked(ptr, true);
+            work.push_back(ptr);
+            if (ptr->child) {
+                auto i = ptr->child;
+                do {
+                    if (!is_marked(i))
+                        mark_trace(i, work);
+                    i = i->next;
+                } while (i != ptr->child);
+            }
+        }
+
+        // 存活的对象连同子树整体保留，否则到其子对象中寻找存活者
+        void rescue(gc_header *ptr, std::vector<gc_header *> &alive) {
+            if (is_marked(ptr)) {
+                alive.push_back(ptr);
+                return;
+            }
+            if (ptr->child) {
+                auto i = ptr->child;
+                do {
+                    rescue(i, alive);
+                    i = i->next;
+                } while (i != ptr->child);
+            }
+        }
+
         void _link(gc_header *parent, gc_header *ptr) {
             if (parent->child) {
                 ptr->prev = parent->child->prev;
@@ -189,35 +422,16 @@ namespace clib {
         }
 
         void _unlink(gc_header *parent, gc_header *ptr) {
-            if (parent->child) {
-                auto i = parent->child;
-                if (i->next == i) {
+            // 兄弟对象组成双向环，直接摘除，不必从头查找
+            if (ptr->next == ptr) {
+                if (parent->child == ptr)
                     parent->child = nullptr;
-                    return;
-                }
-                if (i == ptr) {
-                    parent->child = i->next;
-                    i->prev->next = parent->child;
-                    i->next->prev = i->prev;
-                    return;
-                } else {
-                    i = i->next;
-                }
-                while (i != parent->child) {
-                    if (i->next == ptr) {
-                        if (i->next->next == parent->child) {
-                            i->next = parent->child;
-                            parent->child->prev = i;
-                        } else {
-                            i->next->next->prev = i;
-                            i->next = i->next->next;
-                        }
-                        break;
-                    } else {
-                        i = i->next;
-                    }
-                }
+                return;
             }
+            if (parent->child == ptr)
+                parent->child = ptr->next;
+            ptr->prev->next = ptr->next;
+            ptr->next->prev = ptr->prev;
         }
 
         void mark() {
@@ -234,20 +448,22 @@ namespace clib {
         }
 
         void sweep() {
-            for (auto it = objects.begin(); it != objects.end();) {
-                auto &obj = *it;
+            // 存活对象原地前移，避免逐个erase
+            auto live = objects.begin();
+            for (auto it = objects.begin(); it != objects.end(); it++) {
+                auto obj = *it;
                 if (is_marked(obj)) {
                     set_marked(obj, false);
-                    it++;
+                    *live++ = obj;
                 } else {
 #if SHOW_GC
                     if (gc_callback)
                         gc_callback((void *) data((void *) obj));
 #endif
                     memory.free(obj);
-                    it = objects.erase(it);
                 }
             }
+            objects.erase(live, objects.end());
         }
 
         void dump_children(gc_header *ptr, int level) {
@@ -280,6 +496,8 @@ namespace clib {
         gc_header stack_head{nullptr, nullptr, nullptr};
         std::function<void(void *)> gc_callback{[](void *) {}};
         std::function<void(void *, int)> dump_callback{[](void *, int) {}};
+        std::function<void(size_t, bool)> oom_callback;
+        size_t limit{0}; // 堆的字节上限，0为不限
         std::vector<gc_header *> objects;
         std::vector<gc_header *> stack_roots;
         std::unordered_set<gc_header *> roots;
@@ -6,13 +6,28 @@
 #include <iostream>
 #include <sstream>
 #include <tuple>
+#include <thread>
+#include <chrono>
+#include <functional>
 #include "cparser.h"
 #include "cvm.h"
+#include "cpool.h"
+#include "cexception.h"
 
 #define TEST(a,b) std::make_tuple(a, b)
 
+class pool_host : public clib::chost {
+public:
+    clib::cvm_pool *pool() override { return &workers; }
+
+private:
+    clib::cvm_pool workers{4, 50};
+};
+
 int main(int argc, char *argv[]) {
+    pool_host host;
     clib::cvm vm;
+    vm.set_host(&host);
     auto codes = std::vector<std::tuple<std::string, std::string>>{
             TEST("+ 1 2", "3"),
             TEST("* 1 2 3 4 5 6", "720"),
@@ -83,6 +98,10 @@ int main(int argc, char *argv[]) {
             TEST(R"(def `Y_fib (\ `f `(\ `n `(if (<= n 2) `1 `(+ (f (- n 1)) (f (- n 2)))))))",
                  R"(<lambda `f `(\ `n `(if (<= n 2) `1 `(+ (f (- n 1)) (f (- n 2)))))>)"),
             TEST(R"((Y Y_fib) 5)", "5"),
+            TEST(R"(map (\ `(x) `(* x x)) (range 0 5))", "`(0 1 4 9 16)"),
+            TEST(R"(list (range 10 0 -3) (iota 3 1))", "`(`(10 7 4 1) `(1 2 3))"),
+            TEST(R"(seq->list (seq-take 5 (filter (\ `(x) `(> x 10)) (map (\ `(x) `(* x x)) (seq-range 0)))))",
+                 "`(16 25 36 49 64)"),
             TEST(R"((def `range (\ `(a b) `(if (== a b) `nil `(cons a (range (+ a 1) b))))))",
                 "<lambda `(a b) `(if (== a b) `nil `(cons a (range (+ a 1) b)))>"),
             TEST(R"(range 1 10)", "`(1 2 3 4 5 6 7 8 9)"),
@@ -90,12 +109,148 @@ int main(int argc, char *argv[]) {
             TEST(R"(def `map (\ `(f L) `(if (null? L) `nil `(cons (f (car L)) (map f (cdr L))))))",
                     "<lambda `(f L) `(if (null? L) `nil `(cons (f (car L)) (map f (cdr L))))>"),
             TEST(R"(map + (range 1 10))", "`(2 3 4 5 6 7 8 9 10)"),
+            // constant folding
+            TEST(R"(def `k (\ `(x) `(+ x (* 2 100))))", "<lambda `x `(+ x (* 2 100))>"),
+            TEST(R"(k 1)", "201"),
+            TEST(R"(((\ `(+) `(+ 2 3)) -))", "-1"),
+            TEST(R"(if (> 2 1) `(* 2 100) `0)", "200"),
+            TEST(R"(+ (len `(1 2 3)) (car `(4 5)))", "7"),
+            TEST(R"(begin (def `k3 (\ `x `(list (+ 1 2)))) (k3 0))", "`3"),
+            TEST(R"(begin (def `plus +) (def `+ -) ((\ `x `(list (+ 1 2))) 0))", "`-1"),
+            TEST(R"(begin (def `+ plus) (let ((+ *)) ((\ `x `(list (+ 1 2))) 0)))", "`2"),
+            TEST(R"(((\ `x `(list (+ 1 2))) 0))", "`3"),
+            TEST(R"(begin (def `k4 (\ x (+ x (* 2 100)))) (def `times *) (def `* +) (def `r (k4 1)) (def `* times) r)", "201"),
+            // special forms
+            TEST(R"(if (> 2 1) (+ 1 1) undefined-symbol)", "2"),
+            TEST(R"(((\ (x) (* x x)) 4))", "16"),
+            TEST(R"(def sq (\ x (* x x)))", "<lambda `x (* x x)>"),
+            TEST(R"(sq 7)", "49"),
+            TEST(R"(begin (def `(p q) 5 6) (+ p q))", "11"),
+            TEST(R"(def countdown (\ (n) (if (== n 0) n (countdown (- n 1)))))", "<lambda `n (if (== n 0) n (countdown (- n 1)))>"),
+            TEST(R"(countdown 200)", "0"),
+            // shared constants
+            TEST(R"(def `base (\ `x `(append `(1 2 3) x)))", "<lambda `x `(append `(1 2 3) x)>"),
+            TEST(R"(base `(4))", "`(1 2 3 4)"),
+            TEST(R"(base `(5))", "`(1 2 3 5)"),
+            TEST(R"(((\ x (cdr `(1 2 3))) 0))", "`(2 3)"),
+            // big integers
+            TEST(R"(* 2147483647 2)", "4294967294"),
+            TEST(R"(type (* 9223372036854775807 2))", "\"bigint\""),
+            TEST(R"(/ (* 9223372036854775807 4) 2)", "18446744073709551614"),
+            TEST(R"(< (fact 30) (fact 31))", "1"),
+            TEST(R"(* (fact 100) (fact 100))", "8709782489089480079416590161944485865569720643940840134215932536243379996346583325877967096332754920644690380762219607476364289411435920190573960677507881394607489905331729758013432992987184764607375889434313483382966801515156280854162691766195737493173453603519594496000000000000000000000000000000000000000000000000"),
+            // numeric tower
+            TEST(R"(+ 1 2.5)", "3.5"),
+            TEST(R"(type (* 2 1.5))", "\"double\""),
+            TEST(R"(< 1 2.5)", "1"),
+            TEST(R"(type (+ (fact 30) 0.5))", "\"double\""),
+            // packed arrays
+            TEST(R"(+ (f64 1 2 3) 0.5)", "#f64(1.5 2.5 3.5)"),
+            TEST(R"(* (i64 1 2 3 4 5) (i64 5 4 3 2 1))", "#i64(5 8 9 8 5)"),
+            TEST(R"(< (i64 1 5 3) 3)", "#i64(1 0 0)"),
+            TEST(R"(vec-sum (vec-iota 100001))", "5000050000"),
+            TEST(R"(vec-dot (f64 (vec-iota 10)) (vec-iota 10))", "285"),
+            TEST(R"(list (vec-min (- 0 (vec-iota 37))) (vec-max (f64 3 9 1 4 7)))", "`(-36 9)"),
+            // strings
+            TEST(R"(def `build (\ `(n s) `(if (== n 0) `s `(build (- n 1) (+ s "abcdefgh")))))",
+                 R"(<lambda `(n s) `(if (== n 0) `s `(build (- n 1) (+ s "abcdefgh")))>)"),
+            TEST(R"(+ (build 10 "") "!")", R"("abcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefgh!")"),
+            TEST(R"(== (build 100 "") (build 100 ""))", "1"),
+            TEST(R"(len (word (build 50 "")))", "400"),
+            TEST(R"(def `csv "id,name,,score")", R"("id,name,,score")"),
+            TEST(R"(string-split csv (str ","))", R"(`("id" "name" "" "score"))"),
+            TEST(R"(list (string-find csv (str "name")) (substring csv 3 7) (len csv))", R"(`(3 "name" 14))"),
+            TEST(R"(string-upcase (string-replace csv (str ",,") (string-join (list csv csv) (str ":"))))",
+                 R"("ID,NAMEID,NAME,,SCORE:ID,NAME,,SCORESCORE")"),
+            TEST(R"(+ (string->number (str 40)) (string->number (str 2.5)))", "42.5"),
+            // structural equality
+            TEST(R"(equal? `(1 `(2 3) "x") (list 1 (list 2 3) (str "x")))", "1"),
+            TEST(R"(list (equal? `(1 `(2 3)) `(1 `(2 4))) (equal? 1 1.0) (equal? 2147483648 (+ 2147483647 1)))", "`(0 0 1)"),
+            TEST(R"(== (hash `(1 `(2 3))) (hash (list 1 (list 2 3))))", "1"),
+            TEST(R"(list (== `(1 2) `(1 2)) (!= `(1 2) `(1 3)))", "`(1 1)"),
+            // sequences
+            TEST(R"(filter (\ `(x) `(> x 3)) (iota 8))", "`(4 5 6 7)"),
+            TEST(R"(list (foldl - 100 (iota 5 1)) (foldr - 0 (iota 4 1)))", "`(85 -2)"),
+            TEST(R"(foldr cons `() (reverse (list 1 "a" 2.5)))", R"(`(2.5 "a" 1))"),
+            TEST(R"(len (filter (\ `(x) `(== x (* 2 (/ x 2)))) (iota 200)))", "100"),
+            TEST(R"(list (sort (list 5 3 9 1 3)) (sort (i64 3 1 2) >) (sort (list 3 1 2) (\ `(a b) `(> a b))))",
+                 "`(`(1 3 3 5 9) #i64(3 2 1) `(3 2 1))"),
+            TEST(R"(sort-by car (list (list 2 "b") (list 1 "x") (list 2 "a") (list 1 "y")))",
+                 R"(`(`(1 "x") `(1 "y") `(2 "b") `(2 "a")))"),
+            // lazy sequences
+            TEST(R"(seq->list (seq-zip (list 1 2 3) (seq-drop 2 (seq-range 0))))", "`(`(1 2) `(2 3) `(3 4))"),
+            TEST(R"(list (foldl + 0 (seq-take 100 (seq-range 0))) (type (filter (\ `(x) `x) (seq (i64 1 0)))))",
+                 R"(`(4950 "seq"))"),
+            // memoization
+            TEST(R"(def `fib (memo (\ `n `(if (< n 2) `n `(+ (fib (- n 1)) (fib (- n 2)))))))",
+                 R"(<memo <lambda `n `(if (< n 2) `n `(+ (fib (- n 1)) (fib (- n 2))))>>)"),
+            TEST(R"(list (fib 80) (memo-stats fib))", "`(23416728348467685 `(78 81 81 4096))"),
+            TEST(R"(begin (def `pair (memo list 2)) (pair 1 `(2 3)) (pair 2 2) (pair 3 3) (pair 1 `(2 3)) (memo-stats pair))",
+                 "`(0 4 2 2)"),
+            // loops
+            TEST(R"(begin (def `(s k) 0 0) (while (< k 5) (def `s (+ s k)) (def `k (+ k 1))) s)", "10"),
+            TEST(R"(begin (def `k 5) (do (def `k (+ k 1)) (< k 3)) k)", "6"),
+            TEST(R"(begin (def `pow2 (\ `n `(begin (def `t 1) (dotimes (i n) (def `t (* t 2))) t))) (pow2 10))", "1024"),
+            TEST(R"(begin (def `x 10) (let ((x 1) (y x)) (list x y)))", "`(1 10)"),
+            TEST(R"(let* ((x 1) (y (+ x 1))) (def `x 5) (list x y))", "`(5 2)"),
+            TEST(R"(begin (def `adder (let ((n 5)) (\ `x `(+ x n)))) (adder 2))", "7"),
+            // parallel
+            TEST(R"(pmap (\ `x `(* x x)) `(1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20))",
+                 "`(1 4 9 16 25 36 49 64 81 100 121 144 169 196 225 256 289 324 361 400)"),
+            TEST(R"(begin (def `pfib (\ `n `(if (< n 2) `n `(+ (pfib (- n 1)) (pfib (- n 2)))))) (let ((b 100)) (pmap (\ `x `(+ (pfib x) b)) `(5 8 10))))",
+                 "`(105 121 155)"),
+            TEST(R"(pfor-each (\ `x `(+ x 1)) `(1 2 3))", "nil"),
+            // threads
+            TEST(R"(join (spawn (\ `(a b) `(+ a b)) 1 2))", "3"),
+            TEST(R"(begin (def `log nil) (def `w (\ `(tag n) `(dotimes (i n) (def `log (cons tag log)) (yield i)))) (def `(t1 t2) (spawn w 1 3) (spawn w 2 3)) (join t1) (join t2) log)",
+                 "`(2 1 2 1 2 1)"),
+            TEST(R"(yield 5)", "5"),
+            TEST(R"(begin (def `log nil) (def `w (\ `(tag n) `(dotimes (i n) (def `log (cons tag log)) (yield)))) (def `(t1 t2) (spawn w 1 2) (spawn w 2 2)) (join t1) (join t2) log)",
+                 "`(2 1 2 1)"),
+            TEST(R"((yield))", "nil"),
+            // channels
+            TEST(R"(begin (def `c (chan 2)) (def `p (spawn (\ `n `(dotimes (i n) (send c i))) 5)) (def `s 0) (dotimes (i 5) (def `s (+ s (recv c)))) (join p) s)",
+                 "10"),
+            TEST(R"(begin (def `a (chan 1)) (def `b (chan 1)) (send b 7) (select a b))", "`(1 7)"),
+            TEST(R"(begin (def `c (chan 4)) (pfor-each (\ `x `(send c (* x x))) `(1 2 3)) (+ (recv c) (recv c) (recv c)))", "14"),
+            // 本cvm内的通道直接移交值，不能打包的惰性序列也可以收发；通道离开本cvm时队列中的值就地打包
+            TEST(R"(begin (def `c (chan 1)) (send c (seq-take 3 (seq-range 0))) (seq->list (recv c)))", "`(0 1 2)"),
+            TEST(R"(begin (def `c (chan 3)) (send c (list 1 2)) (pfor-each (\ `x `(send c x)) `(3)) (list (recv c) (recv c)))",
+                 "`(`(1 2) 3)"),
+            // timers
+            TEST(R"(sleep 0.01)", "nil"),
+            TEST(R"(begin (def `log nil) (def `w (\ `(tag t) `(begin (sleep t) (def `log (cons tag log))))) (def `(a b c) (spawn w 1 0.06) (spawn w 2 0.02) (spawn w 3 0.04)) (join a) (join b) (join c) log)",
+                 "`(1 3 2)"),
+            // chunked builtins
+            TEST(R"(len (append (iota 300) `(a) (iota 100) 7))", "402"),
+            TEST(R"(index (word (str (iota 200))) 690)", "'9'"),
+            TEST(R"(begin (def `log nil) (def `s (str (iota 500))) (def `w (\ `(tag s) `(begin (def `log (cons tag log)) (len (word s)) (def `log (cons tag log))))) (def `(t1 t2) (spawn w 1 s) (spawn w 2 "ab")) (join t1) (join t2) log)",
+                 "`(1 2 2 1)"),
+            TEST(R"(list (len (cdr (iota 600))) (len (cons 1 (iota 600))) (car (reverse (iota 600))) (len (str (iota 600))))",
+                 "`(599 601 599 2292)"),
+            TEST(R"(list (car (sort (reverse (iota 600)))) (car (sort (iota 600) >)) (vec-sum (- (sort (i64 (reverse (iota 600)))) (i64 (iota 600)))))",
+                 "`(0 599 0)"),
+            // 归并缓冲区超过临时池（测试目标缩小了VM_TMP）时改在堆外申请
+            TEST(R"(list (len (sort (reverse (iota 1200)))) (vec-sum (- (i64 (sort (reverse (iota 1200)))) (i64 (iota 1200)))))",
+                 "`(1200 0)"),
     };
     auto i = 0;
     auto failed = 0;
     std::stringstream ss;
     std::string ast, out;
     int c = 0;
+    // 表外的用例也按同样的格式逐条打印并计数，失败时附上期望
+    auto check = [&](const std::string &what, bool ok, const std::string &result, const std::string &right) {
+        std::cout << "TEST #" << (++i) << "> " << (ok ? "[PASSED] " : "[ERROR ] ") << what;
+        if (!result.empty())
+            std::cout << "  =>  " << result;
+        if (!ok) {
+            if (!right.empty())
+                std::cout << "   REQUIRE: " << right;
+            failed++;
+        }
+        std::cout << std::endl;
+    };
     for (auto &code : codes) {
         vm.save();
         try {
@@ -105,30 +260,334 @@ int main(int argc, char *argv[]) {
             auto root = p.parse(ast);
             //clib::cast::print(root, 0, std::cout);
             vm.prepare(root);
-            auto val = vm.run(INT32_MAX, c);
-            std::cout << "TEST #" << (++i) << "> ";
+            clib::cval *val;
+            while ((val = vm.run(INT32_MAX, c)) == nullptr) {
+                if (!vm.wait())
+                    std::this_thread::yield(); // pmap等待工作线程
+            }
             ss.str("");
             clib::cast::print(root, 0, ss);
             ast = ss.str();
             ss.str("");
             clib::cvm::print(val, ss);
             out = ss.str();
-            auto &right = std::get<1>(code);
-            if (out == right) {
-                std::cout << "[PASSED] " << ast << "  =>  " << out;
-            } else {
-                std::cout << "[ERROR ] " << ast << "  =>  " << out << "   REQUIRE: " << right;
-                failed++;
-            }
-            std::cout << std::endl;
+            check(ast, out == std::get<1>(code), out, std::get<1>(code));
             vm.gc();
         } catch (const std::exception &e) {
-            failed++;
-            std::cout << "TEST #" << (++i) << "> [ERROR ] " << ast << std::endl;
+            check(ast, false, "", "");
             //printf("RUNTIME ERROR: %s\n", e.what());
             vm.restore();
             vm.gc();
         }
     }
+    auto eval = [&](clib::cvm &q, const std::string &code, std::string &result) {
+        q.save();
+        try {
+            clib::cparser p;
+            q.prepare(p.parse(code));
+            clib::cval *val;
+            while ((val = q.run(INT32_MAX, c)) == nullptr) {
+                if (!q.wait())
+                    std::this_thread::yield();
+            }
+            ss.str("");
+            clib::cvm::print(val, ss);
+            result = ss.str();
+            q.gc();
+            return true;
+        } catch (const clib::cexception &e) {
+            result = e.msg;
+            q.restore();
+            q.gc();
+            return false;
+        }
+    };
+    // 在同一个cvm上依次求值，出错的用例只比较错误信息的开头
+    auto expect = [&](clib::cvm &q, const std::string &tag, const std::vector<std::tuple<std::string, std::string>> &table) {
+        for (auto &code : table) {
+            std::string result;
+            auto ok = eval(q, std::get<0>(code), result);
+            auto &right = std::get<1>(code);
+            check(tag + ": " + std::get<0>(code), ok ? result == right : result.compare(0, right.size(), right) == 0,
+                  result, right);
+        }
+    };
+    {
+        // 隔离体池：同一批代码在各工作线程上独立求值
+        clib::cvm_pool pool(4, 50);
+        std::vector<std::future<clib::cresult>> results;
+        auto pool_codes = std::vector<std::tuple<std::string, std::string>>{
+                TEST("+ 1 2", "3"),
+                TEST(R"(foldl + 0 (range 0 100))", "4950"),
+                TEST(R"(begin (def `k 0) (while (< k 200) (def `k (+ k 1))) k)", "200"),
+                TEST(R"(sort `(3 1 2))", "`(1 2 3)"),
+                TEST(R"(undefined-symbol 1)", ""),
+        };
+        for (auto &code : pool_codes) {
+            results.push_back(pool.submit(std::get<0>(code)));
+        }
+        for (size_t k = 0; k < results.size(); k++) {
+            auto r = results[k].get();
+            auto &right = std::get<1>(pool_codes[k]);
+            check("pool: " + std::get<0>(pool_codes[k]), r.ok ? r.value == right : right.empty(),
+                  r.ok ? r.value : r.error, right);
+        }
+        // 截止时刻与取消：死循环在安全点放弃，隔离体回收后可继续使用
+        clib::ccancel token;
+        auto timeout = pool.submit("while 1 1", 20);
+        auto cancelled = pool.submit("while 1 1", 0, &token);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        token.cancel();
+        auto limits = std::vector<std::tuple<std::string, clib::cresult, std::string>>{
+                std::make_tuple("timeout", timeout.get(), "deadline exceeded"),
+                std::make_tuple("cancel", cancelled.get(), "cancelled"),
+        };
+        for (auto &l : limits) {
+            auto &r = std::get<1>(l);
+            check("pool: " + std::get<0>(l), !r.ok && r.error == std::get<2>(l), r.ok ? r.value : r.error,
+                  std::get<2>(l));
+        }
+        // 等计时器而阻塞的任务被取消时立即醒来，不必睡满
+        clib::ccancel nap;
+        auto t0 = std::chrono::steady_clock::now();
+        auto napping = pool.submit("sleep 3", 0, &nap);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        nap.cancel();
+        auto woke = napping.get();
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count();
+        check("pool: cancel sleep", !woke.ok && woke.error == "cancelled" && ms < 1000,
+              (woke.ok ? woke.value : woke.error) + " in " + std::to_string(ms) + "ms", "cancelled");
+        auto reused = true;
+        for (size_t k = 0; k < pool.size(); k++) {
+            auto r = pool.submit("+ 1 2").get();
+            reused = reused && r.ok && r.value == "3";
+        }
+        check("pool: reuse after cancel", reused, "", "");
+        // 每个任务都从干净的隔离体开始，看不到之前任务的def，覆盖的内建函数也会还原
+        for (size_t k = 0; k < pool.size(); k++) {
+            pool.submit("def `leaked 1").get();
+            pool.submit("def `+ -").get();
+        }
+        auto isolated = true;
+        for (size_t k = 0; k < pool.size() * 2; k++) {
+            isolated = isolated && !pool.submit("leaked").get().ok;
+            auto r = pool.submit("+ 1 2").get();
+            isolated = isolated && r.ok && r.value == "3";
+        }
+        check("pool: isolated jobs", isolated, "", "");
+        // 单个工作线程上，死循环的任务按时间片轮转，后提交的短任务不必等它结束
+        clib::cvm_pool single(1, 50);
+        clib::ccancel spin;
+        auto spinning = single.submit("while 1 1", 0, &spin);
+        auto quick = single.submit("+ 1 2");
+        auto fair = quick.wait_for(std::chrono::seconds(2)) == std::future_status::ready && quick.get().value == "3";
+        spin.cancel();
+        fair = fair && spinning.get().error == "cancelled";
+        check("pool: time slices", fair, "", "");
+    }
+    {
+        // 配额：超限时先就地回收，仍不够则报错，restore后同一个cvm可继续使用
+        clib::cvm q;
+        // 重复def的旧值在语句中即可回收，总分配量超过上限也能完成
+        q.set_heap_limit(q.heap_used() + 700 * 1024);
+        q.set_depth_limit(64);
+        expect(q, "quota", {
+                TEST(R"(begin (def `x (iota 500)) (def `x (iota 500)) (def `x (iota 500)) (def `x (iota 500)) (def `x (iota 500)) (def `x (iota 500)) (len x))", "500"),
+                // 语句中的回收沿数据指针标记，只被闭包引用的调用环境不能被释放
+                TEST(R"(begin (def `combine (\ `f `(\ `(x y) `(if (null? x) `nil `(f (list (car x) (car y)) ((combine f) (cdr x) (cdr y))))))) (def `zip (combine cons)) nil)", "nil"),
+                TEST(R"(len (iota 100000))", "quota exceeded: heap"),
+                TEST(R"(+ 1 2)", "3"),
+                TEST(R"(zip (list 1 2) (list 3 4))", "`(`(1 3) `(2 4))"),
+                TEST(R"(begin (def `f (\ `n `(if (== n 0) 0 (+ 1 (f (- n 1)))))) (f 1000))", "quota exceeded: depth"),
+                TEST(R"(f 10)", "10"),
+                TEST(R"(begin (def `t (spawn f 1000)) (join t))", "thread 1: quota exceeded: depth"),
+                // memo的缓存不钉住堆，内存紧张时被丢弃
+                TEST(R"(begin (def `m (memo (\ `x `(iota 200)))) (dotimes (i 100) (m i)) (len (m 5)))", "200"),
+                TEST(R"(len (m 99))", "200"),
+        });
+        // 上限不按块对齐或不设上限时，报出的用量也不超过上限，并给出引发超限的申请大小
+        std::string over;
+        auto base_used = q.heap_used();
+        auto within = true;
+        for (size_t k = 0; k <= 64 && within; k++) {
+            q.set_heap_limit(k < 64 ? base_used + 300 * 1024 + k : 0); // 最后一次不设上限，按堆的总量报告
+            eval(q, "len (iota 100000)", over);
+            size_t used = 0, cap = 0;
+            auto at = over.find("(heap ");
+            within = at != std::string::npos && sscanf(over.c_str() + at, "(heap %zu/%zu", &used, &cap) == 2 &&
+                     used <= cap && over.find("need ") != std::string::npos;
+        }
+        check("quota: len (iota 100000)", within, over, "");
+    }
+    {
+        // 运行期错误：报错后同一个cvm可继续使用
+        clib::cvm q;
+        expect(q, "error", {
+                TEST(R"(/ 10 (- (index (word "ab") 0) (index (word "ab") 0)))", "divided by zero"),
+                TEST(R"(/ (index (word "ab") 0) (- (index (word "ab") 1) (index (word "ab") 1)))", "divided by zero"),
+                TEST(R"(/ 10 (index (word "ab") 0) 0)", "divided by zero"),
+                TEST(R"(/ 10 (- (index (word "ab") 1) (index (word "ab") 0)))", "10"),
+        });
+    }
+    {
+        // 复制预热好的cvm：副本带着基础环境中的定义，之后各自独立，可以交给其他线程
+        auto base = std::make_unique<clib::cvm>();
+        std::string out;
+        for (auto &code : {R"(def `k 5)", R"(def `sq (memo (\ `n `(* n n))))", R"(sq 4)", R"(def `v (i64 1 2 3))",
+                           R"(def `s (+ (str (iota 20)) (str (iota 20))))", R"(def `lz (seq-take 3 (seq-range 10)))"}) {
+            eval(*base, code, out);
+        }
+        // 出错后未被join的线程不妨碍复制
+        eval(*base, R"(begin (spawn (\ `n `(car n)) 1) (sleep 0.01) nil)", out);
+        auto probe = R"(list (+ k 1) (sq 4) (memo-stats sq) (vec-sum v) (len s) (seq->list lz))";
+        auto a = base->fork(), b = base->fork();
+        std::string expect, forked, threaded, k1, k2, k3;
+        eval(*base, probe, expect);
+        eval(*a, probe, forked);
+        std::thread([&] { eval(*b, probe, threaded); }).join();
+        eval(*a, R"(def `k 7)", out);
+        eval(*base, "k", k1);
+        base.reset();
+        eval(*a, "k", k2);
+        eval(*b, "k", k3);
+        auto fork_codes = std::vector<std::tuple<std::string, std::string, std::string>>{
+                std::make_tuple("probe", forked, expect),
+                std::make_tuple("probe in thread", threaded, expect),
+                std::make_tuple("def in fork", k1 + " " + k2 + " " + k3, "5 7 5"),
+        };
+        for (auto &f : fork_codes) {
+            check("fork: " + std::get<0>(f), std::get<1>(f) == std::get<2>(f), std::get<1>(f), std::get<2>(f));
+        }
+    }
+    {
+        // 长时间运行：反复执行的语句不能让堆持续增长，默认堆上每条都要成功
+        clib::cvm q;
+        q.set_host(&host);
+        auto reclaim_codes = std::vector<std::tuple<std::string, std::function<std::string(int)>, int, std::string>>{
+                std::make_tuple("map", [](int) { return std::string(R"(len (map (\ `x `(+ x 1)) (iota 5000)))"); }, 1,
+                                "5000"),
+                std::make_tuple("foldl", [](int) {
+                    return std::string(R"(foldl (\ `(a x) `(+ a x)) 0 (filter (\ `x `(> x 0)) (iota 5000)))");
+                }, 1, "12497500"),
+                std::make_tuple("lazy foldl", [](int) {
+                    return std::string(R"(foldl + 0 (seq-take 20000 (map (\ `x `(* x 2)) (seq-range 0))))");
+                }, 1, "399980000"),
+                std::make_tuple("seq->list", [](int) {
+                    return std::string(R"(len (seq->list (seq-take 5000 (filter (\ `x `(> x 0)) (seq-range 0)))))");
+                }, 1, "5000"),
+                std::make_tuple("pmap", [](int) { return std::string(R"(pmap (\ `x `(+ x 1)) (iota 8))"); }, 1000,
+                                "`(1 2 3 4 5 6 7 8)"),
+                std::make_tuple("detach", [](int) { return std::string(R"(detach (spawn (\ `n `(iota n)) 100))"); },
+                                2000, "nil"),
+                std::make_tuple("same lambda", [](int) { return std::string(R"((\ `x `(+ x 1)))"); }, 3000,
+                                R"(<lambda `x `(+ x 1)>)"),
+                std::make_tuple("distinct lambdas", [](int k) {
+                    return R"((\ `x `(+ x )" + std::to_string(k) + "))";
+                }, 2000, R"(<lambda `x `(+ x 1999)>)"),
+                std::make_tuple("interned lambdas", [](int k) {
+                    return R"(def `f)" + std::to_string(k) + R"( (\ `x `(+ x 1)))";
+                }, 3000, R"(<lambda `x `(+ x 1)>)"),
+                std::make_tuple("dotimes", [](int) { return std::string(R"(dotimes (i 50000) i)"); }, 1, "nil"),
+                std::make_tuple("while", [](int) {
+                    return std::string(R"(begin (def `k 0) (while (< k 30000) (def `k (+ k 1))) k)");
+                }, 1, "30000"),
+                std::make_tuple("do", [](int) {
+                    return std::string(R"(begin (def `k 0) (do (def `k (+ k 1)) (list k k) (< k 30000)))");
+                }, 1, "`(30000 30000)"),
+        };
+        for (auto &r : reclaim_codes) {
+            std::string out;
+            auto ok = true;
+            for (auto k = 0; ok && k < std::get<2>(r); k++) {
+                ok = eval(q, std::get<1>(r)(k), out);
+            }
+            check("reclaim: " + std::get<0>(r), ok && out == std::get<3>(r), out, std::get<3>(r));
+        }
+    }
+    {
+        // pmap的语句出错时取消尚未完成的块，工作线程随即空出
+        clib::cvm q;
+        q.set_host(&host);
+        std::string out, after;
+        q.set_deadline(50);
+        eval(q, R"(pmap (\ `x `(while 1 1)) (iota 8))", out);
+        q.set_deadline(0);
+        eval(q, R"(pmap (\ `x `(+ x 1)) (iota 4))", after);
+        check("pmap: cancel chunks", out == "deadline exceeded" && after == "`(1 2 3 4)", out + ", " + after,
+              "deadline exceeded, `(1 2 3 4)");
+    }
+    {
+        // 等通道的上下文不再被反复调用，wait经宿主阻塞，其他cvm收发时被唤醒
+        auto base = std::make_unique<clib::cvm>();
+        std::string out, got;
+        eval(*base, R"(def `c (chan 1))", out);
+        auto a = base->fork();
+        auto spins = 0, cycles = 0;
+        std::thread receiver([&] {
+            clib::cparser p;
+            a->prepare(p.parse(R"(begin (spawn (\ `n `(begin (sleep n) (send c 1))) 0.05) (+ (recv c) (recv c)))"));
+            clib::cval *val;
+            while ((val = a->run(INT32_MAX, cycles)) == nullptr) {
+                if (!a->wait())
+                    spins++;
+            }
+            std::stringstream rs;
+            clib::cvm::print(val, rs);
+            got = rs.str();
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        eval(*base, R"(send c 2)", out);
+        receiver.join();
+        check("chan: park", got == "3" && spins == 0 && cycles < 1000,
+              got + " in " + std::to_string(cycles) + " cycles, " + std::to_string(spins) + " spins", "");
+        // join在目标结束前不再被调用，只多出spawn与join本身的几步
+        clib::cvm q;
+        auto cost = [&](const std::string &code) {
+            auto before = c;
+            eval(q, code, out);
+            return c - before;
+        };
+        auto alone = cost(R"(dotimes (i 20000) i)");
+        auto joined = cost(R"(join (spawn (\ `n `(dotimes (i n) i)) 20000))");
+        check("thread: park join", out == "nil" && joined - alone < 50,
+              out + " in " + std::to_string(joined) + " cycles, " + std::to_string(alone) + " alone", "");
+    }
+    {
+        // 分块的内建函数：每次run只给一个周期即只走一步，长表上的构造、复制、排序与输出比短表多走若干块
+        clib::cvm q;
+        std::string out;
+        eval(q, R"(def `xs (reverse (iota 2000)))", out);
+        eval(q, R"(def `ys (reverse (iota 2)))", out);
+        auto steps = [&](const std::string &code, std::string &result) {
+            clib::cparser p;
+            q.prepare(p.parse(code));
+            clib::cval *val;
+            auto runs = 0;
+            while ((val = q.run(1, c)) == nullptr)
+                runs++;
+            ss.str("");
+            clib::cvm::print(val, ss);
+            result = ss.str();
+            q.gc();
+            return runs;
+        };
+        auto chunk_codes = std::vector<std::tuple<std::string, std::string, std::string>>{
+                std::make_tuple(R"(len (iota 2000))", R"(len (iota 2))", "2000"),
+                std::make_tuple(R"(len (range 0 2000))", R"(len (range 0 2))", "2000"),
+                std::make_tuple(R"(car (reverse xs))", R"(car (reverse ys))", "0"),
+                std::make_tuple(R"(len (cdr xs))", R"(len (cdr ys))", "1999"),
+                std::make_tuple(R"(len (cons 1 xs))", R"(len (cons 1 ys))", "2001"),
+                std::make_tuple(R"(len (str xs))", R"(len (str ys))", "8892"),
+                std::make_tuple(R"(car (sort xs))", R"(car (sort ys))", "0"),
+                std::make_tuple(R"(vec-sum (sort (i64 xs)))", R"(vec-sum (sort (i64 ys)))", "1999000"),
+        };
+        for (auto &code : chunk_codes) {
+            std::string small;
+            auto base = steps(std::get<1>(code), small);
+            auto runs = steps(std::get<0>(code), out);
+            check("chunk: " + std::get<0>(code), out == std::get<2>(code) && runs - base >= 2000 / VM_CHUNK - 1,
+                  out + " in " + std::to_string(runs) + " steps", std::get<2>(code));
+        }
+    }
     std::cout << "==== ALL TEST PASSED [" << (i - failed) << "/" << i << "] ====" << std::endl;
 }